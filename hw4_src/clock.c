@@ -0,0 +1,269 @@
+/*******************************************************************************
+* Timing Benchmark
+*
+* Description:
+*     Checks the TSC calibration of timelib and compares its TSC-based
+*     primitives with the clock_gettime()-based ones. First, the frequency
+*     found by tsc_calibrate() is checked by hand, by counting the clocks
+*     elapsed across a sleep of known length. Then, the cost of reading the
+*     time is measured for clock_gettime(), tsc_now_ns() and RDTSCP alone:
+*     one such read is what every iteration of a busywait loop costs. Then,
+*     both busywait_timespec() and busywait_ns() are asked to wait for a
+*     range of lengths, and the time they actually took is measured. Last,
+*     sleeping (nanosleep()), busywaiting (busywait_ns()) and the hybrid of
+*     the two (hybridwait_ns()) wait for the same sequence of many random
+*     lengths, and the distribution of their errors is compared along with
+*     the CPU time they burn.
+*
+* Usage:
+*     <build directory>/clock [-n <waits per length>] [-i <reads per clock>]
+*                             [-r <random waits>]
+*
+* Notes:
+*     The error of a wait is the time it took, as seen by CLOCK_MONOTONIC
+*     around the call, minus the length asked for. The lines of the third
+*     part give its median, mean and maximum, in nanoseconds. Random
+*     lengths are spread evenly on a logarithmic scale between
+*     RANDOM_MIN_NS and RANDOM_MAX_NS. For each way of waiting, the last
+*     part gives the share of the wall-clock time spent on the CPU, the
+*     median, 99th percentile and maximum error, and then a histogram of
+*     the errors in power-of-two buckets.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* Wait lengths tried, in nanoseconds */
+static const uint64_t lengths_ns[] = { 1000, 10000, 100000, 1000000, 10000000 };
+#define NUM_LENGTHS (sizeof(lengths_ns) / sizeof(lengths_ns[0]))
+
+/* Range of the random wait lengths (10 us to 10 ms) */
+#define RANDOM_MIN_NS 10000.0
+#define RANDOM_MAX_NS 10000000.0
+
+/* Histogram buckets: early wake-ups, then bucket i holds errors below
+ * 2^(i + 7) ns, then everything from 2^(HIST_BUCKETS + 5) ns on */
+#define HIST_BUCKETS 18
+
+/* Ways of waiting compared on random lengths */
+#define WAIT_SLEEP  0
+#define WAIT_BUSY   1
+#define WAIT_HYBRID 2
+#define NUM_WAITS   3
+static const char * wait_names[NUM_WAITS] = { "sleep", "busywait", "hybrid" };
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TSPEC_TO_NSEC(now);
+}
+
+/* Average cost of one read of each clock, in nanoseconds */
+static void bench_reads(uint64_t iterations)
+{
+	volatile uint64_t sink = 0;
+	uint64_t start, clocks, i;
+
+	start = monotonic_ns();
+	for (i = 0; i < iterations; i++)
+		sink += monotonic_ns();
+	printf("clock_gettime %.1f\n", (double)(monotonic_ns() - start) / iterations);
+
+	start = monotonic_ns();
+	for (i = 0; i < iterations; i++)
+		sink += tsc_now_ns();
+	printf("tsc_now_ns %.1f\n", (double)(monotonic_ns() - start) / iterations);
+
+	start = monotonic_ns();
+	for (i = 0; i < iterations; i++) {
+		get_clocks_ordered(clocks);
+		sink += clocks;
+	}
+	printf("rdtscp %.1f\n", (double)(monotonic_ns() - start) / iterations);
+	(void)sink;
+}
+
+static int cmp_i64(const void * a, const void * b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Error of <waits> waits of <length_ns> with either primitive. <errors>
+ * has room for all of them. An error is negative if the wait ended
+ * early. */
+static void bench_waits(uint64_t length_ns, int waits, int use_tsc, int64_t * errors)
+{
+	uint64_t start;
+	int64_t sum = 0;
+	int i;
+
+	for (i = 0; i < waits; i++) {
+		start = monotonic_ns();
+		if (use_tsc)
+			busywait_ns(length_ns);
+		else
+			busywait_timespec(NSEC_TO_TSPEC(length_ns));
+		errors[i] = (int64_t)(monotonic_ns() - start - length_ns);
+		sum += errors[i];
+	}
+
+	/* Preemptions show up in the mean and the maximum, but hardly
+	 * move the median */
+	qsort(errors, waits, sizeof(int64_t), cmp_i64);
+	printf(" %ld %.0f %ld", errors[waits / 2], (double)sum / waits, errors[waits - 1]);
+}
+
+static inline uint64_t thread_cpu_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return TSPEC_TO_NSEC(now);
+}
+
+/* Bucket of the histogram error <error> falls in */
+static int hist_bucket(int64_t error)
+{
+	int bucket = 1;
+
+	if (error < 0)
+		return 0;
+	while (bucket < HIST_BUCKETS - 1 && error >= (int64_t)1 << (bucket + 7))
+		bucket++;
+	return bucket;
+}
+
+/* Wait for the <count> <lengths> one after the other in the way <how>,
+ * and count the errors in <hist>. <errors> has room for all of them. */
+static void bench_random(int how, const uint64_t * lengths, int count,
+			 int64_t * errors, uint64_t * hist)
+{
+	uint64_t start, cpu_start, wall, cpu;
+	int i;
+
+	cpu_start = thread_cpu_ns();
+	wall = 0;
+	for (i = 0; i < count; i++) {
+		start = monotonic_ns();
+		if (how == WAIT_SLEEP)
+			get_elapsed_sleep(lengths[i] / NANO_IN_SEC, lengths[i] % NANO_IN_SEC);
+		else if (how == WAIT_BUSY)
+			busywait_ns(lengths[i]);
+		else
+			hybridwait_ns(lengths[i]);
+		errors[i] = (int64_t)(monotonic_ns() - start - lengths[i]);
+		wall += errors[i] + lengths[i];
+		hist[hist_bucket(errors[i])]++;
+	}
+	cpu = thread_cpu_ns() - cpu_start;
+
+	qsort(errors, count, sizeof(int64_t), cmp_i64);
+	printf("%s %.1f %ld %ld %ld\n", wait_names[how], 100.0 * cpu / wall,
+	       errors[count / 2], errors[(int)(count * 0.99)], errors[count - 1]);
+}
+
+int main (int argc, char ** argv)
+{
+	uint64_t iterations = 1000000, clocks, * random_ns, hist[NUM_WAITS][HIST_BUCKETS];
+	int64_t * errors;
+	int waits = 100, random_waits = 1000, opt, how;
+	unsigned i, seed = 1;
+
+	while ((opt = getopt(argc, argv, "n:i:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			waits = atoi(optarg);
+			break;
+		case 'i':
+			iterations = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			random_waits = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n <waits per length>] "
+				"[-i <reads per clock>] [-r <random waits>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (waits <= 0 || iterations == 0 || random_waits <= 0) {
+		fprintf(stderr, "All parameters must be greater than 0.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (tsc_calibrate() == 0) {
+		printf("# TSC unusable, the TSC-based primitives fall back to clock_gettime()\n");
+	} else {
+		/* 100 ms worth of clocks, measured by hand */
+		clocks = get_elapsed_sleep(0, 100 * 1000 * 1000);
+		printf("# TSC calibrated at %.3f MHz, counted by hand at %.3f MHz\n",
+		       (double)tsc_cal.hz / 1000000, (double)clocks / 100000);
+	}
+
+	printf("# clock ns/read\n");
+	bench_reads(iterations);
+
+	errors = (int64_t *)malloc(((waits > random_waits) ? waits : random_waits) * sizeof(int64_t));
+	if (errors == NULL) {
+		perror("Unable to allocate the errors");
+		return EXIT_FAILURE;
+	}
+
+	printf("# length_ns gettime_median_err gettime_mean_err gettime_max_err "
+	       "tsc_median_err tsc_mean_err tsc_max_err\n");
+	for (i = 0; i < NUM_LENGTHS; i++) {
+		printf("%lu", lengths_ns[i]);
+		bench_waits(lengths_ns[i], waits, 0, errors);
+		bench_waits(lengths_ns[i], waits, 1, errors);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	/* The same lengths for every way of waiting */
+	random_ns = (uint64_t *)malloc(random_waits * sizeof(uint64_t));
+	if (random_ns == NULL) {
+		perror("Unable to allocate the random lengths");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < (unsigned)random_waits; i++)
+		random_ns[i] = (uint64_t)(RANDOM_MIN_NS * pow(RANDOM_MAX_NS / RANDOM_MIN_NS,
+							      (double)rand_r(&seed) / RAND_MAX));
+
+	memset(hist, 0, sizeof(hist));
+	printf("# method cpu_pct median_err p99_err max_err\n");
+	for (how = 0; how < NUM_WAITS; how++) {
+		bench_random(how, random_ns, random_waits, errors, hist[how]);
+		fflush(stdout);
+	}
+	printf("# hybrid margin settled at %lu ns\n", hybridwait_margin_ns());
+
+	printf("# error_ns sleep busywait hybrid\n");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (i == 0)
+			printf("<0");
+		else if (i == HIST_BUCKETS - 1)
+			printf(">=%lu", (uint64_t)1 << (i + 6));
+		else
+			printf("<%lu", (uint64_t)1 << (i + 7));
+		for (how = 0; how < NUM_WAITS; how++)
+			printf(" %lu", hist[how][i]);
+		printf("\n");
+	}
+
+	free(random_ns);
+	free(errors);
+
+	return EXIT_SUCCESS;
+}
@@ -2,6 +2,9 @@
 
 */
 
+#ifndef COMMON_H
+#define COMMON_H
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -36,6 +39,14 @@
 #define TSPEC_TO_DOUBLE(spec)				\
     ((double)(spec.tv_sec) + (double)(spec.tv_nsec)/NANO_IN_SEC)
 
+/* Same as above, but to an integer number of nanoseconds */
+#define TSPEC_TO_NSEC(spec)				\
+    ((uint64_t)(spec.tv_sec) * NANO_IN_SEC + (uint64_t)(spec.tv_nsec))
+
+/* And back, from an integer number of nanoseconds */
+#define NSEC_TO_TSPEC(ns)						\
+    ((struct timespec){ .tv_sec = (ns) / NANO_IN_SEC, .tv_nsec = (ns) % NANO_IN_SEC })
+
 /* Request payload as sent by the client and received by the
  * server. */
 struct request {
@@ -51,3 +62,95 @@ struct response {
 	uint8_t status;
 };
 
+/* Version 2 of the protocol. A client opts in by sending a frame
+ * header as the very first bytes of the connection: the server tells
+ * the two versions apart from the magic number, which legacy clients
+ * never send since the low half of their first request ID is 0. From
+ * then on, the client sends frames made of a header followed by
+ * <count> compact requests, with all the times in nanoseconds. */
+#define PROTO_V2_MAGIC    0x32564d48 /* "HMV2" */
+#define PROTO_V2_VERSION  2
+
+/* Frame flag: the responses to the requests of the frame carry the
+ * time the server received, started and completed them. Response
+ * flag: the timestamps follow. */
+#define PROTO_V2_TIMING   0x01
+
+/* Frame flag: the requests of the frame are image operations, sent
+ * as struct request_op instead of struct request_v2 */
+#define PROTO_V2_OPS      0x02
+
+/* Frame flag: the frame uploads an image. Its count must be 1, and
+ * its only request is a struct image_upload followed by the
+ * <width> * <height> pixels. The response carries the handle that
+ * operations name the image with from then on, or is a rejection if
+ * the server has no room for the image. */
+#define PROTO_V2_UPLOAD   0x04
+
+struct frame_v2 {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t flags;
+	uint16_t count;
+};
+
+struct request_v2 {
+	uint64_t req_id;
+	uint64_t sent_ns;
+	uint64_t length_ns;
+};
+
+/* Operations on the images of a connection, which are 8-bit
+ * grayscale, one byte per pixel, row after row */
+#define IMG_OP_NONE      0
+#define IMG_OP_BLUR      1 /* 3x3 box blur */
+#define IMG_OP_SHARPEN   2 /* 3x3 Laplacian sharpening */
+#define IMG_OP_SOBEL     3 /* Sobel edge magnitude, |Gx| + |Gy| */
+#define IMG_OP_ROTATE    4 /* Rotation by 90 degrees clockwise */
+#define IMG_OP_EQUALIZE  5 /* Histogram equalization */
+#define IMG_NUM_OPS      6
+
+/* Largest width and height of an image, and most images stored per
+ * connection */
+#define IMG_MAX_DIM      4096
+#define IMG_MAX_IMAGES   16
+
+/* Request to run operation <op> on the image with handle <image>.
+ * The server schedules it as if it took <length_ns>, which is only
+ * an estimate: the response tells how long it actually took. */
+struct request_op {
+	uint64_t req_id;
+	uint64_t sent_ns;
+	uint64_t length_ns;
+	uint32_t image;
+	uint16_t op;
+	uint16_t reserved;
+};
+
+struct image_upload {
+	uint64_t req_id;
+	uint32_t width;
+	uint32_t height;
+};
+
+/* Response in version 2. The first RESP_V2_BASE_SIZE bytes match a
+ * version 1 response, and the timestamps (CLOCK_MONOTONIC) follow
+ * only if <flags> says so. For a rejected request, completion is the
+ * time of the rejection, and start is 0 unless it was in the queue. */
+struct response_v2 {
+	uint64_t req_id;
+	uint8_t status;
+	uint8_t flags;
+	uint8_t reserved[2];
+	/* Handle of the image stored by an upload */
+	uint32_t image;
+	uint64_t receipt_ns;
+	uint64_t start_ns;
+	uint64_t completion_ns;
+};
+
+#define RESP_V2_BASE_SIZE  16
+#define RESP_V2_SIZE(resp)						\
+	(((resp)->flags & PROTO_V2_TIMING) ? sizeof(struct response_v2) : RESP_V2_BASE_SIZE)
+
+#endif
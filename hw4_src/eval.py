@@ -1,3 +1,5 @@
+import argparse
+
 # Function to process the output and separate it into T0 and T1
 def separate_worker_output(filename):
     t0_output = []
@@ -19,14 +21,28 @@ def separate_worker_output(filename):
 
     return t0_output, t1_output
 
+#Timestamp field of a T or X line, in seconds. Servers run with -N
+#print integer nanoseconds instead of seconds with six decimals.
+def timestamp(field):
+    field = field.strip()
+    if "." in field:
+        return float(field)
+    return int(field) / 1e9
+
+#Completion time of a T line, or rejection time of an X line. T lines
+#of a server run with -T carry the kernel receipt time after it.
+def endTimestamp(line):
+    fields = line.split(",")
+    return timestamp(fields[4] if line.startswith("T") else fields[-1])
+
 # Print the separated output
 def parse(output):
-    initialTime = (output[0].split(","))[2]
-    endTime = (output[-1].split(","))[-1]
-    totalTime = float(endTime) - float(initialTime)
+    initialTime = timestamp((output[0].split(","))[2])
+    endTime = endTimestamp(output[-1])
+    totalTime = endTime - initialTime
     timeBusy = 0
     for line in output:
-        timeBusy += float((line.split(","))[1])
+        timeBusy += timestamp((line.split(","))[1])
     return timeBusy / totalTime
 
 #Calculate average response times for n number of threads 
@@ -40,13 +56,50 @@ def avgResponseTime(files):
             for line in lines:
                 # Skip lines starting with "Q:"
                 if not line.startswith("Q:"):
-                    completion_ts = float(line.split(",")[-1])
-                    sent_ts = float(line.split(",")[0].split(":")[-1])
+                    completion_ts = endTimestamp(line)
+                    sent_ts = timestamp(line.split(",")[0].split(":")[-1])
                     totalResponseTime += (completion_ts - sent_ts)
                     numRequests += 1
         averageResponseTimes.append(totalResponseTime/numRequests)
     return averageResponseTimes
 
+#Calculate the average time requests spend between being received
+#and starting service, which at low load is the worker wakeup latency
+def avgDispatchDelay(files):
+    averageDelays = []
+    for file in files:
+        totalDelay = 0
+        numRequests = 0
+        with open(file, 'r') as file:
+            lines = file.readlines()
+            for line in lines:
+                if line.startswith("T"):
+                    receipt_ts = timestamp(line.split(",")[2])
+                    start_ts = timestamp(line.split(",")[3])
+                    totalDelay += (start_ts - receipt_ts)
+                    numRequests += 1
+        averageDelays.append(totalDelay/numRequests)
+    return averageDelays
+
+#Calculate the pct-th percentile of the response times for each file
+#(e.g. pct = 99 for p99), to compare scheduling policies
+def percentileResponseTime(files, pct):
+    percentiles = []
+    for file in files:
+        responseTimes = []
+        with open(file, 'r') as file:
+            lines = file.readlines()
+            for line in lines:
+                # Only completed requests carry a response time
+                if line.startswith("T"):
+                    completion_ts = endTimestamp(line)
+                    sent_ts = timestamp(line.split(",")[0].split(":")[-1])
+                    responseTimes.append(completion_ts - sent_ts)
+        responseTimes.sort()
+        index = max(0, int(round(pct / 100 * len(responseTimes))) - 1)
+        percentiles.append(responseTimes[index])
+    return percentiles
+
 #Calculate rejection rates
 def numRejects(files):
     rejections = []
@@ -61,6 +114,13 @@ def numRejects(files):
     return rejections
 
 def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--pct", type=float, metavar="PCT",
+                        help="print the PCT-th percentile response time of each run, e.g. 99")
+    parser.add_argument("--dispatch", action="store_true",
+                        help="print the average dispatch delay of each run")
+    args = parser.parse_args()
+
     # Specify the filename of the text file containing the output
     filename = 'part1b.txt'
     utilization = []
@@ -74,6 +134,10 @@ def main():
     #used for avgResponseTime() and part1b.txt contains output for when w = 2
     files = ['part1b.txt', 'w4.txt', 'w6.txt', 'w8.txt']
     # print(avgResponseTime(files))
+    if args.pct is not None:
+        print(percentileResponseTime(files, args.pct))
+    if args.dispatch:
+        print(avgDispatchDelay(files))
 
     #used for part d/ reject files
     rejectFiles = ['part1d-1.txt', 'part1d-2.txt']
@@ -0,0 +1,201 @@
+/*******************************************************************************
+* Asynchronous Binary Event Log (implementation)
+*
+* Description:
+*     Per-thread rings of binary event records drained to a file by a
+*     background writer thread. See evlog.h for the interface.
+*
+* Notes:
+*     The writer hands every contiguous run of records it finds in a ring
+*     to a single write() and only then returns the slots to the producer,
+*     so records are never copied on their way to the file. When all the
+*     rings are empty it naps for EVLOG_NAP_NS instead of being woken up,
+*     which keeps producers free of any system call.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evlog.h"
+
+/* How long the writer sleeps when it finds nothing to write */
+#define EVLOG_NAP_NS (1000 * 1000)
+
+/* Write <len> bytes from <buf>, retrying after short writes. Returns
+ * 0 on success, -1 on failure. */
+static int write_all(int fd, const void * buf, size_t len)
+{
+	const uint8_t * ptr = (const uint8_t *)buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, ptr, len);
+		if (ret < 0)
+			return -1;
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Write out whatever <ring> holds. Returns the number of records. */
+static uint64_t evlog_drain(struct evlog * log, struct evlog_ring * ring)
+{
+	uint64_t start = ring->head, head = start;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t run;
+
+	while (head != tail) {
+		/* Up to the end of the ring or to the tail, whichever
+		 * comes first */
+		run = ring->mask + 1 - (head & ring->mask);
+		if (run > tail - head)
+			run = tail - head;
+
+		/* On failure the records are lost, but the producer
+		 * must not be kept waiting for room forever */
+		if (write_all(log->fd, &ring->recs[head & ring->mask], run * sizeof(struct evlog_rec)) < 0)
+			perror("Unable to write the event log");
+
+		head += run;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+
+	return head - start;
+}
+
+/* Main logic of the writer thread */
+static int evlog_writer_main(void * arg)
+{
+	struct evlog * log = (struct evlog *)arg;
+	struct timespec nap = { 0, EVLOG_NAP_NS };
+	uint64_t written;
+	int i, done;
+
+	do {
+		/* Read the flag first, so that the last pass is
+		 * guaranteed to see every record appended before it */
+		done = __atomic_load_n(&log->done, __ATOMIC_ACQUIRE);
+
+		written = 0;
+		for (i = 0; i < log->num_rings; i++)
+			written += evlog_drain(log, &log->rings[i]);
+		log->written += written;
+
+		if (written == 0 && !done)
+			nanosleep(&nap, NULL);
+	} while (!done || written != 0);
+
+	return EXIT_SUCCESS;
+}
+
+int evlog_open(struct evlog * log, const char * path, int num_rings, size_t ring_size)
+{
+	uint64_t size = 1;
+	int i;
+
+	while (size < ring_size)
+		size <<= 1;
+
+	memset(log, 0, sizeof(struct evlog));
+	log->num_rings = num_rings;
+	log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (log->fd < 0)
+		return -1;
+
+	if (posix_memalign((void **)&log->rings, CACHE_LINE_SIZE,
+			   num_rings * sizeof(struct evlog_ring)))
+		goto err_close;
+	memset(log->rings, 0, num_rings * sizeof(struct evlog_ring));
+
+	for (i = 0; i < num_rings; i++) {
+		log->rings[i].id = i;
+		log->rings[i].mask = size - 1;
+		if (posix_memalign((void **)&log->rings[i].recs, CACHE_LINE_SIZE,
+				   size * sizeof(struct evlog_rec)))
+			goto err_free;
+	}
+
+	if (worker_thread_start(&log->writer, evlog_writer_main, log, -1) < 0)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	for (i = 0; i < num_rings; i++)
+		free(log->rings[i].recs);
+	free(log->rings);
+err_close:
+	close(log->fd);
+	return -1;
+}
+
+void evlog_close(struct evlog * log)
+{
+	int i;
+
+	__atomic_store_n(&log->done, 1, __ATOMIC_RELEASE);
+	worker_thread_join(&log->writer);
+
+	for (i = 0; i < log->num_rings; i++)
+		free(log->rings[i].recs);
+	free(log->rings);
+	close(log->fd);
+}
+
+/* Next free slot of <ring>, waiting for the writer if there is none */
+static inline struct evlog_rec * evlog_slot(struct evlog_ring * ring, uint64_t pos)
+{
+	if (pos - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask) {
+		ring->stalls++;
+		while (pos - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+			sched_yield();
+	}
+
+	return &ring->recs[pos & ring->mask];
+}
+
+void evlog_append(struct evlog_ring * ring, const struct evlog_rec * rec)
+{
+	uint64_t pos = ring->tail;
+	struct evlog_rec * slot = evlog_slot(ring, pos);
+
+	*slot = *rec;
+	slot->ring = ring->id;
+	__atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+void evlog_append_ids(struct evlog_ring * ring, const uint64_t * ids, uint32_t count)
+{
+	uint64_t pos = ring->tail;
+	struct evlog_rec * slot;
+	uint32_t i, n;
+
+	slot = evlog_slot(ring, pos++);
+	slot->type = EVLOG_QUEUE;
+	slot->ring = ring->id;
+	slot->arg = count;
+
+	for (i = 0; i < count; i += n) {
+		n = (count - i < EVLOG_WORDS) ? count - i : EVLOG_WORDS;
+		/* Publish what we have so far if the ring is full, so
+		 * that the writer can make room */
+		if (pos - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+			__atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+		slot = evlog_slot(ring, pos++);
+		slot->type = EVLOG_IDS;
+		slot->ring = ring->id;
+		slot->arg = n;
+		memcpy(slot->data, &ids[i], n * sizeof(uint64_t));
+	}
+
+	__atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,97 @@
+/*******************************************************************************
+* Asynchronous Binary Event Log (header)
+*
+* Description:
+*     A low-overhead replacement for printing one formatted line per event
+*     under a global lock. Every thread that produces events owns a
+*     single-producer/single-consumer ring of fixed-size binary records, and
+*     a background writer thread drains all the rings to a file. Producers
+*     never take a lock nor make a system call: appending a record is a copy
+*     and a store-release of the ring tail.
+*
+* Notes:
+*     Records of different rings end up interleaved in the file in the order
+*     the writer drains them. Every record carries the index of its ring, and
+*     records of the same ring are in the order they were appended, so a
+*     reader can restore a global order by merging the rings on timestamps
+*     (see evlog_decode.c). If a ring fills up, its producer waits for the
+*     writer rather than losing events.
+*
+*******************************************************************************/
+
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mpmc.h"
+#include "worker_thread.h"
+
+/* Record types, named after the line they stand for in the text log */
+#define EVLOG_DONE   'T' /* A request was completed */
+#define EVLOG_REJECT 'X' /* A request was rejected */
+#define EVLOG_QUEUE  'Q' /* Queue status, followed by EVLOG_IDS records */
+#define EVLOG_IDS    'I' /* Continuation of EVLOG_QUEUE */
+
+/* Number of 64-bit payload words in a record */
+#define EVLOG_WORDS 7
+
+/* Default number of records in every ring */
+#define EVLOG_RING_SIZE (16 * 1024)
+
+/* One record, exactly one cache line. All timestamps are in
+ * nanoseconds of CLOCK_MONOTONIC.
+ *   EVLOG_DONE:   arg = worker; data = request ID, sent, length,
+ *                 receipt, start, completion, kernel receipt (0 if
+ *                 unknown)
+ *   EVLOG_REJECT: data = request ID, sent, length, rejection
+ *   EVLOG_QUEUE:  arg = number of queued request IDs, which follow in
+ *                 as many EVLOG_IDS records as needed
+ *   EVLOG_IDS:    data = up to EVLOG_WORDS request IDs */
+struct evlog_rec {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t ring;
+	uint32_t arg;
+	uint64_t data[EVLOG_WORDS];
+};
+
+struct evlog_ring {
+	/* Written by the writer thread only */
+	uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Written by the producer only */
+	uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t stalls;
+	/* Read-only after initialization */
+	struct evlog_rec * recs __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t mask;
+	uint16_t id;
+};
+
+struct evlog {
+	int fd;
+	int num_rings;
+	struct evlog_ring * rings;
+	volatile int done;
+	uint64_t written;
+	struct worker_thread writer;
+};
+
+/* Create the file at <path> and start a writer thread draining
+ * <num_rings> rings of at least <ring_size> records each. Returns 0 on
+ * success, -1 on failure. */
+int evlog_open(struct evlog * log, const char * path, int num_rings, size_t ring_size);
+
+/* Wait for the writer to drain every ring, stop it and close the file.
+ * No record may be appended concurrently. */
+void evlog_close(struct evlog * log);
+
+/* Append a copy of <rec> to <ring>. Only one thread may append to a
+ * given ring. */
+void evlog_append(struct evlog_ring * ring, const struct evlog_rec * rec);
+
+/* Append an EVLOG_QUEUE record for the <count> request IDs in <ids> */
+void evlog_append_ids(struct evlog_ring * ring, const uint64_t * ids, uint32_t count);
+
+#endif
@@ -0,0 +1,191 @@
+/*******************************************************************************
+* Event Log Decoder
+*
+* Description:
+*     Turns a binary event log written by server_multi -o into the same text
+*     the server prints when it logs to standard output, i.e. one T line per
+*     completed request followed by the Q line with the status of the queue,
+*     and one X line per rejected request, so that the usual scripts (e.g.
+*     eval.py) can process it.
+*
+* Usage:
+*     <build directory>/evlog_decode [-n] <log file>
+*
+* Notes:
+*     Every thread writes to its own ring, and the rings end up interleaved
+*     in the file in no particular order. Events are put back in order by
+*     merging the rings on the time of the event: completion for T lines
+*     and rejection for X lines. Q lines stick to the T line before them.
+*     With -n, timestamps are printed as integer nanoseconds, like the
+*     server does with -N.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "evlog.h"
+
+/* Number of distinct ring IDs that fit in a record */
+#define MAX_RINGS 65536
+
+/* The records of one ring, in the order they were appended */
+struct ring_recs {
+	struct evlog_rec ** recs;
+	size_t count;
+	size_t next;
+};
+
+/* Print timestamps as integer nanoseconds (-n) */
+static int print_nsec = 0;
+
+/* Print timestamp <t> followed by <sep>, like the server does */
+static void print_time(nstime_t t, const char * sep)
+{
+	if (print_nsec)
+		printf("%lu%s", t, sep);
+	else
+		printf("%.6f%s", nstime_to_double(t), sep);
+}
+
+/* Time of the event that starts at <rec> */
+static uint64_t event_time(struct evlog_rec * rec)
+{
+	if (rec->type == EVLOG_DONE)
+		return rec->data[5];
+	if (rec->type == EVLOG_REJECT)
+		return rec->data[3];
+	return 0;
+}
+
+/* Print the record at the head of <ring>, along with the queue status
+ * that follows it, if any */
+static void print_event(struct ring_recs * ring)
+{
+	struct evlog_rec * rec = ring->recs[ring->next++];
+	uint32_t i, left;
+
+	switch (rec->type) {
+	case EVLOG_DONE:
+		printf("T%u R%lu:", rec->arg, rec->data[0]);
+		for (i = 1; i < 5; i++)
+			print_time(rec->data[i], ",");
+		/* Kernel receipt, if the server recorded it */
+		if (rec->data[6]) {
+			print_time(rec->data[5], ",");
+			print_time(rec->data[6], "\n");
+		} else {
+			print_time(rec->data[5], "\n");
+		}
+		break;
+	case EVLOG_REJECT:
+		printf("X%lu:", rec->data[0]);
+		print_time(rec->data[1], ",");
+		print_time(rec->data[2], ",");
+		print_time(rec->data[3], "\n");
+		break;
+	case EVLOG_QUEUE:
+		/* Not preceded by an event: print it on its own */
+		ring->next--;
+		break;
+	default:
+		fprintf(stderr, "Skipping record of unknown type %d\n", rec->type);
+		return;
+	}
+
+	while (ring->next < ring->count && ring->recs[ring->next]->type == EVLOG_QUEUE) {
+		left = ring->recs[ring->next++]->arg;
+		printf("Q:[");
+		while (left > 0 && ring->next < ring->count &&
+		       ring->recs[ring->next]->type == EVLOG_IDS) {
+			rec = ring->recs[ring->next++];
+			for (i = 0; i < rec->arg && left > 0; i++, left--)
+				printf((left > 1) ? "R%lu," : "R%lu", rec->data[i]);
+		}
+		printf("]\n");
+	}
+}
+
+int main (int argc, char ** argv)
+{
+	struct ring_recs * rings;
+	struct evlog_rec * recs;
+	struct stat st;
+	size_t count, i;
+	int num_rings = 0, r, best, opt;
+	FILE * file;
+
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		switch (opt) {
+		case 'n':
+			print_nsec = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n] <log file>\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-n] <log file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	file = fopen(argv[optind], "rb");
+	if (file == NULL || fstat(fileno(file), &st) < 0) {
+		perror("Unable to open the event log");
+		return EXIT_FAILURE;
+	}
+
+	count = st.st_size / sizeof(struct evlog_rec);
+	recs = (struct evlog_rec *)malloc(count * sizeof(struct evlog_rec) + 1);
+	if (fread(recs, sizeof(struct evlog_rec), count, file) != count) {
+		perror("Unable to read the event log");
+		return EXIT_FAILURE;
+	}
+	fclose(file);
+
+	/* Split the records by ring */
+	rings = (struct ring_recs *)calloc(MAX_RINGS, sizeof(struct ring_recs));
+	for (i = 0; i < count; i++) {
+		rings[recs[i].ring].count++;
+		if (recs[i].ring >= num_rings)
+			num_rings = recs[i].ring + 1;
+	}
+	for (r = 0; r < num_rings; r++) {
+		rings[r].recs = (struct evlog_rec **)malloc(rings[r].count * sizeof(struct evlog_rec *) + 1);
+		rings[r].count = 0;
+	}
+	for (i = 0; i < count; i++) {
+		struct ring_recs * ring = &rings[recs[i].ring];
+		ring->recs[ring->count++] = &recs[i];
+	}
+
+	/* Merge the rings, earliest event first */
+	for (;;) {
+		best = -1;
+		for (r = 0; r < num_rings; r++) {
+			if (rings[r].next == rings[r].count)
+				continue;
+			if (best < 0 || event_time(rings[r].recs[rings[r].next]) <
+			    event_time(rings[best].recs[rings[best].next]))
+				best = r;
+		}
+		if (best < 0)
+			break;
+		print_event(&rings[best]);
+	}
+
+	for (r = 0; r < num_rings; r++)
+		free(rings[r].recs);
+	free(rings);
+	free(recs);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,406 @@
+/*******************************************************************************
+* Image Operations Benchmark
+*
+* Description:
+*     Measures the data-processing throughput of the image operations of
+*     server_multi (see imgproc.h), first on their own and then through
+*     the queues and workers of the server. In the first part, every
+*     operation runs in this process on a random image with the kernels of
+*     every instruction set the CPU supports, and its output is checked
+*     against that of the scalar kernel. In the second part, a server is
+*     started for every instruction set, and for every operation, a number
+*     of client connections upload an image each and keep a fixed window of
+*     requests for that operation outstanding until they have all been
+*     answered. Requests go out in version 2 frames of struct request_op
+*     asking for timestamps, with the time the operation took in the first
+*     part as their estimated length.
+*
+* Usage:
+*     <build directory>/img_bench [-s <side>] [-c <connections>]
+*                                 [-n <requests per conn>] [-W <window>]
+*                                 [-w <workers>] <server binary>
+*
+* Notes:
+*     Images are side x side pixels (default 512). The first part prints
+*     the throughput of every kernel in megapixels per second. The second
+*     part prints one line per instruction set and operation with the
+*     throughput in requests and megapixels per second, the mean response
+*     time seen by the clients, and the mean time requests spent queued
+*     and in the server, plus the requests rejected. The server output is
+*     discarded.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "imgproc.h"
+
+/* How long to wait for the server to accept connections, in ms */
+#define CONNECT_TIMEOUT_MS 2000
+
+/* Every kernel is timed over at least KERNEL_NS (200 ms) of runs */
+#define KERNEL_NS (200 * 1000 * 1000)
+
+struct bench_conn {
+	int sockfd;
+	uint64_t count;
+	int window;
+	uint16_t op;
+	uint32_t image;
+	uint64_t length_ns;
+	/* Send time of every request, indexed by ID */
+	uint64_t * sent_ns;
+	/* Results */
+	uint64_t completed, rejected;
+	double total_latency, total_wait, total_server;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TSPEC_TO_NSEC(now);
+}
+
+/* Time every kernel on <img>, and check it against the scalar one.
+ * Sets <op_ns> to the time every operation takes with the kernels of
+ * every instruction set. */
+static void bench_kernels(const struct image * img, double op_ns[IMG_NUM_OPS][IMG_NUM_SIMD])
+{
+	struct image ref, out;
+	uint64_t start, elapsed, runs;
+	size_t len;
+	int op, simd;
+
+	memset(&ref, 0, sizeof(ref));
+	memset(&out, 0, sizeof(out));
+	printf("# op instruction_set mpix_per_s output\n");
+	for (op = IMG_OP_NONE + 1; op < IMG_NUM_OPS; op++) {
+		img_run(&ref, img, op, IMG_SIMD_SCALAR);
+		len = (size_t)ref.width * ref.height;
+		for (simd = 0; simd <= img_simd_best(); simd++) {
+			start = now_ns();
+			for (runs = 0, elapsed = 0; elapsed < KERNEL_NS; runs++) {
+				img_run(&out, img, op, simd);
+				elapsed = now_ns() - start;
+			}
+			op_ns[op][simd] = (double)elapsed / runs;
+			printf("%s %s %.1f %s\n", img_op_name(op), img_simd_name(simd),
+			       (double)img->width * img->height * runs / elapsed * 1000,
+			       memcmp(ref.pixels, out.pixels, len) == 0 ? "ok" : "MISMATCH");
+			fflush(stdout);
+		}
+	}
+	image_free(&ref);
+	image_free(&out);
+}
+
+/* Send requests <first> to <first> + <count> - 1 in a single frame */
+static int send_frame(struct bench_conn * conn, uint64_t first, uint64_t count)
+{
+	uint8_t buf[sizeof(struct frame_v2) + count * sizeof(struct request_op)];
+	struct frame_v2 * frame = (struct frame_v2 *)buf;
+	struct request_op * reqs = (struct request_op *)(frame + 1);
+	uint64_t i, now = now_ns();
+
+	frame->magic = PROTO_V2_MAGIC;
+	frame->version = PROTO_V2_VERSION;
+	frame->flags = PROTO_V2_TIMING | PROTO_V2_OPS;
+	frame->count = count;
+	memset(reqs, 0, count * sizeof(struct request_op));
+	for (i = 0; i < count; i++) {
+		reqs[i].req_id = first + i;
+		reqs[i].sent_ns = now;
+		reqs[i].length_ns = conn->length_ns;
+		reqs[i].image = conn->image;
+		reqs[i].op = conn->op;
+		conn->sent_ns[first + i] = now;
+	}
+	return send(conn->sockfd, buf, sizeof(buf), MSG_NOSIGNAL) == (ssize_t)sizeof(buf) ? 0 : -1;
+}
+
+/* Upload <img> and set the handle of the connection to it */
+static int upload(struct bench_conn * conn, const struct image * img)
+{
+	struct frame_v2 frame;
+	struct image_upload header;
+	struct response_v2 resp;
+	size_t len = (size_t)img->width * img->height, off;
+	ssize_t ret;
+
+	frame.magic = PROTO_V2_MAGIC;
+	frame.version = PROTO_V2_VERSION;
+	frame.flags = PROTO_V2_UPLOAD;
+	frame.count = 1;
+	header.req_id = 0;
+	header.width = img->width;
+	header.height = img->height;
+	if (send(conn->sockfd, &frame, sizeof(frame), MSG_NOSIGNAL) != sizeof(frame) ||
+	    send(conn->sockfd, &header, sizeof(header), MSG_NOSIGNAL) != sizeof(header))
+		return -1;
+	for (off = 0; off < len; off += ret) {
+		ret = send(conn->sockfd, img->pixels + off, len - off, MSG_NOSIGNAL);
+		if (ret <= 0)
+			return -1;
+	}
+
+	/* Without timestamps, the response is RESP_V2_BASE_SIZE bytes */
+	for (off = 0; off < RESP_V2_BASE_SIZE; off += ret) {
+		ret = recv(conn->sockfd, (uint8_t *)&resp + off, RESP_V2_BASE_SIZE - off, 0);
+		if (ret <= 0)
+			return -1;
+	}
+	if (resp.status != RESP_COMPLETED)
+		return -1;
+	conn->image = resp.image;
+	return 0;
+}
+
+/* Keep <window> requests outstanding on one connection until <count>
+ * of them have been answered */
+static void * conn_main(void * arg)
+{
+	struct bench_conn * conn = (struct bench_conn *)arg;
+	uint8_t buf[64 * sizeof(struct response_v2)];
+	struct response_v2 resp;
+	uint64_t next = 0, done = 0, count;
+	size_t have = 0, off;
+	ssize_t ret;
+
+	count = (conn->window < (int)conn->count) ? (uint64_t)conn->window : conn->count;
+	if (send_frame(conn, 0, count) < 0)
+		return NULL;
+	next = count;
+
+	while (done < conn->count) {
+		ret = recv(conn->sockfd, buf + have, sizeof(buf) - have, 0);
+		if (ret <= 0)
+			return NULL;
+		have += ret;
+
+		/* All the responses carry timestamps */
+		for (off = 0; have - off >= sizeof(struct response_v2); off += sizeof(struct response_v2)) {
+			memcpy(&resp, buf + off, sizeof(struct response_v2));
+			if (resp.status == RESP_REJECTED) {
+				conn->rejected++;
+			} else {
+				conn->completed++;
+				conn->total_wait += (double)(resp.start_ns - resp.receipt_ns) / NANO_IN_SEC;
+				conn->total_server += (double)(resp.completion_ns - resp.receipt_ns) / NANO_IN_SEC;
+			}
+			conn->total_latency += (double)(now_ns() - conn->sent_ns[resp.req_id]) / NANO_IN_SEC;
+			done++;
+		}
+
+		/* Replace all the requests answered at once */
+		count = done + conn->window;
+		if (count > conn->count)
+			count = conn->count;
+		if (count > next && send_frame(conn, next, count - next) < 0)
+			return NULL;
+		next = count;
+
+		have -= off;
+		memmove(buf, buf + off, have);
+	}
+
+	return NULL;
+}
+
+static int connect_to(int port)
+{
+	struct sockaddr_in addr;
+	int sockfd, waited;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (waited = 0; waited < CONNECT_TIMEOUT_MS; waited += 10) {
+		sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return sockfd;
+		close(sockfd);
+		usleep(10 * 1000);
+	}
+	return -1;
+}
+
+/* Run operation <op> through <conns> connections to the server on
+ * <port>, each with an image of its own */
+static int run_op(int port, int simd, int op, const struct image * img, int conns,
+		  uint64_t count, int window, double length_ns)
+{
+	struct bench_conn bc[conns];
+	pthread_t threads[conns];
+	uint64_t start, end, completed = 0, rejected = 0;
+	double latency = 0, wait = 0, server_time = 0, elapsed;
+	int i, ret = 0;
+
+	for (i = 0; i < conns; i++) {
+		memset(&bc[i], 0, sizeof(bc[i]));
+		bc[i].count = count;
+		bc[i].window = window;
+		bc[i].op = op;
+		bc[i].length_ns = (uint64_t)length_ns;
+		bc[i].sent_ns = (uint64_t *)malloc(count * sizeof(uint64_t));
+		bc[i].sockfd = connect_to(port);
+		if (bc[i].sockfd < 0 || upload(&bc[i], img) < 0) {
+			fprintf(stderr, "Unable to upload the image to the server\n");
+			conns = i + 1;
+			ret = -1;
+			goto out;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < conns; i++)
+		pthread_create(&threads[i], NULL, conn_main, &bc[i]);
+	for (i = 0; i < conns; i++)
+		pthread_join(threads[i], NULL);
+	end = now_ns();
+
+	for (i = 0; i < conns; i++) {
+		completed += bc[i].completed;
+		rejected += bc[i].rejected;
+		latency += bc[i].total_latency;
+		wait += bc[i].total_wait;
+		server_time += bc[i].total_server;
+	}
+
+	elapsed = (double)(end - start) / NANO_IN_SEC;
+	printf("%s %s %.0f %.1f %.1f", img_simd_name(simd), img_op_name(op),
+	       (completed + rejected) / elapsed,
+	       (double)img->width * img->height * completed / elapsed / 1000000,
+	       latency / (completed + rejected) * 1000000);
+	if (completed > 0)
+		printf(" %.1f %.1f", wait / completed * 1000000, server_time / completed * 1000000);
+	else
+		printf(" - -");
+	printf(" %lu\n", rejected);
+	fflush(stdout);
+
+out:
+	for (i = 0; i < conns; i++) {
+		if (bc[i].sockfd >= 0)
+			close(bc[i].sockfd);
+		free(bc[i].sent_ns);
+	}
+	return ret;
+}
+
+/* Start a server with the kernels of instruction set <simd>, and run
+ * every operation through it */
+static int run_server(const char * server, int port, int simd, const struct image * img,
+		      int conns, uint64_t count, int window, int workers,
+		      double op_ns[IMG_NUM_OPS][IMG_NUM_SIMD])
+{
+	char port_str[16], queue_str[16], workers_str[16];
+	int op, devnull, ret = 0;
+	pid_t pid;
+
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	snprintf(queue_str, sizeof(queue_str), "%d", conns * window);
+	snprintf(workers_str, sizeof(workers_str), "%d", workers);
+
+	pid = fork();
+	if (pid == 0) {
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		execl(server, server, "-q", queue_str, "-w", workers_str, "-V", img_simd_name(simd),
+		      port_str, (char *)NULL);
+		exit(EXIT_FAILURE);
+	}
+	if (pid < 0) {
+		perror("Unable to start the server");
+		return -1;
+	}
+
+	for (op = IMG_OP_NONE + 1; op < IMG_NUM_OPS && ret == 0; op++)
+		ret = run_op(port, simd, op, img, conns, count, window, op_ns[op][simd]);
+
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+	return ret;
+}
+
+#define USAGE "Usage: %s [-s <side>] [-c <connections>] [-n <requests per conn>] " \
+	"[-W <window>] [-w <workers>] <server binary>\n"
+
+int main (int argc, char ** argv)
+{
+	int side = 512, conns = 2, window = 4, workers = 1, opt, port, simd;
+	double op_ns[IMG_NUM_OPS][IMG_NUM_SIMD];
+	uint64_t count = 200;
+	struct image img;
+	unsigned seed = 1;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "s:c:n:W:w:")) != -1) {
+		switch (opt) {
+		case 's':
+			side = atoi(optarg);
+			break;
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 'W':
+			window = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || side <= 0 || side > IMG_MAX_DIM || conns <= 0 ||
+	    window <= 0 || workers <= 0 || count == 0) {
+		fprintf(stderr, USAGE, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Random pixels, over a gradient so that equalization has a
+	 * histogram to spread */
+	memset(&img, 0, sizeof(img));
+	if (image_init(&img, side, side) < 0) {
+		perror("Unable to allocate the image");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < (size_t)side * side; i++)
+		img.pixels[i] = (i % side) * 128 / side + rand_r(&seed) % 64;
+
+	printf("# side=%d connections=%d requests=%lu window=%d workers=%d\n",
+	       side, conns, count, window, workers);
+	bench_kernels(&img, op_ns);
+
+	port = 20000 + getpid() % 20000;
+	printf("# instruction_set op req/s mpix_per_s mean_latency_us mean_queued_us "
+	       "mean_in_server_us rejected\n");
+	for (simd = 0; simd <= img_simd_best(); simd++)
+		if (run_server(argv[optind], port + simd, simd, &img, conns, count, window,
+			       workers, op_ns) < 0)
+			return EXIT_FAILURE;
+
+	image_free(&img);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,481 @@
+/*******************************************************************************
+* Image Processing Kernels (implementation)
+*
+* Description:
+*     The AVX2, SSE2 and scalar kernels of every operation, and the
+*     dispatch between them. See imgproc.h for the interface.
+*
+* Notes:
+*     The 3x3 operations widen the pixels to 16-bit lanes, 16 at a time
+*     with AVX2 and 8 with SSE2, and saturate back to bytes when storing.
+*     Blur divides the sum of the 9 pixels by 9 with a multiplication by
+*     BLUR_MUL followed by a shift by 16, which the SIMD kernels get from
+*     a single high-half multiplication, and which the scalar kernel
+*     repeats to produce the same rounding. The SIMD kernels cover the
+*     interior of every row, and the scalar kernel the edges and whatever
+*     is left at the end of a row. Rotation moves 8x8 blocks through byte
+*     transposes made of unpacks: SSE2 does one block at a time, AVX2 two
+*     side by side, one in each 128-bit lane. The rows of a block are
+*     loaded bottom-up, so that the transpose directly yields the rotated
+*     rows.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "common.h"
+#include "imgproc.h"
+
+/* (sum * BLUR_MUL) >> 16 is sum / 9, rounded, for sums up to 9 * 255
+ * once BLUR_ROUND is added */
+#define BLUR_MUL    7282
+#define BLUR_ROUND  4
+
+static const char * simd_names[IMG_NUM_SIMD] = { "scalar", "sse", "avx2" };
+
+static const char * op_names[IMG_NUM_OPS] = {
+	"none", "blur", "sharpen", "sobel", "rotate", "equalize"
+};
+
+const char * img_simd_name(int simd)
+{
+	return simd_names[simd];
+}
+
+const char * img_op_name(int op)
+{
+	return op_names[op];
+}
+
+int img_simd_best(void)
+{
+	if (__builtin_cpu_supports("avx2"))
+		return IMG_SIMD_AVX2;
+	/* Every x86-64 CPU has SSE2 */
+	return IMG_SIMD_SSE;
+}
+
+int img_simd_parse(const char * name)
+{
+	int simd;
+
+	for (simd = 0; simd < IMG_NUM_SIMD; simd++)
+		if (strcmp(name, simd_names[simd]) == 0)
+			break;
+	if (simd == IMG_NUM_SIMD || simd > img_simd_best())
+		return -1;
+	return simd;
+}
+
+int image_init(struct image * img, uint32_t width, uint32_t height)
+{
+	size_t len = (size_t)width * height;
+	uint8_t * pixels;
+
+	if (width == 0 || height == 0)
+		return -1;
+	if (len > img->capacity) {
+		pixels = (uint8_t *)realloc(img->pixels, len);
+		if (pixels == NULL)
+			return -1;
+		img->pixels = pixels;
+		img->capacity = len;
+	}
+	img->width = width;
+	img->height = height;
+	return 0;
+}
+
+void image_free(struct image * img)
+{
+	free(img->pixels);
+	memset(img, 0, sizeof(struct image));
+}
+
+/* Result of 3x3 operation <op> on the neighborhood of a pixel,
+ * given row by row from the top left */
+static inline uint8_t op3x3(int op, int nw, int n, int ne, int w, int c, int e,
+			    int sw, int s, int se)
+{
+	int v, gx, gy;
+
+	switch (op) {
+	case IMG_OP_BLUR:
+		v = ((nw + n + ne + w + c + e + sw + s + se + BLUR_ROUND) * BLUR_MUL) >> 16;
+		break;
+	case IMG_OP_SHARPEN:
+		v = 5 * c - n - w - e - s;
+		break;
+	default:
+		gx = (ne + 2 * e + se) - (nw + 2 * w + sw);
+		gy = (sw + 2 * s + se) - (nw + 2 * n + ne);
+		v = abs(gx) + abs(gy);
+		break;
+	}
+	return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+/* 3x3 operation <op> on pixel (<x>, <y>) of <in>, anywhere in the
+ * image, edges included */
+static uint8_t op3x3_clamped(const struct image * in, int op, int x, int y)
+{
+	int xs[3], ys[3], i, j, p[3][3];
+
+	for (i = 0; i < 3; i++) {
+		xs[i] = x + i - 1;
+		ys[i] = y + i - 1;
+		if (xs[i] < 0)
+			xs[i] = 0;
+		if (xs[i] >= (int)in->width)
+			xs[i] = in->width - 1;
+		if (ys[i] < 0)
+			ys[i] = 0;
+		if (ys[i] >= (int)in->height)
+			ys[i] = in->height - 1;
+	}
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			p[i][j] = in->pixels[(size_t)ys[i] * in->width + xs[j]];
+
+	return op3x3(op, p[0][0], p[0][1], p[0][2], p[1][0], p[1][1], p[1][2],
+		     p[2][0], p[2][1], p[2][2]);
+}
+
+/* Pixels <x0> to <x1> (excluded) of an interior row, between rows
+ * <up> and <down>, all away from the left and right edges */
+static void row3x3_scalar(int op, const uint8_t * up, const uint8_t * mid,
+			  const uint8_t * down, uint8_t * out, int x0, int x1)
+{
+	int x;
+
+	for (x = x0; x < x1; x++)
+		out[x] = op3x3(op, up[x - 1], up[x], up[x + 1], mid[x - 1], mid[x], mid[x + 1],
+			       down[x - 1], down[x], down[x + 1]);
+}
+
+/* Same as above, from pixel 1 on, 8 pixels at a time, for as long
+ * as the pixels to the right of the 8 are in the row. Returns the
+ * first pixel left undone. */
+static int row3x3_sse(int op, const uint8_t * up, const uint8_t * mid,
+		      const uint8_t * down, uint8_t * out, int width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i nw, n, ne, w, c, e, sw, s, se, v, gx, gy;
+	int x;
+
+#define LOAD8(p) _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p)), zero)
+	for (x = 1; x + 8 < width; x += 8) {
+		nw = LOAD8(up + x - 1);
+		n = LOAD8(up + x);
+		ne = LOAD8(up + x + 1);
+		w = LOAD8(mid + x - 1);
+		c = LOAD8(mid + x);
+		e = LOAD8(mid + x + 1);
+		sw = LOAD8(down + x - 1);
+		s = LOAD8(down + x);
+		se = LOAD8(down + x + 1);
+
+		switch (op) {
+		case IMG_OP_BLUR:
+			v = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(nw, n), _mm_add_epi16(ne, w)),
+					  _mm_add_epi16(_mm_add_epi16(c, e), _mm_add_epi16(sw, s)));
+			v = _mm_add_epi16(_mm_add_epi16(v, se), _mm_set1_epi16(BLUR_ROUND));
+			v = _mm_mulhi_epu16(v, _mm_set1_epi16(BLUR_MUL));
+			break;
+		case IMG_OP_SHARPEN:
+			v = _mm_add_epi16(_mm_slli_epi16(c, 2), c);
+			v = _mm_sub_epi16(v, _mm_add_epi16(_mm_add_epi16(n, w), _mm_add_epi16(e, s)));
+			break;
+		default:
+			gx = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(ne, se), _mm_slli_epi16(e, 1)),
+					   _mm_add_epi16(_mm_add_epi16(nw, sw), _mm_slli_epi16(w, 1)));
+			gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(sw, se), _mm_slli_epi16(s, 1)),
+					   _mm_add_epi16(_mm_add_epi16(nw, ne), _mm_slli_epi16(n, 1)));
+			/* No PABSW before SSSE3 */
+			gx = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+			gy = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+			v = _mm_add_epi16(gx, gy);
+			break;
+		}
+		_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(v, v));
+	}
+#undef LOAD8
+	return x;
+}
+
+/* Same as above, 16 pixels at a time */
+__attribute__((target("avx2")))
+static int row3x3_avx2(int op, const uint8_t * up, const uint8_t * mid,
+		       const uint8_t * down, uint8_t * out, int width)
+{
+	__m256i nw, n, ne, w, c, e, sw, s, se, v, gx, gy;
+	int x;
+
+#define LOAD16(p) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p)))
+	for (x = 1; x + 16 < width; x += 16) {
+		nw = LOAD16(up + x - 1);
+		n = LOAD16(up + x);
+		ne = LOAD16(up + x + 1);
+		w = LOAD16(mid + x - 1);
+		c = LOAD16(mid + x);
+		e = LOAD16(mid + x + 1);
+		sw = LOAD16(down + x - 1);
+		s = LOAD16(down + x);
+		se = LOAD16(down + x + 1);
+
+		switch (op) {
+		case IMG_OP_BLUR:
+			v = _mm256_add_epi16(_mm256_add_epi16(_mm256_add_epi16(nw, n), _mm256_add_epi16(ne, w)),
+					     _mm256_add_epi16(_mm256_add_epi16(c, e), _mm256_add_epi16(sw, s)));
+			v = _mm256_add_epi16(_mm256_add_epi16(v, se), _mm256_set1_epi16(BLUR_ROUND));
+			v = _mm256_mulhi_epu16(v, _mm256_set1_epi16(BLUR_MUL));
+			break;
+		case IMG_OP_SHARPEN:
+			v = _mm256_add_epi16(_mm256_slli_epi16(c, 2), c);
+			v = _mm256_sub_epi16(v, _mm256_add_epi16(_mm256_add_epi16(n, w), _mm256_add_epi16(e, s)));
+			break;
+		default:
+			gx = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(ne, se), _mm256_slli_epi16(e, 1)),
+					      _mm256_add_epi16(_mm256_add_epi16(nw, sw), _mm256_slli_epi16(w, 1)));
+			gy = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(sw, se), _mm256_slli_epi16(s, 1)),
+					      _mm256_add_epi16(_mm256_add_epi16(nw, ne), _mm256_slli_epi16(n, 1)));
+			v = _mm256_add_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+			break;
+		}
+		/* PACKUSWB packs within 128-bit lanes: pack the two
+		 * halves against each other instead */
+		_mm_storeu_si128((__m128i *)(out + x),
+				 _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+	}
+#undef LOAD16
+	return x;
+}
+
+static void run_3x3(struct image * out, const struct image * in, int op, int simd)
+{
+	int width = in->width, height = in->height, x, y;
+	const uint8_t * up, * mid, * down;
+	uint8_t * row;
+
+	for (y = 0; y < height; y++) {
+		row = out->pixels + (size_t)y * width;
+		/* Edge rows, and images too narrow for any interior */
+		if (y == 0 || y == height - 1 || width < 3) {
+			for (x = 0; x < width; x++)
+				row[x] = op3x3_clamped(in, op, x, y);
+			continue;
+		}
+
+		up = in->pixels + (size_t)(y - 1) * width;
+		mid = up + width;
+		down = mid + width;
+		if (simd == IMG_SIMD_AVX2)
+			x = row3x3_avx2(op, up, mid, down, row, width);
+		else if (simd == IMG_SIMD_SSE)
+			x = row3x3_sse(op, up, mid, down, row, width);
+		else
+			x = 1;
+		row3x3_scalar(op, up, mid, down, row, x, width - 1);
+		row[0] = op3x3_clamped(in, op, 0, y);
+		row[width - 1] = op3x3_clamped(in, op, width - 1, y);
+	}
+}
+
+/* Rotate the 8x8 block of <in> with top left corner (<x0>, <y0>) */
+static void rotate_block_sse(struct image * out, const struct image * in, int x0, int y0)
+{
+	__m128i r[8], a0, a1, a2, a3, b0, b1, b2, b3, c[4];
+	uint8_t * dst;
+	int i;
+
+	/* Bottom-up, so that the columns come out rotated */
+	for (i = 0; i < 8; i++)
+		r[i] = _mm_loadl_epi64((const __m128i *)(in->pixels + (size_t)(y0 + 7 - i) * in->width + x0));
+
+	a0 = _mm_unpacklo_epi8(r[0], r[1]);
+	a1 = _mm_unpacklo_epi8(r[2], r[3]);
+	a2 = _mm_unpacklo_epi8(r[4], r[5]);
+	a3 = _mm_unpacklo_epi8(r[6], r[7]);
+	b0 = _mm_unpacklo_epi16(a0, a1);
+	b1 = _mm_unpackhi_epi16(a0, a1);
+	b2 = _mm_unpacklo_epi16(a2, a3);
+	b3 = _mm_unpackhi_epi16(a2, a3);
+	/* Columns 0 and 1, 2 and 3, 4 and 5, 6 and 7 */
+	c[0] = _mm_unpacklo_epi32(b0, b2);
+	c[1] = _mm_unpackhi_epi32(b0, b2);
+	c[2] = _mm_unpacklo_epi32(b1, b3);
+	c[3] = _mm_unpackhi_epi32(b1, b3);
+
+	/* Column x0 + i becomes row x0 + i, from column
+	 * height - 8 - y0 on */
+	dst = out->pixels + (size_t)x0 * out->width + (in->height - 8 - y0);
+	for (i = 0; i < 4; i++) {
+		_mm_storel_epi64((__m128i *)dst, c[i]);
+		dst += out->width;
+		_mm_storel_epi64((__m128i *)dst, _mm_unpackhi_epi64(c[i], c[i]));
+		dst += out->width;
+	}
+}
+
+/* Same as above, for the 16x8 block made of two 8x8 blocks side by
+ * side, each in a 128-bit lane */
+__attribute__((target("avx2")))
+static void rotate_block_avx2(struct image * out, const struct image * in, int x0, int y0)
+{
+	__m256i r[8], a0, a1, a2, a3, b0, b1, b2, b3, c;
+	__m128i lo, hi;
+	uint8_t * dst;
+	size_t stride = out->width;
+	int i;
+
+	/* The left 8 pixels of a row go to the low lane, the right 8
+	 * to the high lane */
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_permute4x64_epi64(_mm256_castsi128_si256(_mm_loadu_si128(
+			(const __m128i *)(in->pixels + (size_t)(y0 + 7 - i) * in->width + x0))), 0x50);
+
+	a0 = _mm256_unpacklo_epi8(r[0], r[1]);
+	a1 = _mm256_unpacklo_epi8(r[2], r[3]);
+	a2 = _mm256_unpacklo_epi8(r[4], r[5]);
+	a3 = _mm256_unpacklo_epi8(r[6], r[7]);
+	b0 = _mm256_unpacklo_epi16(a0, a1);
+	b1 = _mm256_unpackhi_epi16(a0, a1);
+	b2 = _mm256_unpacklo_epi16(a2, a3);
+	b3 = _mm256_unpackhi_epi16(a2, a3);
+
+	dst = out->pixels + (size_t)x0 * stride + (in->height - 8 - y0);
+	for (i = 0; i < 4; i++) {
+		switch (i) {
+		case 0:
+			c = _mm256_unpacklo_epi32(b0, b2);
+			break;
+		case 1:
+			c = _mm256_unpackhi_epi32(b0, b2);
+			break;
+		case 2:
+			c = _mm256_unpacklo_epi32(b1, b3);
+			break;
+		default:
+			c = _mm256_unpackhi_epi32(b1, b3);
+			break;
+		}
+		/* Columns 2 * i and 2 * i + 1 of both blocks */
+		lo = _mm256_castsi256_si128(c);
+		hi = _mm256_extracti128_si256(c, 1);
+		_mm_storel_epi64((__m128i *)(dst + 2 * i * stride), lo);
+		_mm_storel_epi64((__m128i *)(dst + (2 * i + 1) * stride), _mm_unpackhi_epi64(lo, lo));
+		_mm_storel_epi64((__m128i *)(dst + (2 * i + 8) * stride), hi);
+		_mm_storel_epi64((__m128i *)(dst + (2 * i + 9) * stride), _mm_unpackhi_epi64(hi, hi));
+	}
+}
+
+static int run_rotate(struct image * out, const struct image * in, int simd)
+{
+	uint32_t width = in->width, height = in->height, x, y, x_blocks;
+
+	if (image_init(out, height, width) < 0)
+		return -1;
+
+	/* Whole blocks first, then the pixels along the right and
+	 * bottom edges that do not fill a block */
+	x_blocks = (simd == IMG_SIMD_SCALAR) ? 0 : width & ~7U;
+	for (y = 0; simd != IMG_SIMD_SCALAR && y + 8 <= height; y += 8) {
+		x = 0;
+		if (simd == IMG_SIMD_AVX2)
+			for (; x + 16 <= width; x += 16)
+				rotate_block_avx2(out, in, x, y);
+		for (; x + 8 <= width; x += 8)
+			rotate_block_sse(out, in, x, y);
+	}
+	for (y = 0; y < height; y++) {
+		/* Rows of whole blocks only miss their right end */
+		x = (simd != IMG_SIMD_SCALAR && y < (height & ~7U)) ? x_blocks : 0;
+		for (; x < width; x++)
+			out->pixels[(size_t)x * height + (height - 1 - y)] = in->pixels[(size_t)y * width + x];
+	}
+	return 0;
+}
+
+/* Map <len> pixels through <lut>, eight at a time */
+__attribute__((target("avx2")))
+static size_t map_avx2(uint8_t * dst, const uint8_t * src, size_t len, const int32_t * lut)
+{
+	__m256i idx, v;
+	__m128i w;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+		v = _mm256_i32gather_epi32(lut, idx, 4);
+		w = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(w, w));
+	}
+	return i;
+}
+
+static void run_equalize(struct image * out, const struct image * in, int simd)
+{
+	size_t len = (size_t)in->width * in->height, i;
+	uint32_t hist[4][256];
+	uint64_t cdf, cdf_min = 0;
+	int32_t lut[256];
+	int v;
+
+	/* Four histograms, so that runs of equal pixels do not wait
+	 * on each other's increments */
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i + 4 <= len; i += 4) {
+		hist[0][in->pixels[i]]++;
+		hist[1][in->pixels[i + 1]]++;
+		hist[2][in->pixels[i + 2]]++;
+		hist[3][in->pixels[i + 3]]++;
+	}
+	for (; i < len; i++)
+		hist[0][in->pixels[i]]++;
+
+	/* Spread the cumulative distribution over the whole range,
+	 * from the darkest pixel present on. An image of a single
+	 * shade is left as is. */
+	for (v = 0; cdf_min == 0; v++)
+		cdf_min = hist[0][v] + hist[1][v] + hist[2][v] + hist[3][v];
+	cdf = 0;
+	for (v = 0; v < 256; v++) {
+		cdf += hist[0][v] + hist[1][v] + hist[2][v] + hist[3][v];
+		if (cdf_min == len)
+			lut[v] = v;
+		else if (cdf < cdf_min)
+			lut[v] = 0;
+		else
+			lut[v] = ((cdf - cdf_min) * 255 + (len - cdf_min) / 2) / (len - cdf_min);
+	}
+
+	i = (simd == IMG_SIMD_AVX2) ? map_avx2(out->pixels, in->pixels, len, lut) : 0;
+	for (; i < len; i++)
+		out->pixels[i] = lut[in->pixels[i]];
+}
+
+int img_run(struct image * out, const struct image * in, int op, int simd)
+{
+	switch (op) {
+	case IMG_OP_BLUR:
+	case IMG_OP_SHARPEN:
+	case IMG_OP_SOBEL:
+		if (image_init(out, in->width, in->height) < 0)
+			return -1;
+		run_3x3(out, in, op, simd);
+		return 0;
+	case IMG_OP_ROTATE:
+		return run_rotate(out, in, simd);
+	case IMG_OP_EQUALIZE:
+		if (image_init(out, in->width, in->height) < 0)
+			return -1;
+		run_equalize(out, in, simd);
+		return 0;
+	}
+	return -1;
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+* Image Processing Kernels (header)
+*
+* Description:
+*     The operations clients can run on the images they uploaded (see the
+*     IMG_OP_* codes in common.h): 3x3 box blur, 3x3 Laplacian sharpening,
+*     Sobel edge detection, rotation by 90 degrees clockwise and histogram
+*     equalization, on 8-bit grayscale images. Every operation has an AVX2
+*     kernel, an SSE2 kernel and a scalar one, and all three produce the
+*     same output to the bit, so that they can be checked against each
+*     other and compared on throughput alone.
+*
+* Notes:
+*     The 3x3 operations treat the pixels past the edges as copies of the
+*     nearest edge pixel. Histogram equalization spends most of its time
+*     building the histogram, which has no SIMD formulation that pays off;
+*     the AVX2 kernel maps the pixels through the lookup table with
+*     gathers, and the SSE2 one, which has no gathers, does it pixel by
+*     pixel like the scalar kernel. Every function returning an int
+*     returns a negative value on failure.
+*
+*******************************************************************************/
+
+#ifndef IMGPROC_H
+#define IMGPROC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Instruction sets the kernels can use */
+#define IMG_SIMD_SCALAR  0
+#define IMG_SIMD_SSE     1
+#define IMG_SIMD_AVX2    2
+#define IMG_NUM_SIMD     3
+
+/* An 8-bit grayscale image. <capacity> bytes are allocated at
+ * <pixels>, which may be more than the image needs when the buffer
+ * is reused for a smaller image. */
+struct image {
+	uint32_t width, height;
+	uint8_t * pixels;
+	size_t capacity;
+};
+
+/* Make <img> a <width> x <height> image, reusing its buffer if large
+ * enough. <img> must be zeroed before the first call. The pixels are
+ * left uninitialized. */
+int image_init(struct image * img, uint32_t width, uint32_t height);
+void image_free(struct image * img);
+
+/* Most capable instruction set of this CPU */
+int img_simd_best(void);
+
+/* Parse the name of an instruction set, which must be supported by
+ * this CPU */
+int img_simd_parse(const char * name);
+
+const char * img_simd_name(int simd);
+const char * img_op_name(int op);
+
+/* Run operation <op> on <in> into <out>, resized as needed, with the
+ * kernels for instruction set <simd> */
+int img_run(struct image * out, const struct image * in, int op, int simd);
+
+#endif
@@ -0,0 +1,492 @@
+/*******************************************************************************
+* I/O Backend Benchmark
+*
+* Description:
+*     Compares the epoll and io_uring backends of server_multi on loopback,
+*     the shared-memory transport (shm) that bypasses sockets entirely, and
+*     datagram mode (udp).
+*     For each backend, a server is started with zero-length requests in
+*     mind, and a number of client connections keep a fixed window of
+*     requests outstanding each until they have all been answered. Since
+*     requests take no time to serve, the results are dominated by the cost
+*     of moving requests and responses in and out of the server. With -2,
+*     the clients speak version 2 of the protocol: the requests sent in
+*     response to the same batch of responses go out as a single frame,
+*     and the responses carry the server-side timestamps. The shm clients
+*     always use the rings of version 1 requests and responses, and the udp
+*     clients send version 1 requests, one per datagram. A udp client that
+*     hears nothing for UDP_TIMEOUT_MS writes off all of its outstanding
+*     requests as lost and carries on.
+*
+* Usage:
+*     <build directory>/io_bench [-c <connections>] [-n <requests per conn>]
+*                                [-W <window>] [-w <workers>] [-2]
+*                                <server binary>
+*
+* Notes:
+*     Prints one line per backend with the throughput, the mean response
+*     time seen by the clients, and the CPU time the server consumed per
+*     request, plus the requests rejected and lost. With -2, the time
+*     requests spent queued in the server and
+*     their total time in the server are added. The server output is
+*     discarded.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "shmring.h"
+
+/* How long to wait for the server to accept connections, in ms */
+#define CONNECT_TIMEOUT_MS 2000
+
+/* How long a udp client waits for a response before giving up on the
+ * requests outstanding, in ms */
+#define UDP_TIMEOUT_MS 100
+
+struct bench_conn {
+	int sockfd;
+	/* Used instead of the socket for the shm transport */
+	struct shm_channel * shm;
+	uint64_t count;
+	int window;
+	int v2;
+	/* Send time of every request, indexed by ID */
+	uint64_t * sent_ns;
+	/* Results */
+	uint64_t completed, rejected, lost;
+	double total_latency;
+	/* Server-side times reported with version 2, in seconds */
+	double total_wait, total_server;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TSPEC_TO_NSEC(now);
+}
+
+static int send_request(struct bench_conn * conn, uint64_t id)
+{
+	struct request req;
+
+	memset(&req, 0, sizeof(req));
+	req.req_id = id;
+	clock_gettime(CLOCK_MONOTONIC, &req.req_timestamp);
+	conn->sent_ns[id] = TSPEC_TO_NSEC(req.req_timestamp);
+	return send(conn->sockfd, &req, sizeof(req), MSG_NOSIGNAL) == sizeof(req) ? 0 : -1;
+}
+
+/* Send requests <first> to <first> + <count> - 1 in a single version
+ * 2 frame asking for timestamps */
+static int send_frame(struct bench_conn * conn, uint64_t first, uint64_t count)
+{
+	uint8_t buf[sizeof(struct frame_v2) + count * sizeof(struct request_v2)];
+	struct frame_v2 * frame = (struct frame_v2 *)buf;
+	struct request_v2 * reqs = (struct request_v2 *)(frame + 1);
+	uint64_t i, now = now_ns();
+
+	frame->magic = PROTO_V2_MAGIC;
+	frame->version = PROTO_V2_VERSION;
+	frame->flags = PROTO_V2_TIMING;
+	frame->count = count;
+	for (i = 0; i < count; i++) {
+		reqs[i].req_id = first + i;
+		reqs[i].sent_ns = now;
+		reqs[i].length_ns = 0;
+		conn->sent_ns[first + i] = now;
+	}
+	return send(conn->sockfd, buf, sizeof(buf), MSG_NOSIGNAL) == (ssize_t)sizeof(buf) ? 0 : -1;
+}
+
+/* Send requests from <*next> on, up to <limit> excluded */
+static int send_requests(struct bench_conn * conn, uint64_t * next, uint64_t limit)
+{
+	uint64_t count;
+
+	if (limit > conn->count)
+		limit = conn->count;
+
+	while (*next < limit) {
+		if (!conn->v2) {
+			if (send_request(conn, (*next)++) < 0)
+				return -1;
+			continue;
+		}
+		count = (limit - *next > UINT16_MAX) ? UINT16_MAX : limit - *next;
+		if (send_frame(conn, *next, count) < 0)
+			return -1;
+		*next += count;
+	}
+	return 0;
+}
+
+/* Keep <window> requests outstanding on one connection until <count>
+ * of them have been answered */
+static void * conn_main(void * arg)
+{
+	struct bench_conn * conn = (struct bench_conn *)arg;
+	uint8_t buf[64 * sizeof(struct response_v2)];
+	struct response_v2 resp;
+	uint64_t next = 0, done = 0;
+	size_t have = 0, off, size;
+	ssize_t ret;
+
+	if (send_requests(conn, &next, conn->window) < 0)
+		return NULL;
+
+	while (done < conn->count) {
+		ret = recv(conn->sockfd, buf + have, sizeof(buf) - have, 0);
+		if (ret <= 0)
+			return NULL;
+		have += ret;
+
+		for (off = 0; have - off >= RESP_V2_BASE_SIZE; off += size) {
+			memcpy(&resp, buf + off, RESP_V2_BASE_SIZE);
+			size = conn->v2 ? RESP_V2_SIZE(&resp) : sizeof(struct response);
+			if (have - off < size)
+				break;
+			memcpy(&resp, buf + off, size);
+
+			if (resp.status == RESP_REJECTED)
+				conn->rejected++;
+			else
+				conn->completed++;
+			conn->total_latency += (double)(now_ns() - conn->sent_ns[resp.req_id]) / NANO_IN_SEC;
+			if (resp.flags & PROTO_V2_TIMING && resp.status != RESP_REJECTED) {
+				conn->total_wait += (double)(resp.start_ns - resp.receipt_ns) / NANO_IN_SEC;
+				conn->total_server += (double)(resp.completion_ns - resp.receipt_ns) / NANO_IN_SEC;
+			}
+			done++;
+		}
+
+		/* Replace all the requests answered at once */
+		if (send_requests(conn, &next, done + conn->window) < 0)
+			return NULL;
+
+		/* Keep the partial response, if any */
+		have -= off;
+		memmove(buf, buf + off, have);
+	}
+
+	return NULL;
+}
+
+/* Same as conn_main(), over the shared-memory transport */
+static void * shm_conn_main(void * arg)
+{
+	struct bench_conn * conn = (struct bench_conn *)arg;
+	struct request req;
+	struct response resp;
+	uint64_t next = 0, done = 0;
+
+	memset(&req, 0, sizeof(req));
+	while (done < conn->count) {
+		/* Top up the window, then wait for a response */
+		while (next < conn->count && next < done + conn->window) {
+			req.req_id = next;
+			clock_gettime(CLOCK_MONOTONIC, &req.req_timestamp);
+			if (shm_send_request(conn->shm, &req) < 0)
+				break;
+			conn->sent_ns[next++] = TSPEC_TO_NSEC(req.req_timestamp);
+		}
+
+		if (shm_recv_response(conn->shm, &resp, 1) < 0)
+			return NULL;
+		if (resp.status == RESP_REJECTED)
+			conn->rejected++;
+		else
+			conn->completed++;
+		conn->total_latency += (double)(now_ns() - conn->sent_ns[resp.req_id]) / NANO_IN_SEC;
+		done++;
+	}
+
+	return NULL;
+}
+
+/* Same as conn_main(), over UDP: every datagram carries one request
+ * and comes back with one response */
+static void * udp_conn_main(void * arg)
+{
+	struct bench_conn * conn = (struct bench_conn *)arg;
+	struct response_v2 resp;
+	uint64_t next = 0, done = 0, written_off = 0;
+	ssize_t ret;
+
+	if (send_requests(conn, &next, conn->window) < 0)
+		return NULL;
+
+	while (done < conn->count) {
+		ret = recv(conn->sockfd, &resp, sizeof(resp), 0);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED)
+				return NULL;
+			/* Nothing came back in time: the responses still
+			 * to come, if any, are ignored */
+			conn->lost += next - done;
+			done = written_off = next;
+		} else if (ret >= (ssize_t)sizeof(struct response) && resp.req_id >= written_off &&
+			   resp.req_id < next) {
+			if (resp.status == RESP_REJECTED)
+				conn->rejected++;
+			else
+				conn->completed++;
+			conn->total_latency += (double)(now_ns() - conn->sent_ns[resp.req_id]) / NANO_IN_SEC;
+			done++;
+		}
+
+		if (send_requests(conn, &next, done + conn->window) < 0)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/* Attach to the server through the shared-memory transport at <path> */
+static struct shm_channel * shm_connect_to(const char * path)
+{
+	struct shm_channel * ch = (struct shm_channel *)malloc(sizeof(struct shm_channel));
+	int waited;
+
+	for (waited = 0; waited < CONNECT_TIMEOUT_MS; waited += 10) {
+		if (shm_connect(ch, path) == 0)
+			return ch;
+		usleep(10 * 1000);
+	}
+	free(ch);
+	return NULL;
+}
+
+/* Address a UDP socket to the server on <port>, once it answers */
+static int udp_connect_to(int port)
+{
+	struct sockaddr_in addr;
+	struct timeval timeout = { 0, 10 * 1000 };
+	struct request req;
+	struct response_v2 resp;
+	int sockfd, waited;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(&req, 0, sizeof(req));
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		return -1;
+
+	/* Probe from a socket of its own, so that the probes do not
+	 * show up in the sequence of any client */
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	for (waited = 0; waited < CONNECT_TIMEOUT_MS; waited += 10) {
+		send(sockfd, &req, sizeof(req), 0);
+		if (recv(sockfd, &resp, sizeof(resp), 0) > 0)
+			break;
+		/* Refused right away while the port is not bound yet */
+		if (errno == ECONNREFUSED)
+			usleep(10 * 1000);
+	}
+	close(sockfd);
+	if (waited >= CONNECT_TIMEOUT_MS)
+		return -1;
+
+	timeout.tv_sec = UDP_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (UDP_TIMEOUT_MS % 1000) * 1000;
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+		return -1;
+	return sockfd;
+}
+
+static int connect_to(int port)
+{
+	struct sockaddr_in addr;
+	int sockfd, waited;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (waited = 0; waited < CONNECT_TIMEOUT_MS; waited += 10) {
+		sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return sockfd;
+		close(sockfd);
+		usleep(10 * 1000);
+	}
+	return -1;
+}
+
+/* Run the benchmark against <server> with I/O backend <backend>, or
+ * over the shared-memory transport if <backend> is "shm", or over UDP
+ * if it is "udp" */
+static int run_bench(const char * server, const char * backend, int port, int conns,
+		     uint64_t count, int window, int workers, int v2)
+{
+	struct bench_conn bc[conns];
+	pthread_t threads[conns];
+	char port_str[16], queue_str[16], workers_str[16], shm_path[64];
+	int use_shm = (strcmp(backend, "shm") == 0);
+	int use_udp = (strcmp(backend, "udp") == 0);
+	uint64_t start, end, completed = 0, rejected = 0, lost = 0;
+	double latency = 0, wait = 0, server_time = 0, elapsed, cpu;
+	struct rusage usage;
+	int i, status, devnull;
+	pid_t pid;
+
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	snprintf(queue_str, sizeof(queue_str), "%d", conns * window);
+	snprintf(workers_str, sizeof(workers_str), "%d", workers);
+	snprintf(shm_path, sizeof(shm_path), "/tmp/io_bench.%d.sock", getpid());
+
+	pid = fork();
+	if (pid == 0) {
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		if (use_shm)
+			execl(server, server, "-q", queue_str, "-w", workers_str, "-x", shm_path,
+			      port_str, (char *)NULL);
+		else if (use_udp)
+			execl(server, server, "-q", queue_str, "-w", workers_str, "-u",
+			      port_str, (char *)NULL);
+		else
+			execl(server, server, "-q", queue_str, "-w", workers_str, "-i", backend,
+			      port_str, (char *)NULL);
+		exit(EXIT_FAILURE);
+	}
+	if (pid < 0) {
+		perror("Unable to start the server");
+		return -1;
+	}
+
+	for (i = 0; i < conns; i++) {
+		memset(&bc[i], 0, sizeof(bc[i]));
+		bc[i].count = count;
+		bc[i].window = window;
+		bc[i].v2 = v2;
+		bc[i].sent_ns = (uint64_t *)malloc(count * sizeof(uint64_t));
+		if (use_shm) {
+			bc[i].shm = shm_connect_to(shm_path);
+			bc[i].sockfd = bc[i].shm ? bc[i].shm->sockfd : -1;
+		} else if (use_udp) {
+			bc[i].sockfd = udp_connect_to(port);
+		} else {
+			bc[i].sockfd = connect_to(port);
+		}
+		if (bc[i].sockfd < 0) {
+			fprintf(stderr, "Unable to connect to the server\n");
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			return -1;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < conns; i++)
+		pthread_create(&threads[i], NULL, use_shm ? shm_conn_main :
+			       use_udp ? udp_conn_main : conn_main, &bc[i]);
+	for (i = 0; i < conns; i++)
+		pthread_join(threads[i], NULL);
+	end = now_ns();
+
+	kill(pid, SIGINT);
+	wait4(pid, &status, 0, &usage);
+
+	for (i = 0; i < conns; i++) {
+		completed += bc[i].completed;
+		rejected += bc[i].rejected;
+		lost += bc[i].lost;
+		latency += bc[i].total_latency;
+		wait += bc[i].total_wait;
+		server_time += bc[i].total_server;
+		if (bc[i].shm) {
+			shm_close(bc[i].shm);
+			free(bc[i].shm);
+		} else {
+			close(bc[i].sockfd);
+		}
+		free(bc[i].sent_ns);
+	}
+
+	elapsed = (double)(end - start) / NANO_IN_SEC;
+	cpu = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1000000
+		+ (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1000000;
+
+	printf("%s %.0f %.1f %.2f %lu %lu", backend, (completed + rejected) / elapsed,
+	       latency / (completed + rejected) * 1000000,
+	       cpu / (completed + rejected) * 1000000, rejected, lost);
+	if (v2 && completed > 0)
+		printf(" %.1f %.1f", wait / completed * 1000000, server_time / completed * 1000000);
+	printf("\n");
+	fflush(stdout);
+	return 0;
+}
+
+int main (int argc, char ** argv)
+{
+	int conns = 4, window = 16, workers = 1, v2 = 0, opt, port;
+	uint64_t count = 100000;
+
+	while ((opt = getopt(argc, argv, "c:n:W:w:2")) != -1) {
+		switch (opt) {
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 'W':
+			window = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case '2':
+			v2 = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c <connections>] [-n <requests per conn>] "
+				"[-W <window>] [-w <workers>] [-2] <server binary>\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1 || conns <= 0 || window <= 0 || workers <= 0 || count == 0) {
+		fprintf(stderr, "Usage: %s [-c <connections>] [-n <requests per conn>] "
+			"[-W <window>] [-w <workers>] [-2] <server binary>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	port = 20000 + getpid() % 20000;
+
+	printf("# connections=%d requests=%lu window=%d workers=%d protocol=%d\n",
+	       conns, count, window, workers, v2 ? 2 : 1);
+	printf("# backend req/s mean_latency_us server_cpu_us/req rejected lost%s\n",
+	       v2 ? " mean_queued_us mean_in_server_us" : "");
+	if (run_bench(argv[optind], "epoll", port, conns, count, window, workers, v2) < 0 ||
+	    run_bench(argv[optind], "uring", port + 1, conns, count, window, workers, v2) < 0 ||
+	    run_bench(argv[optind], "shm", port + 2, conns, count, window, workers, 0) < 0 ||
+	    run_bench(argv[optind], "udp", port + 3, conns, count, window, workers, 0) < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
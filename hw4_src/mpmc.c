@@ -0,0 +1,162 @@
+/*******************************************************************************
+* Lock-Free Bounded MPMC Ring (implementation)
+*
+* Description:
+*     A bounded multi-producer/multi-consumer ring buffer that does not rely
+*     on any lock. See mpmc.h for the interface.
+*
+* Notes:
+*     Each slot starts with a 64-bit sequence number followed by the element
+*     payload, and slots are padded to a multiple of the cache line size so
+*     that producers and consumers working on neighboring slots do not
+*     bounce the same line between cores. A slot whose sequence equals the
+*     position being enqueued is free; one whose sequence equals position+1
+*     holds an element ready to be dequeued.
+*
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpmc.h"
+
+/* Pointer to the sequence number of the slot at position <pos> */
+static inline uint64_t * slot_seq(struct mpmc * ring, uint64_t pos)
+{
+	return (uint64_t *)(ring->slots + (pos & ring->mask) * ring->slot_size);
+}
+
+/* Pointer to the payload of the slot at position <pos> */
+static inline void * slot_data(struct mpmc * ring, uint64_t pos)
+{
+	return ring->slots + (pos & ring->mask) * ring->slot_size + sizeof(uint64_t);
+}
+
+int mpmc_init(struct mpmc * ring, size_t capacity, size_t elem_size)
+{
+	uint64_t size = 1, i;
+
+	while (size < capacity)
+		size <<= 1;
+
+	ring->elem_size = elem_size;
+	ring->slot_size = (sizeof(uint64_t) + elem_size + CACHE_LINE_SIZE - 1)
+		& ~((size_t)CACHE_LINE_SIZE - 1);
+	ring->mask = size - 1;
+	ring->capacity = capacity;
+
+	if (posix_memalign((void **)&ring->slots, CACHE_LINE_SIZE, size * ring->slot_size))
+		return -1;
+
+	for (i = 0; i < size; i++)
+		*slot_seq(ring, i) = i;
+
+	ring->enqueue_pos = 0;
+	ring->dequeue_pos = 0;
+	return 0;
+}
+
+void mpmc_destroy(struct mpmc * ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+int mpmc_push(struct mpmc * ring, const void * elem)
+{
+	uint64_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	uint64_t seq;
+	int64_t diff;
+
+	for (;;) {
+		seq = __atomic_load_n(slot_seq(ring, pos), __ATOMIC_ACQUIRE);
+		diff = (int64_t)seq - (int64_t)pos;
+
+		if (diff == 0) {
+			/* Slot is free for this lap, but the ring may be
+			 * held to fewer elements than it has slots. If
+			 * <pos> is stale, the difference is negative and the
+			 * claim below fails. */
+			if (ring->capacity <= ring->mask &&
+			    (int64_t)(pos - __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED)) >=
+			    (int64_t)ring->capacity)
+				return -1;
+			/* Try to claim it */
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Consumers have not caught up yet: ring is full */
+			return -1;
+		} else {
+			/* Another producer got here first */
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+			cpu_relax();
+		}
+	}
+
+	memcpy(slot_data(ring, pos), elem, ring->elem_size);
+	__atomic_store_n(slot_seq(ring, pos), pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int mpmc_pop(struct mpmc * ring, void * elem)
+{
+	uint64_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+	uint64_t seq;
+	int64_t diff;
+
+	for (;;) {
+		seq = __atomic_load_n(slot_seq(ring, pos), __ATOMIC_ACQUIRE);
+		diff = (int64_t)seq - (int64_t)(pos + 1);
+
+		if (diff == 0) {
+			/* Slot holds an element for this lap: try to claim it */
+			if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Producers have not filled this slot yet: ring is empty */
+			return -1;
+		} else {
+			/* Another consumer got here first */
+			pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+			cpu_relax();
+		}
+	}
+
+	memcpy(elem, slot_data(ring, pos), ring->elem_size);
+	/* Hand the slot back to producers for the next lap */
+	__atomic_store_n(slot_seq(ring, pos), pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+size_t mpmc_size(struct mpmc * ring)
+{
+	uint64_t head = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+	return (tail > head) ? (size_t)(tail - head) : 0;
+}
+
+size_t mpmc_snapshot(struct mpmc * ring, void * out, size_t max)
+{
+	uint64_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_ACQUIRE);
+	uint64_t seq;
+	size_t count = 0;
+
+	for (; pos < tail && count < max; pos++) {
+		/* Copy the slot only if it holds this lap's element both
+		 * before and after the copy, as in a seqlock */
+		if (__atomic_load_n(slot_seq(ring, pos), __ATOMIC_ACQUIRE) != pos + 1)
+			continue;
+		memcpy((uint8_t *)out + count * ring->elem_size, slot_data(ring, pos), ring->elem_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq = __atomic_load_n(slot_seq(ring, pos), __ATOMIC_RELAXED);
+		if (seq == pos + 1)
+			count++;
+	}
+
+	return count;
+}
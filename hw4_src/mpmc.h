@@ -0,0 +1,70 @@
+/*******************************************************************************
+* Lock-Free Bounded MPMC Ring (header)
+*
+* Description:
+*     A bounded multi-producer/multi-consumer ring buffer that does not rely
+*     on any lock. Every slot carries a sequence number that tells producers
+*     and consumers whether the slot is free or holds a valid element for
+*     the current lap around the ring, so that enqueue and dequeue only
+*     need a single compare-and-swap on the shared head or tail index.
+*
+* Notes:
+*     Elements are copied by value and have a fixed size chosen at
+*     initialization time. The number of slots is rounded up to the next
+*     power of two, but the ring never holds more elements than the
+*     capacity it was asked for. The ring itself never blocks: callers that need to sleep while
+*     the ring is empty must pair it with their own notification mechanism.
+*
+*******************************************************************************/
+
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of a cache line on the platforms we care about */
+#define CACHE_LINE_SIZE 64
+
+/* Hint to the CPU that we are spinning on a contended location */
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+
+struct mpmc {
+	/* Written by producers only */
+	uint64_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Written by consumers only */
+	uint64_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Read-only after initialization */
+	uint8_t * slots __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t mask;
+	/* Most elements held at once, up to mask + 1 */
+	uint64_t capacity;
+	size_t elem_size;
+	size_t slot_size;
+};
+
+/* Initialize the ring to hold up to <capacity> elements of
+ * <elem_size> bytes each. Returns 0 on success, -1 on failure. */
+int mpmc_init(struct mpmc * ring, size_t capacity, size_t elem_size);
+
+/* Release the memory held by the ring */
+void mpmc_destroy(struct mpmc * ring);
+
+/* Copy <elem> into the ring. Returns 0 on success and -1 if the ring
+ * is full, or holds <capacity> elements. */
+int mpmc_push(struct mpmc * ring, const void * elem);
+
+/* Copy the oldest element of the ring into <elem>. Returns 0 on
+ * success and -1 if the ring is empty. */
+int mpmc_pop(struct mpmc * ring, void * elem);
+
+/* Approximate number of elements currently in the ring */
+size_t mpmc_size(struct mpmc * ring);
+
+/* Copy up to <max> of the queued elements, oldest first, into <out>
+ * without removing them. Slots that are being modified concurrently
+ * are skipped, so the result is a best-effort snapshot. Returns the
+ * number of elements copied. */
+size_t mpmc_snapshot(struct mpmc * ring, void * out, size_t max);
+
+#endif
@@ -0,0 +1,224 @@
+/*******************************************************************************
+* Queue Contention Benchmark
+*
+* Description:
+*     Measures the throughput of the two request queue backends used by
+*     server_multi as the number of consumer threads grows: the semaphore-
+*     protected circular buffer and the lock-free MPMC ring. To isolate the
+*     cost of the queue, both runs hand requests over through the same
+*     counting semaphore, which producers post after every enqueue, rather
+*     than the idle-list futex wakeups of the server.
+*
+* Usage:
+*     <build directory>/mpmc_bench [-p <producers>] [-w <max workers>]
+*                                  [-n <requests per run>] [-q <queue size>]
+*
+* Notes:
+*     For every worker count from 1 to the maximum, prints one line with the
+*     number of dequeued requests per second for each backend.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "common.h"
+#include "mpmc.h"
+
+/* Same size as the requests moving through the server queue */
+struct bench_item {
+	uint64_t id;
+	uint64_t payload[11];
+};
+
+/* Sentinel that tells a consumer to exit */
+#define POISON_ID UINT64_MAX
+
+struct bench_queue {
+	int lock_free;
+	struct mpmc * ring;
+	/* Semaphore-protected circular buffer, as in server_multi */
+	sem_t mutex;
+	struct bench_item * items;
+	int front, rear, size, max_size;
+	/* Wakes up consumers. A plain semaphore handoff, the same for
+	 * both backends, not the wakeups of server_multi. */
+	sem_t notify;
+};
+
+struct bench_args {
+	struct bench_queue * queue;
+	uint64_t count;
+	int consumers;
+};
+
+static int bench_push(struct bench_queue * q, struct bench_item * item)
+{
+	if (q->lock_free) {
+		if (mpmc_push(q->ring, item) < 0)
+			return -1;
+	} else {
+		sem_wait(&q->mutex);
+		if (q->size == q->max_size) {
+			sem_post(&q->mutex);
+			return -1;
+		}
+		q->items[q->rear] = *item;
+		q->rear = (q->rear + 1) % q->max_size;
+		q->size++;
+		sem_post(&q->mutex);
+	}
+	sem_post(&q->notify);
+	return 0;
+}
+
+static void bench_pop(struct bench_queue * q, struct bench_item * item)
+{
+	sem_wait(&q->notify);
+	if (q->lock_free) {
+		while (mpmc_pop(q->ring, item) < 0)
+			;
+	} else {
+		sem_wait(&q->mutex);
+		*item = q->items[q->front];
+		q->front = (q->front + 1) % q->max_size;
+		q->size--;
+		sem_post(&q->mutex);
+	}
+}
+
+static void * producer_main(void * arg)
+{
+	struct bench_args * args = (struct bench_args *)arg;
+	struct bench_item item;
+	uint64_t i;
+
+	memset(&item, 0, sizeof(item));
+	for (i = 0; i < args->count; i++) {
+		item.id = i;
+		/* Like a client that gets rejected, just try again */
+		while (bench_push(args->queue, &item) < 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void * consumer_main(void * arg)
+{
+	struct bench_args * args = (struct bench_args *)arg;
+	struct bench_item item;
+
+	do {
+		bench_pop(args->queue, &item);
+	} while (item.id != POISON_ID);
+	return NULL;
+}
+
+/* Push <total> items through the queue with the given number of
+ * producers and consumers and return the throughput in items/s */
+static double run_bench(int lock_free, int producers, int consumers,
+			uint64_t total, int queue_size)
+{
+	struct bench_queue q;
+	struct bench_args args;
+	struct bench_item poison;
+	struct timespec start, end;
+	pthread_t prod[producers], cons[consumers];
+	double elapsed;
+	int i;
+
+	memset(&q, 0, sizeof(q));
+	q.lock_free = lock_free;
+	q.max_size = queue_size;
+	sem_init(&q.mutex, 0, 1);
+	sem_init(&q.notify, 0, 0);
+	if (lock_free) {
+		q.ring = (struct mpmc *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct mpmc));
+		mpmc_init(q.ring, queue_size, sizeof(struct bench_item));
+	} else {
+		q.items = (struct bench_item *)malloc(queue_size * sizeof(struct bench_item));
+	}
+
+	args.queue = &q;
+	args.count = total / producers;
+	args.consumers = consumers;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < consumers; i++)
+		pthread_create(&cons[i], NULL, consumer_main, &args);
+	for (i = 0; i < producers; i++)
+		pthread_create(&prod[i], NULL, producer_main, &args);
+	for (i = 0; i < producers; i++)
+		pthread_join(prod[i], NULL);
+
+	poison.id = POISON_ID;
+	for (i = 0; i < consumers; i++)
+		while (bench_push(&q, &poison) < 0)
+			sched_yield();
+	for (i = 0; i < consumers; i++)
+		pthread_join(cons[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = TSPEC_TO_DOUBLE(end) - TSPEC_TO_DOUBLE(start);
+
+	if (lock_free) {
+		mpmc_destroy(q.ring);
+		free(q.ring);
+	} else {
+		free(q.items);
+	}
+	sem_destroy(&q.mutex);
+	sem_destroy(&q.notify);
+
+	return (double)(args.count * producers) / elapsed;
+}
+
+int main (int argc, char ** argv)
+{
+	int producers = 1, max_workers = 16, queue_size = 1024, opt, w;
+	uint64_t total = 1000000;
+
+	while ((opt = getopt(argc, argv, "p:w:n:q:")) != -1) {
+		switch (opt) {
+		case 'p':
+			producers = atoi(optarg);
+			break;
+		case 'w':
+			max_workers = atoi(optarg);
+			break;
+		case 'n':
+			total = strtoull(optarg, NULL, 10);
+			break;
+		case 'q':
+			queue_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p <producers>] [-w <max workers>] "
+				"[-n <requests per run>] [-q <queue size>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (producers <= 0 || max_workers <= 0 || queue_size <= 0 || total == 0) {
+		fprintf(stderr, "All parameters must be greater than 0.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("# producers=%d requests=%lu queue_size=%d\n", producers, total, queue_size);
+	printf("# workers mutex_req/s lockfree_req/s speedup\n");
+	for (w = 1; w <= max_workers; w++) {
+		double mutex_tput = run_bench(0, producers, w, total, queue_size);
+		double lf_tput = run_bench(1, producers, w, total, queue_size);
+		printf("%d %.0f %.0f %.2f\n", w, mutex_tput, lf_tput, lf_tput / mutex_tput);
+		fflush(stdout);
+	}
+
+	return EXIT_SUCCESS;
+}
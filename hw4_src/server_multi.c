@@ -6,14 +6,144 @@
 *     First Out (FIFO) order. The server binds to the specified port number
 *     provided as a parameter upon launch. It launches multiple threads to
 *     process incoming requests and allows to specify a maximum queue size.
+*     Any number of clients can be connected at the same time: an epoll-based
+*     event loop accepts new connections and reads requests from all of them
+*     into the shared queue, and each response is routed back to the socket
+*     the corresponding request arrived on.
 *
 * Usage:
-*     <build directory>/server -q <queue_size> -w <workers> <port_number>
+*     <build directory>/server -q <queue_size> -w <workers> [-l]
+*                              [-d <policy>] [-s] [-p <policy>]
+*                              [-k <slo_factor>] [-r <max_response>]
+*                              [-m <target>[,<interval>]]
+*                              [-e <min_workers>,<max_workers>]
+*                              [-t <spin_time>] [-c <cpu_list>]
+*                              [-o <log_file>]
+*                              [-g <max_responses>[,<max_delay>]]
+*                              [-i <backend>] [-S <shards>]
+*                              [-x <socket_path>] [-u] [-T]
+*                              [-b <high>[,<low>]] [-f <quota>] [-N]
+*                              [-W <kernels>[:<working_set>]]
+*                              [-V <instruction_set>] <port_number>
 *
 * Parameters:
 *     port_number - The port number to bind the server to.
 *     queue_size  - The maximum number of queued requests
 *     workers     - The number of workers to start to process requests
+*     -l          - Use the lock-free queue backend
+*     policy      - shared (default): all workers pull from one queue.
+*                   rr, jsq, p2c: every worker owns a queue of queue_size
+*                   entries, and new requests are dispatched round-robin,
+*                   to the shortest queue, or to the shorter of two random
+*                   queues, respectively
+*     -s          - With per-worker queues, let idle workers steal
+*                   requests from the queues of their peers
+*     -p          - Order of service of queued requests: fifo (default),
+*                   sjn (shortest job next; srpt is an alias, as requests
+*                   are never preempted), edf (earliest deadline first) or
+*                   drr (fair queueing: every connection gets a sub-queue,
+*                   and the workers serve the sub-queues by deficit
+*                   round-robin, charging every request its length, so
+*                   that each connection gets an equal share of the
+*                   workers' time whatever its request rate). drr
+*                   requires the shared queue
+*     quota       - Under drr, the most requests a connection may have
+*                   queued: any more are rejected right away, without
+*                   affecting the other connections (default half of
+*                   queue_size)
+*     -k          - Under edf, the deadline of a request is its arrival
+*                   plus this multiple of its length (default 10)
+*     max_response - Admission control: reject right away any request whose
+*                   predicted response time, i.e. the length of the work
+*                   admitted ahead of it divided by the number of workers
+*                   serving its queue plus its own length, exceeds this
+*                   many seconds. Disabled by default
+*     target      - CoDel active queue management: once the time spent in
+*     interval      the queue by requests has stayed above target seconds
+*                   for interval seconds (default 0.1), reject requests at
+*                   the head of the queue at an increasing rate until it
+*                   goes back below target. Disabled by default
+*     min_workers - Elastic pool: start with <workers> threads and add
+*     max_workers   one, up to max_workers, whenever the backlog or the
+*                   utilization stays high, and park one, down to
+*                   min_workers, whenever they sit idle for a second.
+*                   Requires the shared queue
+*     spin_time   - Microseconds an idle worker spins waiting for a new
+*                   request before going to sleep (default 0). Either way,
+*                   each new request wakes up exactly one sleeping worker
+*     cpu_list    - CPUs to pin the workers to, e.g. 0-3,8. Worker i runs
+*                   on the i-th CPU of the list, wrapping around, and its
+*                   stack and state are allocated on that CPU's NUMA node
+*     log_file    - Write the T, Q and X lines to this file in binary form
+*                   through per-thread buffers, instead of printing them
+*                   under a global lock. Decode it with evlog_decode
+*     max_responses - Response coalescing: buffer the responses of every
+*     max_delay     connection and send them together once max_responses
+*                   (at most 64) have piled up, max_delay microseconds
+*                   have passed (default 100), or the worker finds its
+*                   queue empty, whichever comes first. Disabled by default
+*     backend     - epoll (default): a single thread waits for events on
+*                   all the sockets with epoll and reads and accepts with
+*                   non-blocking calls, while workers send responses.
+*                   uring: the same thread drives everything through
+*                   io_uring, with multishot accept and receives into
+*                   provided buffers, and sends the responses handed over
+*                   by the workers. Falls back to epoll if unsupported
+*     shards      - Shared-nothing mode: run this many independent servers
+*                   (shards) in the same process, each with its own
+*                   SO_REUSEPORT listening socket on port_number, event
+*                   loop, queues and workers, so that the kernel spreads
+*                   the connections across them. The CPUs given with -c
+*                   (all the online CPUs by default) are split in as many
+*                   groups, and each shard runs on its own group. The
+*                   event log of shard i, if any, goes to <log_file>.i
+*     socket_path - Shared-memory transport: also serve clients on the same
+*                   host that attach through the UNIX socket at this path
+*                   (see shmring.h). Their requests and responses go
+*                   through rings in memory shared with the server, and a
+*                   dedicated thread admits their requests to the same
+*                   queues as the TCP clients. With shards, shard i
+*                   listens on <socket_path>.i
+*     -u          - Datagram mode: bind a UDP socket to port_number instead
+*                   of accepting TCP connections. Every datagram carries
+*                   one or more requests, which are picked up in batches
+*                   with recvmmsg(), and the responses go back to the
+*                   address each request came from in batches with
+*                   sendmmsg(). Requests that never arrive or arrive out
+*                   of order are counted per client address. Always uses
+*                   the epoll backend
+*     -T          - Kernel receive timestamps: have the kernel timestamp
+*                   incoming data (SO_TIMESTAMPING) and record, next to the
+*                   time the server picked a request up, the time its data
+*                   reached the socket, converted to CLOCK_MONOTONIC. T
+*                   lines then carry it as a sixth field, after the
+*                   completion time. Over TCP, the timestamp of a read is
+*                   that of the newest data it returned. Only with the
+*                   epoll backend
+*     high        - Backpressure: instead of rejecting requests when the
+*     low           queue is full, stop reading from a connection as soon
+*                   as the queue its next request goes to holds high
+*                   requests, and resume once the queue is down to low
+*                   (default high / 2). The requests pile up in the socket
+*                   and TCP flow control slows the client down, so no
+*                   request is rejected unless admission control or CoDel
+*                   are enabled too. high may not exceed queue_size. Only
+*                   for TCP clients with the epoll backend
+*     -N          - Print the timestamps of T and X lines as integer
+*                   nanoseconds instead of seconds with six decimals.
+*                   Internally, timestamps are always kept in nanoseconds
+*     kernels     - Synthetic workload: instead of busywaiting, serve a
+*     working_set   request by running a service kernel for its length
+*                   (see workload.h): busy, gemm (SIMD matrix products),
+*                   chase (pointer chasing), copy (streaming memcpy) or
+*                   hash. With a comma-separated list, the requests go
+*                   through the kernels in turn by request ID. chase and
+*                   copy each touch working_set KiB per worker (default
+*                   8192). Kernels are calibrated at startup, so that
+*                   requests take their length on an idle machine
+*     instruction_set - Kernels of the image operations (see imgproc.h):
+*                   avx2, sse or scalar. Defaults to the most capable one
+*                   the CPU supports
 *
 * Author:
 *     Renato Mancuso
@@ -29,6 +159,15 @@
 *     server. The server relies on a FIFO mechanism to handle requests, thus
 *     guaranteeing the order of processing. If the queue is full at the time a
 *     new request is received, the request is rejected with a negative ack.
+*     The server runs until it receives SIGINT or SIGTERM.
+*     Every connection may speak either version of the protocol (see
+*     common.h): legacy clients send fixed-size requests, while version 2
+*     clients send frames of compact requests and may ask for responses
+*     that carry the time the server received, started and completed them.
+*     Version 2 clients may also upload images and then send requests
+*     that name an operation to run on one of them: the workers run the
+*     operation instead of busywaiting, and the length of such a request
+*     is only the client's estimate, used for scheduling and admission.
 *
 *******************************************************************************/
 
@@ -38,6 +177,14 @@
 #include <stdlib.h>
 #include <sched.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/* Needed for the epoll-based event loop */
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 
 /* Needed for wait(...) */
 #include <sys/types.h>
@@ -46,18 +193,130 @@
 /* Needed for semaphores */
 #include <semaphore.h>
 
+/* Needed to put idle workers to sleep */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
 /* Include struct definitions and other libraries that need to be
  * included by both client and server */
 #include "common.h"
+#include "mpmc.h"
+#include "worker_thread.h"
+#include "evlog.h"
+#include "uring.h"
+#include "shmring.h"
+#include "workload.h"
+#include "imgproc.h"
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+/* Needed for kernel receive timestamps */
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#define BACKLOG_COUNT 4096
+/* Maximum number of events retrieved by a single epoll_wait() call */
+#define MAX_EVENTS 256
+/* Size of the receive buffer of every connection, i.e. how many bytes
+ * of requests a single recv() can pick up */
+#define CONN_BUF_SIZE 4096
+/* Most requests enqueued at once, as many as fit in a full buffer */
+#define MAX_BATCH (CONN_BUF_SIZE / sizeof(struct request_v2))
+/* Most responses coalesced into a single send() */
+#define MAX_COALESCE 64
+/* Most bytes of responses that may wait for a client to make room in
+ * its socket: a client that lets more pile up does not read them, and
+ * is disconnected */
+#define CONN_MAX_PENDING (1024 * 1024)
+
+/* Most bytes of pixels stored for all the clients together: past
+ * that, uploads are rejected as if their table of images was full */
+#define IMG_BUDGET (1024ul * 1024 * 1024)
+
+/* Datagram mode: most datagrams received or sent with a single system
+ * call, largest datagram accepted, most client addresses whose
+ * sequence of request IDs is followed, and most responses waiting for
+ * the event loop to send them */
+#define UDP_BATCH      64
+#define UDP_DGRAM_SIZE 1024
+#define UDP_MAX_PEERS  4096
+#define UDP_RESPONSES  4096
+
+/* Protocol spoken on a connection, told from its first bytes */
+#define PROTO_UNKNOWN 0
+#define PROTO_V1      1 /* Fixed-size requests, bare responses */
+#define PROTO_V2      2 /* Frames of compact requests, see common.h */
+
+/* I/O backends driving the client sockets */
+#define IO_EPOLL 0 /* epoll and non-blocking system calls */
+#define IO_URING 1 /* io_uring, or epoll if the kernel lacks support */
 
-#define BACKLOG_COUNT 100
+/* io_uring backend: submission ring entries, number (a power of two)
+ * and size of the provided receive buffers */
+#define URING_ENTRIES  1024
+#define URING_BGID     0
+#define URING_BUFFERS  256
+#define URING_BUF_SIZE CONN_BUF_SIZE
+
+/* What a completion is about, kept in the low bits of its user_data
+ * next to the connection, response or timer concerned */
+#define URING_TAG_MASK 7
+#define URING_ACCEPT   1
+#define URING_RECV     2
+#define URING_SEND     3
+#define URING_WAKE     4
+#define URING_TIMER    5
 #define USAGE_STRING				\
 	"Missing parameter. Exiting.\n"		\
-	"Usage: %s -q <queue size> -w <number of threads> <port_number>\n"
+	"Usage: %s -q <queue size> -w <number of threads> [-l] "	\
+	"[-d <shared|rr|jsq|p2c>] [-s] [-p <fifo|sjn|edf|drr>] [-k <slo factor>] "	\
+	"[-r <max response time>] [-m <target>[,<interval>]] "	\
+	"[-e <min workers>,<max workers>] [-t <spin time>] [-c <cpu list>] "	\
+	"[-o <log file>] [-g <max responses>[,<max delay>]] [-i <epoll|uring>] "	\
+	"[-S <shards>] [-x <socket path>] [-u] [-T] [-b <high>[,<low>]] [-f <quota>] [-N] "	\
+	"[-W <kernels>[:<working set>]] [-V <avx2|sse|scalar>] <port_number>\n"
+
+/* Maximum number of CPUs that can be listed with -c */
+#define MAX_CPUS 1024
+
+/* Policies to choose the queue a new request is dispatched to */
+#define DISPATCH_SHARED 0 /* One queue shared by all the workers */
+#define DISPATCH_RR     1 /* Per-worker queues, round-robin */
+#define DISPATCH_JSQ    2 /* Per-worker queues, join-shortest-queue */
+#define DISPATCH_P2C    3 /* Per-worker queues, power-of-two-choices */
+
+/* Order in which queued requests are served */
+#define QUEUE_FIFO 0 /* First in, first out */
+#define QUEUE_SJN  1 /* Shortest job next */
+#define QUEUE_EDF  2 /* Earliest deadline first */
+#define QUEUE_DRR  3 /* Deficit round-robin across connections */
+
+/* Default deadline of a request under EDF, as a multiple of its
+ * length past its arrival */
+#define DEFAULT_SLO_FACTOR 10.0
+
+/* Default interval over which the CoDel sojourn time must stay above
+ * target before requests are dropped, in seconds */
+#define DEFAULT_CODEL_INTERVAL 0.1
+
+/* Default longest time a response is held back to be coalesced with
+ * the following ones, in microseconds */
+#define DEFAULT_COALESCE_DELAY 100.0
+
+/* Elastic worker pool: how often the pool size is reconsidered, for
+ * how many consecutive periods the load must stay above/below the
+ * thresholds before a worker is added/parked, and the utilization
+ * thresholds themselves. Growing reacts fast and shrinking slowly,
+ * so that the pool does not oscillate. */
+#define ELASTIC_TICK_NS      (10 * 1000 * 1000)
+#define ELASTIC_GROW_TICKS   3
+#define ELASTIC_SHRINK_TICKS 100
+#define ELASTIC_HIGH_UTIL    0.9
+#define ELASTIC_LOW_UTIL     0.5
 
-/* 4KB of stack for the worker thread */
-#define STACK_SIZE (4096)
+/* How long an idle worker sleeps before looking for work to steal */
+#define STEAL_INTERVAL_NS (100 * 1000)
 
 /* Mutex needed to protect the threaded printf. DO NOT TOUCH */
 sem_t * printf_mutex;
@@ -72,376 +331,4182 @@ sem_t * printf_mutex;
 
 /* START - Variables needed to protect the shared queue. DO NOT TOUCH */
 sem_t * queue_mutex;
-sem_t * queue_notify;
 /* END - Variables needed to protect the shared queue. DO NOT TOUCH */
 
+/* Set asynchronously by the signal handler to stop the event loop */
+static volatile sig_atomic_t server_done = 0;
+
+/* Print the timestamps of the T and X lines as integer nanoseconds
+ * rather than seconds (-N) */
+static int log_nsec = 0;
+
+/* Bytes of pixels stored or being uploaded, held to IMG_BUDGET */
+static size_t img_bytes = 0;
+
+/* Sub-queue of a connection under QUEUE_DRR: the slots of the queue's
+ * request array holding its requests, in order of arrival, and its
+ * place in the round */
+struct drr_flow {
+	int head, tail, count;
+	uint64_t deficit_ns;
+	int active;
+	struct connection * next_active;
+};
+
+/* State of a single client connection. The event loop holds one
+ * reference for as long as the socket is open for reading, and every
+ * request sitting in the queue or in service holds one more, so the
+ * socket is only closed (and its descriptor number possibly reused)
+ * once the last response has been sent. */
+struct connection {
+	int conn_socket;
+	int refcount;
+	/* Shared-memory channel of the client, NULL for TCP clients.
+	 * The socket is then the UNIX socket of the channel. */
+	struct shm_channel * shm;
+	/* Set for the single pseudo-connection of datagram mode, whose
+	 * socket is the UDP socket shared by all the clients */
+	int udp;
+	/* PROTO_* version of the protocol, and with version 2, the
+	 * requests of the current frame not received yet and the
+	 * flags of the frame */
+	int proto;
+	int frame_left;
+	uint8_t frame_flags;
+	/* Bytes received but not parsed yet: at most the beginning of
+	 * a request, if recv() split one in two */
+	size_t in_bytes;
+	uint8_t in_buf[CONN_BUF_SIZE];
+	/* Responses waiting to be sent, when coalescing, and whether
+	 * the connection is on the list of the coalescer (which then
+	 * holds a reference on it) */
+	sem_t out_lock;
+	int out_count;
+	size_t out_bytes;
+	uint8_t out_buf[MAX_COALESCE * sizeof(struct response_v2)];
+	int dirty;
+	struct connection * next_dirty;
+	/* Bytes the socket could not take yet, to be sent in order
+	 * before anything else, and whether the event loop watches for
+	 * room in the socket. With io_uring, all the bytes go there and
+	 * the event loop sends them. Protected by out_lock. */
+	uint8_t * pend_buf;
+	size_t pend_len, pend_cap;
+	int want_out;
+	/* Set once the epoll event loop no longer reads from the socket.
+	 * From then on, the socket stays registered only while bytes are
+	 * pending on it, and the loop holds a reference until they are
+	 * out. Protected by out_lock, but only the loop writes it. */
+	int closing;
+	/* Epoll instance the socket is registered with, -1 if none, or
+	 * else outbox of the io_uring event loop serving it, if any, and
+	 * next connection with bytes for the loop to send */
+	int epfd;
+	struct outbox * box;
+	struct connection * next_writable;
+	/* Bytes taken from pend_buf that the io_uring event loop is
+	 * sending, up to <send_off> of which are out. Only the event loop
+	 * touches them. */
+	uint8_t * send_buf;
+	size_t send_len, send_off, send_cap;
+	/* Set while the event loop does not read from the connection
+	 * because of backpressure, along with when it stopped, the queue
+	 * the held back request waits for, and the next paused
+	 * connection */
+	int paused;
+	nstime_t paused_at;
+	struct queue * paused_on;
+	struct connection * next_paused;
+	/* Requests admitted to a QUEUE_DRR queue and not taken by a
+	 * worker yet, and the sub-queue holding them */
+	int queued;
+	struct drr_flow flow;
+	/* Images uploaded by the client, which operations name by
+	 * their index, and the upload in progress: the image being
+	 * received (NULL if its pixels are discarded), the ID of the
+	 * upload request and the pixels still to come (0 until the
+	 * header of the upload is in) */
+	struct image * images[IMG_MAX_IMAGES];
+	int num_images;
+	struct image * upload;
+	uint64_t upload_id;
+	size_t upload_left;
+};
+
+/* State of response coalescing, shared by all the connections */
+struct coalescer {
+	int max_batch;
+	uint64_t max_delay_ns;
+	/* Connections with responses waiting to be sent */
+	sem_t lock;
+	struct connection * dirty;
+	/* Responses sent, and send() calls used to send them */
+	uint64_t responses;
+	uint64_t sends;
+};
+
 struct timeRequest {
 	struct request request;
-	struct timespec receipt_timestamp;
-	struct timespec start_timestamp;
-	struct timespec completion_timestamp;
+	struct connection * conn;
+	/* Queue the request was admitted to */
+	struct queue * origin;
+	nstime_t receipt_timestamp;
+	/* When the data of the request reached the socket, according to
+	 * the kernel, zero if unknown */
+	nstime_t kernel_timestamp;
+	nstime_t start_timestamp;
+	nstime_t completion_timestamp;
+	/* PROTO_V2_TIMING if the response must carry the timestamps */
+	uint8_t resp_flags;
+	/* Image operation to run instead of busywaiting, IMG_OP_NONE
+	 * if none, and the image of the connection to run it on */
+	uint16_t op;
+	const struct image * image;
+	/* Where the request came from, in datagram mode */
+	struct sockaddr_in peer;
+	/* Priority in the queue (lower is served first) and arrival
+	 * order among requests with the same priority */
+	uint64_t sched_key;
+	uint64_t sched_seq;
+};
+
+/* State of the CoDel active queue management of a queue */
+struct codel {
+	sem_t lock;
+	uint64_t target_ns;
+	uint64_t interval_ns;
+	/* When the sojourn time will have been above target for a
+	 * whole interval, 0 if it is below target */
+	uint64_t first_above_ns;
+	int dropping;
+	uint64_t drop_next_ns;
+	uint64_t count, last_count;
+	/* Total number of requests dropped */
+	uint64_t drops;
+};
+
+/* A worker waiting for requests to be added to a queue. It sleeps on
+ * <futex> until a producer sets it to 1 and wakes it up. */
+struct waiter {
+	uint32_t futex;
+	struct waiter * next;
 };
 
 struct queue {
 	/* ADD REQUIRED FIELDS */
 	struct timeRequest* requestQueue;
 	int front, rear, size, maxSize;
+	/* Lock-free backend, used instead of requestQueue when set */
+	struct mpmc * ring;
+	/* Protection for this queue */
+	sem_t * mutex;
+	/* Workers sleeping until a request is added, most recently
+	 * idle first, the spinlock protecting the list, and how long
+	 * workers spin before joining it */
+	struct waiter * idle;
+	int idle_lock;
+	uint64_t spin_ns;
+	/* Requests taken from this queue that are still in service */
+	int in_service;
+	/* Active queue management state, NULL if disabled */
+	struct codel * codel;
+	/* Total length of the requests admitted to this queue that are
+	 * not completed yet, and number of workers serving it */
+	uint64_t pending_ns;
+	int num_servers;
+	/* QUEUE_* order of service. QUEUE_SJN and QUEUE_EDF keep
+	 * requestQueue organized as a binary min-heap. */
+	int policy;
+	double slo_factor;
+	uint64_t enqueued;
+	/* QUEUE_DRR: link from every slot of requestQueue to the next
+	 * one of the same sub-queue or of the free list, the connections
+	 * with queued requests in the order of the round, the quantum
+	 * added to a deficit (the largest cost seen so far), and the
+	 * most requests a connection may have queued */
+	int * drr_next;
+	int drr_free;
+	struct connection * drr_head, * drr_tail;
+	uint64_t drr_quantum_ns;
+	int drr_quota;
 };
 
 struct connection_params {
 	/* ADD REQUIRED FIELDS */
 	int queueSize;
 	int numWorkers;
+	int lockFree;
+	int dispatch;
+	int workStealing;
+	int schedPolicy;
+	double sloFactor;
+	double maxResponse;
+	double codelTarget;
+	double codelInterval;
+	double spinTime;
+	int coalesceMax;
+	double coalesceDelay;
+	int ioBackend;
+	int numShards;
+	/* CPUs the workers are pinned to, round-robin */
+	int * cpus;
+	int numCpus;
+	int minWorkers;
+	int maxWorkers;
+	/* Binary event log, NULL to print events to stdout */
+	char * logPath;
+	/* UNIX socket of the shared-memory transport, NULL if unused */
+	char * shmPath;
+	int udp;
+	int rxTimestamps;
+	/* Backpressure watermarks, 0 if disabled */
+	int bpHigh, bpLow;
+	/* Per-connection quota under QUEUE_DRR */
+	int drrQuota;
+	/* Service kernels, NULL to busywait */
+	struct workload * workload;
+	/* IMG_SIMD_* instruction set of the image operations */
+	int imgSimd;
 };
 
 struct worker_params {
 	/* ADD REQUIRED FIELDS */
 	struct queue * serverQueue; 
-	int conn_socket; 
 	int thread_id;
-	int worker_done;
+	volatile int worker_done;
+	/* All the workers, to steal from when the local queue is empty */
+	struct worker_params ** peers;
+	int num_peers;
+	int work_stealing;
+	uint64_t steals;
+	uint64_t completed;
+	/* Used to sleep while there is nothing to do */
+	struct waiter waiter;
+	/* Elastic pool the worker belongs to, NULL if the pool is
+	 * fixed. A worker whose ID is not below the number of active
+	 * workers parks on <park>. */
+	struct elastic_pool * pool;
+	sem_t park;
+	int started;
+	/* Thread running the worker, and the CPU it is pinned to (-1
+	 * if none) */
+	struct worker_thread thread;
+	int cpu;
+	/* Ring of the binary event log, NULL if disabled, and room for
+	 * the IDs of the queued requests, for a copy of the queue they are
+	 * taken from and, without the event log, for the line listing
+	 * them */
+	struct evlog_ring * log;
+	uint64_t * ids;
+	struct timeRequest * snap;
+	char * line;
+	/* Response coalescing state, NULL if disabled */
+	struct coalescer * coalescer;
+	/* Where to hand responses with the io_uring backend, NULL to
+	 * send them directly */
+	struct outbox * outbox;
+	/* Backpressure state, NULL if disabled */
+	struct backpressure * bp;
+	/* Service kernels and their state in this worker, NULL to
+	 * busywait */
+	const struct workload * workload;
+	struct workload_ctx work;
+	/* Instruction set of the image operations, and where the worker
+	 * writes their results */
+	int img_simd;
+	struct image img_out;
+};
+
+/* State of the controller that grows and shrinks the set of workers
+ * serving the shared queue */
+struct elastic_pool {
+	int min_workers, max_workers;
+	volatile int active;
+	struct worker_params ** workers;
+	struct queue * queue;
+	/* Exponential moving average of the fraction of busy workers */
+	double utilization;
+	/* Consecutive periods spent above/below the thresholds */
+	int above_ticks, below_ticks;
+	uint64_t grows, shrinks;
 };
 
-/* Helper function to perform queue initialization */
-void queue_init(struct queue * the_queue, size_t queue_size)
+/* State needed by the event loop to pick the queue each new request
+ * is added to */
+struct dispatcher {
+	int policy;
+	struct queue * queues;
+	int num_queues;
+	/* Next queue for round-robin */
+	int next;
+	/* Random state for power-of-two-choices */
+	unsigned int seed;
+	/* Response time objective for admission control, 0 if disabled */
+	uint64_t slo_ns;
+	/* Rejections because the queue was full, or because the request
+	 * was predicted to miss the response time objective */
+	uint64_t rejected_full;
+	uint64_t rejected_slo;
+	/* Rejections because the connection used up its quota */
+	uint64_t rejected_quota;
+	/* Ring of the binary event log, NULL if disabled */
+	struct evlog_ring * log;
+	/* Admitted requests not added to <batch_queue> yet */
+	struct timeRequest batch[MAX_BATCH];
+	int batch_count;
+	struct queue * batch_queue;
+	/* Number of recv() calls, and of requests they picked up */
+	uint64_t recv_calls;
+	uint64_t received;
+	/* Backpressure state, NULL to reject requests when the queue is
+	 * full */
+	struct backpressure * bp;
+	/* Kernel receive timestamps: whether to ask for them, the one of
+	 * the data being ingested (zero if unknown), and the requests
+	 * that had one along with their total time in the socket */
+	int rx_timestamps;
+	nstime_t rx_stamp;
+	uint64_t rx_stamped;
+	uint64_t rx_delay_ns;
+};
+
+/* A response on its way to the datagram event loop, which sends it */
+struct outgoing {
+	struct connection * conn;
+	struct sockaddr_in peer;
+	struct response_v2 resp;
+};
+
+/* Sequence of the request IDs received from one client address in
+ * datagram mode. Clients number their requests from 0. */
+struct udp_peer {
+	struct sockaddr_in addr;
+	int used;
+	uint64_t next_id;
+};
+
+/* State of datagram mode */
+struct udp_state {
+	struct connection * conn;
+	struct udp_peer * peers;
+	uint64_t num_peers;
+	/* Receive buffers, UDP_DGRAM_SIZE bytes for each datagram of a
+	 * batch */
+	uint8_t * bufs;
+	/* Requests skipped over by a higher ID, and received after a
+	 * higher ID, i.e. late */
+	uint64_t skipped;
+	uint64_t reordered;
+	/* Responses sent, sendmmsg() calls, and responses dropped
+	 * because the socket buffer was full */
+	uint64_t send_calls;
+	uint64_t sent;
+	uint64_t send_drops;
+};
+
+/* Responses handed by the workers to the datagram event loop, or
+ * connections with bytes pending for the io_uring event loop to send.
+ * The loop sets <sleeping> before waiting for
+ * completions, and the first thread to find it set wakes the loop up
+ * through eventfd <efd>. */
+struct outbox {
+	struct mpmc ring;
+	int efd;
+	int sleeping;
+	sem_t lock;
+	struct connection * writable;
+};
+
+/* Backpressure: the event loop stops reading from a connection whose
+ * next request would find its queue at <high> requests, and sets
+ * <waiting>. The first worker to take a request from a queue down to
+ * <low> requests clears it and wakes the loop up through eventfd <efd>,
+ * which then reads from the paused connections again. */
+struct backpressure {
+	int high, low;
+	int efd;
+	int waiting;
+	/* Connections not read from */
+	struct connection * paused;
+	/* Times a connection was paused, and total time connections
+	 * spent paused */
+	uint64_t pauses;
+	uint64_t paused_ns;
+};
+
+/* Totals of a run of the server, to be aggregated across shards */
+struct server_stats {
+	uint64_t received;
+	uint64_t completed;
+	uint64_t rejected;
+	uint64_t steals;
+};
+
+/* State of the thread serving the clients of the shared-memory
+ * transport. It admits their requests through a dispatcher of its own
+ * that shares the queues of the event loop. */
+struct shm_server {
+	const char * path;
+	int sockfd;
+	/* Written to stop the thread */
+	int stopfd;
+	struct dispatcher disp;
+	struct worker_thread thread;
+	/* Clients served, and times the thread was woken up */
+	uint64_t clients;
+	uint64_t wakeups;
+};
+
+/* A shard of the server in shared-nothing mode, running its own event
+ * loop on its own listening socket */
+struct shard {
+	int id;
+	int sockfd;
+	struct connection_params params;
+	struct server_stats stats;
+	struct worker_thread thread;
+};
+
+/* State of the loop serving the clients, whatever the I/O backend */
+struct server_loop {
+	int sockfd;
+	struct dispatcher * disp;
+	struct elastic_pool * pool;
+	struct coalescer * coalescer;
+	/* Timers driving the elastic pool and the coalescer, -1 if
+	 * unused */
+	int timerfd, flushfd;
+	/* Signals are only accepted while waiting for events */
+	sigset_t wait_mask;
+	/* io_uring backend, NULL if epoll is used, and where the
+	 * responses to send show up */
+	struct uring * ring;
+	struct outbox * outbox;
+	/* Datagram mode, NULL if serving TCP connections */
+	struct udp_state * udp;
+};
+
+/* Take an additional reference on connection <conn> */
+void conn_get(struct connection * conn)
 {
-	the_queue->requestQueue = (struct timeRequest*)malloc(queue_size * sizeof(struct timeRequest));
-	the_queue->front = the_queue->rear = the_queue->size = 0;
-	the_queue->maxSize = queue_size;
+	__atomic_add_fetch(&conn->refcount, 1, __ATOMIC_RELAXED);
 }
 
-/* Add a new request <request> to the shared queue <the_queue> */
-int add_to_queue(struct timeRequest to_add, struct queue * the_queue)
+/* Free image <img>, and give its pixels back to the budget */
+static void img_release(struct image * img)
 {
-	int retval = 0;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-    the_queue->requestQueue[the_queue->rear] = to_add;
-    the_queue->rear = (the_queue->rear + 1) % the_queue->maxSize;
-    the_queue->size++;
-	/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
-	sem_post(queue_notify);
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
+	__atomic_sub_fetch(&img_bytes, (size_t)img->width * img->height, __ATOMIC_RELAXED);
+	image_free(img);
+	free(img);
 }
 
-/* Get a new request <request> from the shared queue <the_queue> */
-struct timeRequest get_from_queue(struct queue * the_queue)
+/* Drop a reference on connection <conn>. The last one to go closes
+ * the socket and releases the connection state. */
+void conn_put(struct connection * conn)
 {
-	struct timeRequest retval;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	int i;
 
-	/* WRITE YOUR CODE HERE! */
-	if (the_queue->size > 0) {
-        // Retrieve request from front of the queue
-        retval = the_queue->requestQueue[the_queue->front];
-        the_queue->front = (the_queue->front + 1) % the_queue->maxSize;
-        the_queue->size--;
+	if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		/* No request can name the images any more */
+		for (i = 0; i < conn->num_images; i++)
+			img_release(conn->images[i]);
+		if (conn->upload)
+			img_release(conn->upload);
+		free(conn->pend_buf);
+		free(conn->send_buf);
+		if (conn->shm) {
+			shm_close(conn->shm);
+			free(conn->shm);
+		} else {
+			shutdown(conn->conn_socket, SHUT_RDWR);
+			close(conn->conn_socket);
+		}
+		free(conn);
 	}
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
 }
 
-void dump_queue_status(struct queue * the_queue)
+/* Set up the state of a new connection on socket <sockfd>, with the
+ * reference held by the event loop */
+struct connection * conn_create(int sockfd)
 {
-	int i;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	struct connection * conn = (struct connection *)malloc(sizeof(struct connection));
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	sync_printf("Q:[");
-	for (i = 0; i < the_queue->size; i++) {
-        sync_printf("R%lu", the_queue->requestQueue[(the_queue->front + i) % the_queue->maxSize].request.req_id);
-        if (i < the_queue->size - 1) {
-            sync_printf(",");
-        }
-    }
-    sync_printf("]\n");
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+	conn->conn_socket = sockfd;
+	conn->refcount = 1;
+	conn->shm = NULL;
+	conn->udp = 0;
+	conn->proto = PROTO_UNKNOWN;
+	conn->frame_left = 0;
+	conn->frame_flags = 0;
+	conn->in_bytes = 0;
+	sem_init(&conn->out_lock, 0, 1);
+	conn->out_count = 0;
+	conn->out_bytes = 0;
+	conn->dirty = 0;
+	conn->pend_buf = NULL;
+	conn->pend_len = 0;
+	conn->pend_cap = 0;
+	conn->want_out = 0;
+	conn->closing = 0;
+	conn->epfd = -1;
+	conn->box = NULL;
+	conn->send_buf = NULL;
+	conn->send_len = 0;
+	conn->send_off = 0;
+	conn->send_cap = 0;
+	conn->paused = 0;
+	conn->paused_on = NULL;
+	conn->queued = 0;
+	memset(&conn->flow, 0, sizeof(struct drr_flow));
+	conn->num_images = 0;
+	conn->upload = NULL;
+	conn->upload_left = 0;
+	return conn;
 }
 
-/* Main logic of the worker thread */
-int worker_main (void * arg)
+/* Add the <len> bytes at <buf> to those pending on connection <conn>,
+ * which must be protected by its out_lock. A client that let
+ * CONN_MAX_PENDING bytes pile up is not reading its responses: since
+ * the bytes it misses would leave the rest of the stream unreadable,
+ * it is disconnected instead. */
+static void conn_queue_locked(struct connection * conn, const uint8_t * buf, size_t len)
 {
-	struct timespec now;
-	struct worker_params * params = (struct worker_params *)arg;
-	int conn_socket = params->conn_socket; 
-	int threadID = params->thread_id;
-	int worker_done = params->worker_done;
-
-	/* Print the first alive message. */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	sync_printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
-
-	/* Okay, now execute the main logic. */
-	while (!worker_done) {
-		struct timeRequest req;
-		struct response resp;
-
-		req = get_from_queue(params->serverQueue);
-		clock_gettime(CLOCK_MONOTONIC, &req.start_timestamp);
-		//busywait for specified request length
-		get_elapsed_busywait(req.request.req_length.tv_sec, req.request.req_length.tv_nsec);
-		clock_gettime(CLOCK_MONOTONIC, &req.completion_timestamp);
+	size_t cap = conn->pend_cap ? conn->pend_cap : CONN_BUF_SIZE;
+	uint8_t * grown;
 
-		//Provide a response
-		resp.req_id = req.request.req_id;
-		send(conn_socket, &resp, sizeof(struct response), 0);
-		sync_printf("T%d R%lu:%.6f,%.6f,%.6f,%.6f,%.6f\n", threadID, req.request.req_id, TSPEC_TO_DOUBLE(req.request.req_timestamp), TSPEC_TO_DOUBLE(req.request.req_length), TSPEC_TO_DOUBLE(req.receipt_timestamp),TSPEC_TO_DOUBLE(req.start_timestamp), TSPEC_TO_DOUBLE(req.completion_timestamp));
-		dump_queue_status(params->serverQueue);
+	while (cap < conn->pend_len + len)
+		cap *= 2;
+	if (conn->pend_len + len > CONN_MAX_PENDING) {
+		sync_printf("INFO: Client does not read its responses. Socket = %d\n", conn->conn_socket);
+		goto drop;
+	}
+	if (cap > conn->pend_cap) {
+		grown = (uint8_t *)realloc(conn->pend_buf, cap);
+		if (grown == NULL) {
+			ERROR_INFO();
+			perror("Unable to buffer responses");
+			goto drop;
+		}
+		conn->pend_buf = grown;
+		conn->pend_cap = cap;
 	}
+	memcpy(conn->pend_buf + conn->pend_len, buf, len);
+	conn->pend_len += len;
+	return;
 
-	return EXIT_SUCCESS;
+drop:
+	/* The event loop notices the hangup on its next read */
+	shutdown(conn->conn_socket, SHUT_RDWR);
+	conn->pend_len = 0;
 }
 
-/* This function will start the worker thread wrapping around the
- * clone() system call*/
-int start_worker(struct worker_params *params, void * worker_stack)
+/* Send as many of the bytes pending on connection <conn>, which must
+ * be protected by its out_lock, as its socket takes. Returns -1 if
+ * some are left. */
+static int conn_send_pending_locked(struct connection * conn)
 {
-	/* Throw an error if no stack was passed. */
-	if (worker_stack == NULL)
-		return -1;
-	int retval = clone(worker_main, worker_stack + STACK_SIZE, CLONE_THREAD | CLONE_VM | CLONE_SIGHAND | CLONE_FS | CLONE_FILES | CLONE_SYSVSEM, params);
+	ssize_t sent;
 
-	return retval;
+	while (conn->pend_len > 0) {
+		sent = send(conn->conn_socket, conn->pend_buf, conn->pend_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return -1;
+			/* The client is gone, and the event loop notices
+			 * on its next read */
+			conn->pend_len = 0;
+			break;
+		}
+		conn->pend_len -= sent;
+		memmove(conn->pend_buf, conn->pend_buf + sent, conn->pend_len);
+	}
+	return 0;
 }
 
-/* Main function to handle connection with the client. This function
- * takes in input conn_socket and returns only when the connection
- * with the client is interrupted. */
-void handle_connection(int conn_socket, struct connection_params conn_params)
+void outbox_want_out(struct outbox * box, struct connection * conn);
+
+/* Make sure the bytes pending on connection <conn>, which must be
+ * protected by its out_lock, go out once its socket has room */
+static void conn_want_out_locked(struct connection * conn)
 {
-	struct timeRequest * req;
-	struct queue * the_queue;
-	size_t in_bytes;
+	struct epoll_event ev;
+	struct pollfd pfd;
 
-	/* Now handle queue allocation and initialization */
-	/* IMPLEMENT ME !!*/
-	the_queue = (struct queue*)malloc(sizeof(struct queue)); // Allocate memory for the queue
-	queue_init(the_queue, conn_params.queueSize);
+	if (conn->want_out)
+		return;
 
-	/* IMPLEMENT ME!! Write a loop to start and initialize all the worker threads*/
-	// An array of worker_params
-	struct worker_params worker_params_array[conn_params.numWorkers];
-	// An array to store the process IDs of worker threads
-	pid_t worker_thread_ids[conn_params.numWorkers];	
-
-	for (int i = 0; i < conn_params.numWorkers; i++) {
-		// Populate each element of the array
-		worker_params_array[i].serverQueue = the_queue;
-		worker_params_array[i].conn_socket = conn_socket;
-		worker_params_array[i].thread_id = i;
-		worker_params_array[i].worker_done = 0; // Variable used to control termination of the worker thread
-		void *worker_stack = malloc(STACK_SIZE);
-		worker_thread_ids[i] = start_worker(&worker_params_array[i], worker_stack);
-
-		if (worker_thread_ids[i] < 0) {
-			free(worker_stack);
-			free(the_queue);
-			ERROR_INFO();
-			perror("Unable to create worker thread!");
+	if (conn->epfd >= 0) {
+		conn->want_out = 1;
+		ev.data.ptr = conn;
+		if (conn->closing) {
+			/* The socket is no longer registered */
+			conn_get(conn);
+			ev.events = EPOLLOUT;
+			epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->conn_socket, &ev);
 			return;
-		} 
-		sync_printf("INFO: Worker thread started. Thread ID = %d\n", worker_params_array[i].thread_id);
+		}
+		/* While backpressure keeps the socket out of epoll, this
+		 * fails, and bp_resume() asks for EPOLLOUT instead */
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+		epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->conn_socket, &ev);
+		return;
+	}
+	if (conn->box) {
+		conn->want_out = 1;
+		conn_get(conn);
+		outbox_want_out(conn->box, conn);
+		return;
 	}
 
-	/* We are ready to proceed with the rest of the request
-	 * handling logic. */
+	/* No event loop to tell: wait for room right here */
+	pfd.fd = conn->conn_socket;
+	pfd.events = POLLOUT;
+	while (conn_send_pending_locked(conn) < 0)
+		poll(&pfd, 1, -1);
+}
 
-	req = (struct timeRequest *)malloc(sizeof(struct timeRequest));
+/* Send the <len> bytes at <buf> on the socket of connection <conn>,
+ * which must be protected by its out_lock, without blocking: what the
+ * socket does not take right away is sent once it has room, after the
+ * bytes already waiting for it, if any */
+static void conn_write_locked(struct connection * conn, const void * buf, size_t len)
+{
+	ssize_t sent = 0;
 
-	do {
-		/* IMPLEMENT ME: Receive next request from socket. */
-		/* IMPLEMENT ME: Attempt to enqueue or reject request! */
-		in_bytes = recv(conn_socket, &req->request, sizeof(struct request), 0);
-		clock_gettime(CLOCK_MONOTONIC, &req->receipt_timestamp);
-		/* Don't just return if in_bytes is 0 or -1. Instead
-		 * skip the response and break out of the loop in an
-		 * orderly fashion so that we can de-allocate the req
-		 * and resp varaibles, and shutdown the socket. */
-		if (in_bytes > 0) {
-			struct timespec rejectTimestamp;
-			struct response resp;
-			resp.req_id = req->request.req_id;
-			/* if queue is full, reject request */
-			if (the_queue->size >= the_queue->maxSize) {
-				clock_gettime(CLOCK_MONOTONIC, &rejectTimestamp);
-				resp.status = 1;  // 1 for rejected
-				// Send the rejection response to the client
-				// Don't forget to log the rejection as mentioned in your requirements.
-				send(conn_socket, &resp, sizeof(struct response), 0);
-				sync_printf("X%lu:%.6f,%.6f,%.6f\n", resp.req_id, TSPEC_TO_DOUBLE(req->request.req_timestamp), TSPEC_TO_DOUBLE(req->request.req_length), TSPEC_TO_DOUBLE(rejectTimestamp));
-
-				//dump queue status upon rejection (commented out for codebuddy submission)
-				// dump_queue_status(params.serverQueue);
-			}
-			else {
-				resp.status = 0;
-				add_to_queue(*req, the_queue);
-			}
+	/* Under io_uring, only the event loop sends, so that nothing
+	 * overtakes a send in flight */
+	if (conn->pend_len == 0 && conn->box == NULL) {
+		do {
+			sent = send(conn->conn_socket, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (sent < 0 && errno == EINTR);
+		if (sent < 0) {
+			/* The client is gone, and the event loop notices
+			 * on its next read */
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return;
+			sent = 0;
 		}
+		if ((size_t)sent == len)
+			return;
+	}
 
-	} while (in_bytes > 0);
+	conn_queue_locked(conn, (const uint8_t *)buf + sent, len - sent);
+	if (conn->pend_len > 0)
+		conn_want_out_locked(conn);
+}
 
-	/* loop to gracefully terminate all the worker threads */
-	printf("INFO: Asserting termination flag for worker threads...\n");
-	// for (int i = 0; i < conn_params.numWorkers; i++) {
-    // 	// Access the worker_params at index i
-    // 	struct worker_params current_worker = worker_params_array[i];
-	// 	current_worker.worker_done = 1;
-	// 	/* Just in case the thread is stuck on the notify semaphore, * wake it up */
-	// 	sem_post(queue_notify);
-	// 	printf("Status: %d", waitpid(-1, NULL, 0));
-	// 	sync_printf("INFO: Worker thread %d exited.\n", current_worker.thread_id);
-	// }
+/* The socket of connection <conn> has room again: send what is
+ * pending on it, and stop watching for room once it is all out */
+void conn_output_ready(struct connection * conn)
+{
+	struct epoll_event ev;
 
-	free(the_queue);
-	free(req);
-	shutdown(conn_socket, SHUT_RDWR);
-	close(conn_socket);
-	printf("INFO: Client disconnected.\n");
+	sem_wait(&conn->out_lock);
+	if (conn_send_pending_locked(conn) == 0 && conn->want_out) {
+		conn->want_out = 0;
+		if (conn->closing) {
+			/* That was all the event loop kept it for */
+			epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->conn_socket, NULL);
+			sem_post(&conn->out_lock);
+			conn_put(conn);
+			return;
+		}
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->conn_socket, &ev);
+	}
+	sem_post(&conn->out_lock);
 }
 
-/* Template implementation of the main function for the FIFO
- * server. The server must accept in input a command line parameter
- * with the <port number> to bind the server to. */
-int main (int argc, char ** argv) {
-	int sockfd, retval, accepted, optval, opt;
-	in_port_t socket_port;
-	struct sockaddr_in addr, client;
-	struct in_addr any_address;
-	socklen_t client_len;
+/* The epoll event loop is done reading from connection <conn>: drop
+ * its reference, unless bytes are still pending on the socket, in which
+ * case it only watches for room to send them */
+void conn_close_input(struct connection * conn)
+{
+	struct epoll_event ev;
 
-	struct connection_params conn_params;
+	sem_wait(&conn->out_lock);
+	conn->closing = 1;
+	if (conn->want_out) {
+		/* The socket is out of epoll if backpressure paused it */
+		ev.events = EPOLLOUT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->conn_socket, &ev) < 0)
+			epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->conn_socket, &ev);
+		sem_post(&conn->out_lock);
+		return;
+	}
+	epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->conn_socket, NULL);
+	sem_post(&conn->out_lock);
+	conn_put(conn);
+}
 
-	/* Parse all the command line arguments */
-	while ((opt = getopt(argc, argv, "q:w:")) != -1) {
-        switch (opt) {
-			/* 1. Detect the -q parameter and set aside the queue size in conn_params */
-            case 'q':
-                conn_params.queueSize = atoi(optarg);
-                break;
-			/* 2. Detect the -w parameter and set aside the number of threads to launch */
-            case 'w':
-                conn_params.numWorkers = atoi(optarg);
-                break;
-            default:
-                fprintf(stderr, "Usage: %s -q <queue_size> -w <num_workers>\n", argv[0]);
-                exit(EXIT_FAILURE);
-        }
-    }
+/* Send all the responses buffered for connection <conn>, which must
+ * be protected by its out_lock */
+void conn_flush_locked(struct coalescer * co, struct connection * conn)
+{
+	if (conn->out_count == 0)
+		return;
+	conn_write_locked(conn, conn->out_buf, conn->out_bytes);
+	__atomic_add_fetch(&co->responses, conn->out_count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&co->sends, 1, __ATOMIC_RELAXED);
+	conn->out_count = 0;
+	conn->out_bytes = 0;
+}
 
-	// Check if the required options are provided
-    if (conn_params.queueSize <= 0 || conn_params.numWorkers <= 0) {
-        fprintf(stderr, "Both queue size and number of workers must be greater than 0.\n");
-        exit(EXIT_FAILURE);
-    }
+/* Send response <resp> on connection <conn> right away, through
+ * whichever transport the client uses */
+void conn_send(struct connection * conn, struct response_v2 * resp)
+{
+	struct response legacy;
 
-	/* 3. Detect the port number to bind the server socket to (see HW1 and HW2) */
-	if (optind < argc) {
-		socket_port = strtol(argv[optind], NULL, 10);
-		printf("INFO: setting server port as: %d\n", socket_port);
-	} else {
-		ERROR_INFO();
-		fprintf(stderr, USAGE_STRING, argv[0]);
-		return EXIT_FAILURE;
+	if (conn->shm == NULL) {
+		sem_wait(&conn->out_lock);
+		conn_write_locked(conn, resp, RESP_V2_SIZE(resp));
+		sem_post(&conn->out_lock);
+		return;
 	}
 
-	/* Now onward to create the right type of socket */
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	/* The rings carry version 1 responses, and only one thread at
+	 * a time may add to them */
+	memset(&legacy, 0, sizeof(legacy));
+	legacy.req_id = resp->req_id;
+	legacy.status = resp->status;
+	sem_wait(&conn->out_lock);
+	shm_push_response(conn->shm, &legacy);
+	sem_post(&conn->out_lock);
+}
 
-	if (sockfd < 0) {
-		ERROR_INFO();
-		perror("Unable to create socket");
-		return EXIT_FAILURE;
+/* Send response <resp> to request <req> right away, through whichever
+ * transport its client uses */
+void respond_now(struct timeRequest * req, struct response_v2 * resp)
+{
+	if (req->conn->udp)
+		sendto(req->conn->conn_socket, resp, RESP_V2_SIZE(resp), MSG_NOSIGNAL | MSG_DONTWAIT,
+		       (struct sockaddr *)&req->peer, sizeof(req->peer));
+	else
+		conn_send(req->conn, resp);
+}
+
+/* Fill in the response to request <req> with status <status>. Only
+ * the first RESP_V2_SIZE() bytes go on the wire, which for a client
+ * that did not ask for timestamps is exactly a version 1 response. */
+void make_response(struct timeRequest * req, uint8_t status, struct response_v2 * resp)
+{
+	memset(resp, 0, sizeof(struct response_v2));
+	resp->req_id = req->request.req_id;
+	resp->status = status;
+	resp->flags = req->resp_flags;
+	if (resp->flags & PROTO_V2_TIMING) {
+		resp->receipt_ns = req->receipt_timestamp;
+		resp->start_ns = req->start_timestamp;
+		resp->completion_ns = req->completion_timestamp;
 	}
+}
 
-	/* Before moving forward, set socket to reuse address */
-	optval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&optval, sizeof(optval));
+/* Send response <resp> on connection <conn>. With coalescing, the
+ * response is buffered and sent along with the following ones, right
+ * away if <flush> is set or the buffer is full, or else when the
+ * coalescer next runs. */
+void send_response(struct coalescer * co, struct connection * conn, struct response_v2 * resp, int flush)
+{
+	/* Responses pile up in a shared-memory ring anyway */
+	if (co == NULL || conn->shm) {
+		conn_send(conn, resp);
+		return;
+	}
 
-	/* Convert INADDR_ANY into network byte order */
-	any_address.s_addr = htonl(INADDR_ANY);
+	sem_wait(&conn->out_lock);
+	memcpy(conn->out_buf + conn->out_bytes, resp, RESP_V2_SIZE(resp));
+	conn->out_bytes += RESP_V2_SIZE(resp);
+	conn->out_count++;
 
-	/* Time to bind the socket to the right port  */
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(socket_port);
-	addr.sin_addr = any_address;
+	if (flush || conn->out_count >= co->max_batch) {
+		conn_flush_locked(co, conn);
+	} else if (!conn->dirty) {
+		/* Make sure the response goes out within the delay */
+		conn->dirty = 1;
+		conn_get(conn);
+		sem_wait(&co->lock);
+		conn->next_dirty = co->dirty;
+		co->dirty = conn;
+		sem_post(&co->lock);
+	}
 
-	/* Attempt to bind the socket with the given parameters */
-	retval = bind(sockfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+	sem_post(&conn->out_lock);
+}
 
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to bind socket");
-		return EXIT_FAILURE;
+/* Wake the event loop of <box> up if it waits for completions */
+static void outbox_wake(struct outbox * box)
+{
+	uint64_t one = 1;
+
+	/* Pairs with the fence in serve_uring() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&box->sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&box->sleeping, 0, __ATOMIC_ACQ_REL)) {
+		if (write(box->efd, &one, sizeof(one)) < 0)
+			perror("Unable to wake up the event loop");
 	}
+}
 
-	/* Let us now proceed to set the server to listen on the selected port */
-	retval = listen(sockfd, BACKLOG_COUNT);
+/* Hand response <resp> to request <req> over to the event loop, along
+ * with a reference on its connection. Returns -1 if there is no room
+ * left, in which case the caller keeps both. */
+int outbox_push(struct outbox * box, struct timeRequest * req, struct response_v2 * resp)
+{
+	struct outgoing out;
 
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to listen on socket");
-		return EXIT_FAILURE;
+	out.conn = req->conn;
+	out.peer = req->peer;
+	out.resp = *resp;
+	if (mpmc_push(&box->ring, &out) < 0)
+		return -1;
+
+	outbox_wake(box);
+	return 0;
+}
+
+/* Ask the event loop of <box> to send what is pending on connection
+ * <conn> once its socket has room, handing it a reference on <conn> */
+void outbox_want_out(struct outbox * box, struct connection * conn)
+{
+	sem_wait(&box->lock);
+	conn->next_writable = box->writable;
+	box->writable = conn;
+	sem_post(&box->lock);
+	outbox_wake(box);
+}
+
+/* Set up <box> with room for <size> responses, none if 0. Returns -1
+ * on failure. */
+int outbox_init(struct outbox * box, size_t size)
+{
+	box->ring.slots = NULL;
+	if (size && mpmc_init(&box->ring, size, sizeof(struct outgoing)) < 0)
+		return -1;
+	box->sleeping = 0;
+	sem_init(&box->lock, 0, 1);
+	box->writable = NULL;
+	box->efd = eventfd(0, EFD_CLOEXEC);
+	if (box->efd < 0) {
+		mpmc_destroy(&box->ring);
+		return -1;
 	}
+	return 0;
+}
 
-	/* Ready to accept connections! */
-	printf("INFO: Waiting for incoming connection...\n");
-	client_len = sizeof(struct sockaddr_in);
-	accepted = accept(sockfd, (struct sockaddr *)&client, &client_len);
+/* Send the responses buffered on every connection */
+void coalescer_flush(struct coalescer * co)
+{
+	struct connection * conn, * next;
 
-	if (accepted == -1) {
-		ERROR_INFO();
-		perror("Unable to accept connections");
-		return EXIT_FAILURE;
+	sem_wait(&co->lock);
+	conn = co->dirty;
+	co->dirty = NULL;
+	sem_post(&co->lock);
+
+	for (; conn; conn = next) {
+		next = conn->next_dirty;
+		sem_wait(&conn->out_lock);
+		conn_flush_locked(co, conn);
+		conn->dirty = 0;
+		sem_post(&conn->out_lock);
+		conn_put(conn);
 	}
+}
 
-	/* Initilize threaded printf mutex */
-	printf_mutex = (sem_t *)malloc(sizeof(sem_t));
-	retval = sem_init(printf_mutex, 0, 1);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize printf mutex");
-		return EXIT_FAILURE;
+/* Helper function to perform queue initialization. Access to the
+ * queue is protected by <mutex>. When <lock_free> is set, the queue
+ * is backed by a lock-free MPMC ring and <mutex> is never taken. */
+int queue_init(struct queue * the_queue, size_t queue_size, int lock_free,
+	       sem_t * mutex)
+{
+	the_queue->front = the_queue->rear = the_queue->size = 0;
+	the_queue->maxSize = queue_size;
+	the_queue->requestQueue = NULL;
+	the_queue->ring = NULL;
+	the_queue->mutex = mutex;
+	the_queue->idle = NULL;
+	the_queue->idle_lock = 0;
+	the_queue->spin_ns = 0;
+	the_queue->in_service = 0;
+	the_queue->pending_ns = 0;
+	the_queue->codel = NULL;
+	the_queue->num_servers = 1;
+	the_queue->policy = QUEUE_FIFO;
+	the_queue->slo_factor = DEFAULT_SLO_FACTOR;
+	the_queue->enqueued = 0;
+	the_queue->drr_next = NULL;
+	the_queue->drr_head = the_queue->drr_tail = NULL;
+	the_queue->drr_quantum_ns = 1;
+	the_queue->drr_quota = 0;
+
+	if (!lock_free) {
+		the_queue->requestQueue = (struct timeRequest*)malloc(queue_size * sizeof(struct timeRequest));
+		return (the_queue->requestQueue == NULL) ? -1 : 0;
 	}
 
-	/* Initialize queue protection variables. DO NOT TOUCH. */
-	queue_mutex = (sem_t *)malloc(sizeof(sem_t));
-	queue_notify = (sem_t *)malloc(sizeof(sem_t));
-	retval = sem_init(queue_mutex, 0, 1);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize queue mutex");
-		return EXIT_FAILURE;
+	the_queue->ring = (struct mpmc *)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct mpmc));
+	if (the_queue->ring == NULL)
+		return -1;
+	if (mpmc_init(the_queue->ring, queue_size, sizeof(struct timeRequest)) < 0) {
+		free(the_queue->ring);
+		the_queue->ring = NULL;
+		return -1;
 	}
-	retval = sem_init(queue_notify, 0, 0);
-	if (retval < 0) {
-		ERROR_INFO();
-		perror("Unable to initialize queue notify");
-		return EXIT_FAILURE;
+	return 0;
+}
+
+/* Release the memory of <the_queue>, which may have been only partly
+ * set up, along with its fair queueing and CoDel state */
+void queue_destroy(struct queue * the_queue)
+{
+	if (the_queue->ring) {
+		mpmc_destroy(the_queue->ring);
+		free(the_queue->ring);
 	}
-	/* DONE - Initialize queue protection variables */
+	free(the_queue->requestQueue);
+	free(the_queue->drr_next);
+	free(the_queue->codel);
+}
+
+/* Number of requests currently sitting in the queue */
+int queue_size(struct queue * the_queue)
+{
+	if (the_queue->ring)
+		return mpmc_size(the_queue->ring);
+	return the_queue->size;
+}
 
-	/* Ready to handle the new connection with the client. */
-	handle_connection(accepted, conn_params);
+/* Whether request <a> should be served before request <b> */
+static inline int sched_before(struct timeRequest * a, struct timeRequest * b)
+{
+	return (a->sched_key < b->sched_key) ||
+		(a->sched_key == b->sched_key && a->sched_seq < b->sched_seq);
+}
+
+/* Insert <to_add> in the heap kept in the queue's request array.
+ * Must be called with the queue protected and not full. */
+void heap_push(struct queue * the_queue, struct timeRequest * to_add)
+{
+	struct timeRequest * heap = the_queue->requestQueue;
+	int i = the_queue->size++, parent;
+
+	/* Sift the hole up until the parent goes first */
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!sched_before(to_add, &heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = *to_add;
+}
+
+/* Remove the root of the heap kept in the queue's request array.
+ * Must be called with the queue protected and not empty. */
+struct timeRequest heap_pop(struct queue * the_queue)
+{
+	struct timeRequest * heap = the_queue->requestQueue;
+	struct timeRequest retval = heap[0];
+	struct timeRequest * last = &heap[--the_queue->size];
+	int i = 0, child;
+
+	/* Sift the last element down from the root */
+	while ((child = 2 * i + 1) < the_queue->size) {
+		if (child + 1 < the_queue->size && sched_before(&heap[child + 1], &heap[child]))
+			child++;
+		if (!sched_before(&heap[child], last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = *last;
+	return retval;
+}
+
+/* Switch <the_queue>, which must be empty, to QUEUE_DRR with at most
+ * <quota> requests queued per connection. Returns -1 on failure. */
+int drr_init(struct queue * the_queue, int quota)
+{
+	int i;
+
+	the_queue->drr_next = (int *)malloc(the_queue->maxSize * sizeof(int));
+	if (the_queue->drr_next == NULL)
+		return -1;
+	/* Every slot starts out free */
+	for (i = 0; i < the_queue->maxSize; i++)
+		the_queue->drr_next[i] = i + 1;
+	the_queue->drr_next[the_queue->maxSize - 1] = -1;
+	the_queue->drr_free = 0;
+	the_queue->policy = QUEUE_DRR;
+	the_queue->drr_quota = quota;
+	return 0;
+}
+
+/* What serving request <req> costs a connection. Requests of no length
+ * still cost something, so that they take turns too. */
+static inline uint64_t drr_cost(struct timeRequest * req)
+{
+	return TSPEC_TO_NSEC(req->request.req_length) + 1;
+}
+
+/* Append <to_add> to the sub-queue of its connection, which joins the
+ * end of the round if it had nothing queued. Must be called with the
+ * queue protected and not full. */
+void drr_push(struct queue * the_queue, struct timeRequest * to_add)
+{
+	struct connection * conn = to_add->conn;
+	struct drr_flow * flow = &conn->flow;
+	int slot = the_queue->drr_free;
+
+	the_queue->drr_free = the_queue->drr_next[slot];
+	the_queue->requestQueue[slot] = *to_add;
+	the_queue->drr_next[slot] = -1;
+	if (flow->count++ == 0)
+		flow->head = slot;
+	else
+		the_queue->drr_next[flow->tail] = slot;
+	flow->tail = slot;
+	the_queue->size++;
+
+	/* With a quantum at least as large as any cost, every turn
+	 * serves at least one request */
+	if (drr_cost(to_add) > the_queue->drr_quantum_ns)
+		the_queue->drr_quantum_ns = drr_cost(to_add);
+
+	if (!flow->active) {
+		flow->active = 1;
+		flow->deficit_ns = 0;
+		flow->next_active = NULL;
+		if (the_queue->drr_tail)
+			the_queue->drr_tail->flow.next_active = conn;
+		else
+			the_queue->drr_head = conn;
+		the_queue->drr_tail = conn;
+	}
+}
+
+/* Take the next request in deficit round-robin order. The connection
+ * at the head of the round is served for as long as its deficit covers
+ * the cost of its oldest request, and otherwise gets a quantum added to
+ * its deficit and goes to the end of the round. Must be called with
+ * the queue protected and not empty. */
+struct timeRequest drr_pop(struct queue * the_queue)
+{
+	struct connection * conn;
+	struct drr_flow * flow;
+	struct timeRequest retval;
+	int slot;
+
+	for (;;) {
+		conn = the_queue->drr_head;
+		flow = &conn->flow;
+		slot = flow->head;
+		if (flow->deficit_ns >= drr_cost(&the_queue->requestQueue[slot]))
+			break;
+
+		flow->deficit_ns += the_queue->drr_quantum_ns;
+		if (conn != the_queue->drr_tail) {
+			the_queue->drr_head = flow->next_active;
+			flow->next_active = NULL;
+			the_queue->drr_tail->flow.next_active = conn;
+			the_queue->drr_tail = conn;
+		}
+	}
+
+	retval = the_queue->requestQueue[slot];
+	flow->deficit_ns -= drr_cost(&retval);
+	flow->head = the_queue->drr_next[slot];
+	the_queue->drr_next[slot] = the_queue->drr_free;
+	the_queue->drr_free = slot;
+	the_queue->size--;
+	__atomic_sub_fetch(&conn->queued, 1, __ATOMIC_RELAXED);
+
+	/* A connection with nothing left leaves the round, and does not
+	 * keep its deficit: credit is not saved up while idle */
+	if (--flow->count == 0) {
+		flow->active = 0;
+		the_queue->drr_head = flow->next_active;
+		if (the_queue->drr_head == NULL)
+			the_queue->drr_tail = NULL;
+	}
+	return retval;
+}
+
+/* Acquire/release the spinlock protecting the idle list of <the_queue> */
+static inline void idle_lock(struct queue * the_queue)
+{
+	while (__atomic_exchange_n(&the_queue->idle_lock, 1, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static inline void idle_unlock(struct queue * the_queue)
+{
+	__atomic_store_n(&the_queue->idle_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Wake up the worker that most recently went idle on <the_queue>, if
+ * any. Only that one worker is woken up, and when no worker is idle
+ * this costs a single load. */
+void queue_wake_one(struct queue * the_queue)
+{
+	struct waiter * w;
+
+	/* Pairs with the fence in wait_on_queue() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&the_queue->idle, __ATOMIC_RELAXED) == NULL)
+		return;
+
+	idle_lock(the_queue);
+	w = the_queue->idle;
+	if (w)
+		the_queue->idle = w->next;
+	idle_unlock(the_queue);
+
+	if (w) {
+		__atomic_store_n(&w->futex, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &w->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+/* Wake up all the workers idle on <the_queue> */
+void queue_wake_all(struct queue * the_queue)
+{
+	struct waiter * w, * next;
+
+	idle_lock(the_queue);
+	w = the_queue->idle;
+	the_queue->idle = NULL;
+	idle_unlock(the_queue);
+
+	for (; w; w = next) {
+		next = w->next;
+		__atomic_store_n(&w->futex, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &w->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+/* Add the <count> requests in <to_add> to the shared queue
+ * <the_queue>, acquiring the queue only once. Returns the number of
+ * requests added, which falls short of <count> if the queue fills up
+ * first. */
+int add_to_queue(struct timeRequest * to_add, int count, struct queue * the_queue)
+{
+	int i;
+
+	/* Lock-free backend: publish the requests, then wake workers.
+	 * The ring holds no more than the queue size, however many
+	 * dispatchers push at once. */
+	if (the_queue->ring) {
+		for (i = 0; i < count; i++) {
+			if (mpmc_push(the_queue->ring, &to_add[i]) < 0)
+				break;
+			queue_wake_one(the_queue);
+		}
+		return i;
+	}
+
+	/* Compute the priorities outside of the critical section */
+	for (i = 0; i < count; i++) {
+		if (the_queue->policy == QUEUE_SJN) {
+			to_add[i].sched_key = TSPEC_TO_NSEC(to_add[i].request.req_length);
+		} else if (the_queue->policy == QUEUE_EDF) {
+			to_add[i].sched_key = to_add[i].receipt_timestamp
+				+ (uint64_t)(the_queue->slo_factor * TSPEC_TO_NSEC(to_add[i].request.req_length));
+		}
+	}
+
+	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
+	sem_wait(the_queue->mutex);
+	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	/* The dispatchers only look at the size of the queue when they
+	 * admit requests: another one may have taken the room since */
+	if (count > the_queue->maxSize - the_queue->size)
+		count = the_queue->maxSize - the_queue->size;
+	for (i = 0; i < count; i++) {
+		if (the_queue->policy == QUEUE_DRR) {
+			drr_push(the_queue, &to_add[i]);
+		} else if (the_queue->policy != QUEUE_FIFO) {
+			to_add[i].sched_seq = the_queue->enqueued++;
+			heap_push(the_queue, &to_add[i]);
+		} else {
+    the_queue->requestQueue[the_queue->rear] = to_add[i];
+    the_queue->rear = (the_queue->rear + 1) % the_queue->maxSize;
+    the_queue->size++;
+		}
+	}
+	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
+	sem_post(the_queue->mutex);
+	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+
+	/* Wake up consumers only after letting go of the queue, so
+	 * that they do not immediately block on the mutex. This stops
+	 * costing anything as soon as no worker is left idle. */
+	for (i = 0; i < count; i++)
+		queue_wake_one(the_queue);
+	return count;
+}
+
+/* Remove the request at the head of <the_queue> into <req> without
+ * blocking. Returns 0 on success and -1 if there was nothing to take. */
+int try_take_from_queue(struct queue * the_queue, struct timeRequest * req)
+{
+	int retval = -1;
+
+	/* Lock-free backend. The head slot may be in the middle of
+	 * being published, in which case the queue looks non-empty
+	 * and the caller tries again. */
+	if (the_queue->ring)
+		return mpmc_pop(the_queue->ring, req);
+
+	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
+	sem_wait(the_queue->mutex);
+	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+
+	/* WRITE YOUR CODE HERE! */
+	if (the_queue->size > 0 && the_queue->policy == QUEUE_DRR) {
+		*req = drr_pop(the_queue);
+		retval = 0;
+	} else if (the_queue->size > 0 && the_queue->policy != QUEUE_FIFO) {
+		*req = heap_pop(the_queue);
+		retval = 0;
+	} else if (the_queue->size > 0) {
+        // Retrieve request from front of the queue
+        *req = the_queue->requestQueue[the_queue->front];
+        the_queue->front = (the_queue->front + 1) % the_queue->maxSize;
+        the_queue->size--;
+		retval = 0;
+	}
+	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
+	sem_post(the_queue->mutex);
+	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+	return retval;
+}
+
+/* Wait until a request might be available in <the_queue>, <done> is
+ * set, or the optional relative <timeout> expires. The worker first
+ * spins for the queue's spin budget, then adds <self> to the idle list
+ * and sleeps on its futex until a producer picks it. */
+void wait_on_queue(struct queue * the_queue, struct waiter * self,
+		   volatile int * done, const struct timespec * timeout)
+{
+	struct timespec now;
+	uint64_t spin_end;
+	struct waiter ** link;
+
+	/* Short waits are cheaper to spin through than to sleep */
+	if (the_queue->spin_ns) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		spin_end = TSPEC_TO_NSEC(now) + the_queue->spin_ns;
+		do {
+			if (queue_size(the_queue) > 0 || *done)
+				return;
+			cpu_relax();
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while (TSPEC_TO_NSEC(now) < spin_end);
+	}
+
+	__atomic_store_n(&self->futex, 0, __ATOMIC_RELAXED);
+	idle_lock(the_queue);
+	self->next = the_queue->idle;
+	the_queue->idle = self;
+	idle_unlock(the_queue);
+
+	/* Pairs with the fence in queue_wake_one(): either we see the
+	 * new request here, or the producer sees us in the idle list */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (queue_size(the_queue) == 0 && !*done)
+		syscall(SYS_futex, &self->futex, FUTEX_WAIT_PRIVATE, 0, timeout, NULL, 0);
+
+	/* Leave the idle list, unless a producer already took us out */
+	idle_lock(the_queue);
+	for (link = &the_queue->idle; *link; link = &(*link)->next) {
+		if (*link == self) {
+			*link = self->next;
+			break;
+		}
+	}
+	idle_unlock(the_queue);
+}
+
+/* Get a new request <request> from the shared queue <the_queue>. The
+ * returned request has no connection if <done> was set. */
+struct timeRequest get_from_queue(struct queue * the_queue, struct waiter * self,
+				  volatile int * done)
+{
+	struct timeRequest retval;
+
+	while (try_take_from_queue(the_queue, &retval) < 0) {
+		if (*done) {
+			retval.conn = NULL;
+			break;
+		}
+		wait_on_queue(the_queue, self, done, NULL);
+	}
+	return retval;
+}
+
+/* Number of requests queued at or being served from <the_queue> */
+int queue_load(struct queue * the_queue)
+{
+	return queue_size(the_queue) + __atomic_load_n(&the_queue->in_service, __ATOMIC_RELAXED);
+}
+
+/* Pick the queue that the next request should be added to, according
+ * to the policy of dispatcher <disp> */
+struct queue * dispatch_queue(struct dispatcher * disp)
+{
+	int i, a, b, best;
+
+	switch (disp->policy) {
+	case DISPATCH_RR:
+		best = disp->next;
+		disp->next = (disp->next + 1) % disp->num_queues;
+		break;
+	case DISPATCH_JSQ:
+		best = 0;
+		for (i = 1; i < disp->num_queues; i++)
+			if (queue_load(&disp->queues[i]) < queue_load(&disp->queues[best]))
+				best = i;
+		break;
+	case DISPATCH_P2C:
+		a = rand_r(&disp->seed) % disp->num_queues;
+		b = rand_r(&disp->seed) % disp->num_queues;
+		best = (queue_load(&disp->queues[b]) < queue_load(&disp->queues[a])) ? b : a;
+		break;
+	default:
+		best = 0;
+	}
+
+	return &disp->queues[best];
+}
+
+/* Get a new request for worker <params>. With work stealing enabled,
+ * a worker whose own queue is empty takes the oldest request of the
+ * first peer that has a backlog, and otherwise only sleeps for a short
+ * while before looking again. */
+struct timeRequest worker_get_request(struct worker_params * params)
+{
+	struct queue * own = params->serverQueue;
+	struct timeRequest retval;
+	struct timespec interval = { 0, STEAL_INTERVAL_NS };
+	int i;
+
+	if (!params->work_stealing)
+		return get_from_queue(own, &params->waiter, &params->worker_done);
+
+	while (!params->worker_done) {
+		if (try_take_from_queue(own, &retval) == 0)
+			return retval;
+
+		/* Look for work at the peers, starting from the next one
+		 * so that thieves spread across victims */
+		for (i = 1; i < params->num_peers; i++) {
+			struct queue * victim = params->peers[(params->thread_id + i) % params->num_peers]->serverQueue;
+			if (queue_size(victim) > 0 && try_take_from_queue(victim, &retval) == 0) {
+				params->steals++;
+				return retval;
+			}
+		}
+
+		/* Nothing to steal either */
+		wait_on_queue(own, &params->waiter, &params->worker_done, &interval);
+	}
+
+	retval.conn = NULL;
+	return retval;
+}
+
+/* qsort() comparator to list requests in order of service */
+int sched_cmp(const void * a, const void * b)
+{
+	struct timeRequest * ra = (struct timeRequest *)a, * rb = (struct timeRequest *)b;
+
+	if (sched_before(ra, rb))
+		return -1;
+	return sched_before(rb, ra) ? 1 : 0;
+}
+
+/* Copy the IDs of the requests in <the_queue>, in order of service,
+ * into <ids>, using <snap> as scratch space. Both must have room for
+ * the whole queue. Returns the number of IDs copied. */
+int queue_snapshot(struct queue * the_queue, uint64_t * ids, struct timeRequest * snap)
+{
+	int i, count = 0;
+	struct timeRequest * heap = NULL;
+
+	/* Only copy the request IDs while the queue is protected, and
+	 * sort them after letting go of it */
+	if (the_queue->ring) {
+		count = mpmc_snapshot(the_queue->ring, snap, the_queue->maxSize);
+		for (i = 0; i < count; i++)
+			ids[i] = snap[i].request.req_id;
+	} else {
+		/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
+		sem_wait(the_queue->mutex);
+		/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+
+		count = the_queue->size;
+		if (the_queue->policy == QUEUE_DRR) {
+			/* Connection by connection, in the order of the
+			 * round */
+			struct connection * conn;
+			int slot;
+
+			count = 0;
+			for (conn = the_queue->drr_head; conn; conn = conn->flow.next_active)
+				for (slot = conn->flow.head, i = 0; i < conn->flow.count;
+				     slot = the_queue->drr_next[slot], i++)
+					ids[count++] = the_queue->requestQueue[slot].request.req_id;
+		} else if (the_queue->policy != QUEUE_FIFO) {
+			/* Copy the heap so it can be listed in order
+			 * of service */
+			heap = snap;
+			memcpy(heap, the_queue->requestQueue, count * sizeof(struct timeRequest));
+		} else {
+			for (i = 0; i < count; i++)
+				ids[i] = the_queue->requestQueue[(the_queue->front + i) % the_queue->maxSize].request.req_id;
+		}
+
+		/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
+		sem_post(the_queue->mutex);
+		/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
+	}
+
+	if (heap) {
+		qsort(heap, count, sizeof(struct timeRequest), sched_cmp);
+		for (i = 0; i < count; i++)
+			ids[i] = heap[i].request.req_id;
+	}
+
+	return count;
+}
+
+/* Print timestamp <t> at <buf> as configured, followed by <sep>.
+ * Returns the number of characters printed. */
+static int sprint_time(char * buf, nstime_t t, const char * sep)
+{
+	if (log_nsec)
+		return sprintf(buf, "%lu%s", t, sep);
+	return sprintf(buf, "%.6f%s", nstime_to_double(t), sep);
+}
+
+/* List the requests in the queue served by the worker described by
+ * <params>, in the room it set aside for that */
+void dump_queue_status(struct worker_params * params)
+{
+	int i, count;
+	size_t len = 0;
+	uint64_t * ids = params->ids;
+	char * line = params->line;
+
+	count = queue_snapshot(params->serverQueue, ids, params->snap);
+
+	len += sprintf(line + len, "Q:[");
+	for (i = 0; i < count; i++)
+		len += sprintf(line + len, (i < count - 1) ? "R%lu," : "R%lu", ids[i]);
+	sprintf(line + len, "]\n");
+	sync_printf("%s", line);
+}
+
+/* Send a negative acknowledgement for request <req> and log the
+ * rejection, to the event log ring <log> if not NULL */
+void reject_request(struct timeRequest * req, struct evlog_ring * log)
+{
+	nstime_t rejectTimestamp;
+	struct response_v2 resp;
+	struct evlog_rec rec;
+	char line[128];
+	int len;
+
+	rejectTimestamp = nstime_now();
+	req->completion_timestamp = rejectTimestamp;
+	make_response(req, RESP_REJECTED, &resp);
+	respond_now(req, &resp);
+
+	if (log) {
+		rec.type = EVLOG_REJECT;
+		rec.data[0] = resp.req_id;
+		rec.data[1] = TSPEC_TO_NSEC(req->request.req_timestamp);
+		rec.data[2] = TSPEC_TO_NSEC(req->request.req_length);
+		rec.data[3] = rejectTimestamp;
+		evlog_append(log, &rec);
+		return;
+	}
+
+	len = sprintf(line, "X%lu:", resp.req_id);
+	len += sprint_time(line + len, tspec_to_nstime(req->request.req_timestamp), ",");
+	len += sprint_time(line + len, tspec_to_nstime(req->request.req_length), ",");
+	len += sprint_time(line + len, rejectTimestamp, "\n");
+	sync_printf("%s", line);
+}
+
+/* Log the completion of request <req> by the worker described by
+ * <params>, along with the status of the queue it serves */
+void log_completion(struct worker_params * params, struct timeRequest * req)
+{
+	struct evlog_rec rec;
+	int count;
+
+	if (params->log == NULL) {
+		char line[256];
+		int len;
+
+		len = sprintf(line, "T%d R%lu:", params->thread_id, req->request.req_id);
+		len += sprint_time(line + len, tspec_to_nstime(req->request.req_timestamp), ",");
+		len += sprint_time(line + len, tspec_to_nstime(req->request.req_length), ",");
+		len += sprint_time(line + len, req->receipt_timestamp, ",");
+		len += sprint_time(line + len, req->start_timestamp, ",");
+		if (req->kernel_timestamp) {
+			len += sprint_time(line + len, req->completion_timestamp, ",");
+			len += sprint_time(line + len, req->kernel_timestamp, "\n");
+		} else {
+			len += sprint_time(line + len, req->completion_timestamp, "\n");
+		}
+		sync_printf("%s", line);
+		dump_queue_status(params);
+		return;
+	}
+
+	rec.type = EVLOG_DONE;
+	rec.arg = params->thread_id;
+	rec.data[0] = req->request.req_id;
+	rec.data[1] = TSPEC_TO_NSEC(req->request.req_timestamp);
+	rec.data[2] = TSPEC_TO_NSEC(req->request.req_length);
+	rec.data[3] = req->receipt_timestamp;
+	rec.data[4] = req->start_timestamp;
+	rec.data[5] = req->completion_timestamp;
+	rec.data[6] = req->kernel_timestamp;
+	evlog_append(params->log, &rec);
+
+	count = queue_snapshot(params->serverQueue, params->ids, params->snap);
+	evlog_append_ids(params->log, params->ids, count);
+}
+
+/* CoDel control law: when to drop next, given that the <count>-th
+ * drop of the current dropping state happened at time <t> */
+static inline uint64_t codel_control_law(struct codel * codel, uint64_t t)
+{
+	return t + (uint64_t)(codel->interval_ns / sqrt((double)codel->count));
+}
+
+/* Decide whether the request that just left the queue protected by
+ * <codel> after waiting <sojourn_ns> should be dropped. This follows
+ * the CoDel dequeue logic one request at a time: once the sojourn time
+ * has stayed above target for a whole interval, requests at the head
+ * are dropped at a rate that grows with the square root of the number
+ * of drops, until the sojourn time goes back below target. A request
+ * that leaves the queue empty behind it is never dropped. */
+int codel_should_drop(struct codel * codel, uint64_t sojourn_ns, uint64_t now_ns, int queue_empty)
+{
+	int ok_to_drop = 0, drop = 0;
+	uint64_t delta;
+
+	sem_wait(&codel->lock);
+
+	if (sojourn_ns < codel->target_ns || queue_empty) {
+		codel->first_above_ns = 0;
+	} else if (codel->first_above_ns == 0) {
+		codel->first_above_ns = now_ns + codel->interval_ns;
+	} else if (now_ns >= codel->first_above_ns) {
+		ok_to_drop = 1;
+	}
+
+	if (codel->dropping) {
+		if (!ok_to_drop) {
+			codel->dropping = 0;
+		} else if (now_ns >= codel->drop_next_ns) {
+			codel->count++;
+			codel->drop_next_ns = codel_control_law(codel, codel->drop_next_ns);
+			drop = 1;
+		}
+	} else if (ok_to_drop) {
+		/* Resume from the previous drop rate if we were dropping
+		 * until recently */
+		delta = codel->count - codel->last_count;
+		if (delta > 1 && now_ns - codel->drop_next_ns < 16 * codel->interval_ns)
+			codel->count = delta;
+		else
+			codel->count = 1;
+		codel->drop_next_ns = codel_control_law(codel, now_ns);
+		codel->last_count = codel->count;
+		codel->dropping = 1;
+		drop = 1;
+	}
+
+	if (drop)
+		codel->drops++;
+
+	sem_post(&codel->lock);
+	return drop;
+}
+
+/* Wake up the event loop if it waits for <the_queue>, which a request
+ * just left, to drain below the low watermark of <bp> */
+void bp_release(struct backpressure * bp, struct queue * the_queue)
+{
+	uint64_t one = 1;
+
+	/* Pairs with the fence in serve_epoll() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&bp->waiting, __ATOMIC_RELAXED) && queue_size(the_queue) <= bp->low &&
+	    __atomic_exchange_n(&bp->waiting, 0, __ATOMIC_ACQ_REL)) {
+		if (write(bp->efd, &one, sizeof(one)) < 0)
+			perror("Unable to wake up the event loop");
+	}
+}
+
+/* Main logic of the worker thread */
+int worker_main (void * arg)
+{
+	struct timespec now;
+	struct worker_params * params = (struct worker_params *)arg;
+	uint8_t status;
+
+	/* Set up the working sets before taking any request, on the
+	 * NUMA node of the CPU of the worker */
+	if (params->workload && workload_ctx_init(&params->work, params->workload, params->cpu) < 0) {
+		ERROR_INFO();
+		perror("Unable to allocate the working sets");
+		params->workload = NULL;
+	}
+
+	/* Print the first alive message. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sync_printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
+
+	/* Okay, now execute the main logic. */
+	while (!params->worker_done) {
+		struct timeRequest req;
+		struct response_v2 resp;
+
+		/* Stay parked for as long as the elastic pool does not
+		 * need this worker */
+		if (params->pool && params->thread_id >= params->pool->active) {
+			sem_wait(&params->park);
+			continue;
+		}
+
+		req = worker_get_request(params);
+		/* Woken up with nothing to do, most likely to terminate */
+		if (req.conn == NULL)
+			continue;
+		req.start_timestamp = nstime_now();
+		if (params->bp)
+			bp_release(params->bp, req.origin);
+
+		/* Active queue management: drop requests at the head
+		 * while the queue is persistently standing */
+		if (req.origin->codel && codel_should_drop(req.origin->codel,
+				nstime_sub(req.start_timestamp, req.receipt_timestamp),
+				req.start_timestamp, queue_size(req.origin) == 0)) {
+			reject_request(&req, params->log);
+			__atomic_sub_fetch(&req.origin->pending_ns, TSPEC_TO_NSEC(req.request.req_length), __ATOMIC_RELAXED);
+			conn_put(req.conn);
+			continue;
+		}
+
+		__atomic_add_fetch(&params->serverQueue->in_service, 1, __ATOMIC_RELAXED);
+		//run the image operation of the request, or busywait for
+		//specified request length, or run the kernel of the
+		//request for as long
+		status = RESP_COMPLETED;
+		if (req.op != IMG_OP_NONE) {
+			if (img_run(&params->img_out, req.image, req.op, params->img_simd) < 0)
+				status = RESP_REJECTED;
+		} else if (params->workload)
+			workload_run(&params->work, workload_kernel(params->workload, req.request.req_id),
+				     TSPEC_TO_NSEC(req.request.req_length));
+		else
+			busywait_ns(TSPEC_TO_NSEC(req.request.req_length));
+		req.completion_timestamp = nstime_now();
+
+		//Provide a response. Do not hold it back if there is no
+		//more work in sight, as nothing would come to join it.
+		make_response(&req, status, &resp);
+		if (params->outbox == NULL || req.conn->shm ||
+		    outbox_push(params->outbox, &req, &resp) < 0) {
+			if (req.conn->udp)
+				respond_now(&req, &resp);
+			else
+				send_response(params->coalescer, req.conn, &resp, queue_size(params->serverQueue) == 0);
+			conn_put(req.conn);
+		}
+		__atomic_sub_fetch(&params->serverQueue->in_service, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&req.origin->pending_ns, TSPEC_TO_NSEC(req.request.req_length), __ATOMIC_RELAXED);
+		log_completion(params, &req);
+		params->completed++;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* This function will start the worker thread on a stack of its own,
+ * through the helpers of worker_thread.h */
+int start_worker(struct worker_params *params)
+{
+	return worker_thread_start(&params->thread, worker_main, params, params->cpu);
+}
+
+/* Start the worker described by <params> if it never ran before,
+ * or wake it up if it is parked. Returns -1 on failure. */
+int wake_worker(struct worker_params * params)
+{
+	if (params->started) {
+		sem_post(&params->park);
+		return 0;
+	}
+
+	if (start_worker(params) < 0) {
+		ERROR_INFO();
+		perror("Unable to create worker thread!");
+		return -1;
+	}
+	params->started = 1;
+	if (params->cpu >= 0)
+		sync_printf("INFO: Worker thread started. Thread ID = %d, CPU = %d\n", params->thread_id, params->cpu);
+	else
+		sync_printf("INFO: Worker thread started. Thread ID = %d\n", params->thread_id);
+	return 0;
+}
+
+/* Periodic step of the elastic pool controller. A worker is added
+ * when the backlog exceeds one request per active worker, or nearly
+ * all of them are busy, for ELASTIC_GROW_TICKS periods in a row. One
+ * is parked when the queue is empty and utilization stays low for
+ * ELASTIC_SHRINK_TICKS periods. Parked workers finish the request
+ * they are serving, if any, before going to sleep. */
+void elastic_adjust(struct elastic_pool * pool)
+{
+	int depth = queue_size(pool->queue);
+	int busy = __atomic_load_n(&pool->queue->in_service, __ATOMIC_RELAXED);
+	int before = pool->active;
+
+	pool->utilization = 0.9 * pool->utilization + 0.1 * busy / pool->active;
+
+	if (depth > pool->active || (depth > 0 && pool->utilization > ELASTIC_HIGH_UTIL))
+		pool->above_ticks++;
+	else
+		pool->above_ticks = 0;
+
+	if (depth == 0 && pool->utilization < ELASTIC_LOW_UTIL)
+		pool->below_ticks++;
+	else
+		pool->below_ticks = 0;
+
+	if (pool->above_ticks >= ELASTIC_GROW_TICKS && pool->active < pool->max_workers) {
+		if (wake_worker(pool->workers[pool->active]) == 0) {
+			pool->active++;
+			pool->grows++;
+		}
+		pool->above_ticks = 0;
+	} else if (pool->below_ticks >= ELASTIC_SHRINK_TICKS && pool->active > pool->min_workers) {
+		pool->active--;
+		pool->shrinks++;
+		pool->below_ticks = 0;
+	}
+
+	if (pool->active != before) {
+		pool->queue->num_servers = pool->active;
+		sync_printf("INFO: Scaling workers from %d to %d.\n", before, pool->active);
+	}
+}
+
+/* Add the requests admitted so far to their queue. Those that find
+ * it full after all are rejected, and give back what admitting them
+ * took. */
+void flush_batch(struct dispatcher * disp)
+{
+	struct queue * the_queue = disp->batch_queue;
+	struct timeRequest * req;
+	int added;
+
+	if (disp->batch_count == 0)
+		return;
+	added = add_to_queue(disp->batch, disp->batch_count, the_queue);
+	for (req = disp->batch + added; req < disp->batch + disp->batch_count; req++) {
+		if (the_queue->drr_quota)
+			__atomic_sub_fetch(&req->conn->queued, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&the_queue->pending_ns, TSPEC_TO_NSEC(req->request.req_length),
+				   __ATOMIC_RELAXED);
+		disp->rejected_full++;
+		reject_request(req, disp->log);
+		conn_put(req->conn);
+	}
+	disp->batch_count = 0;
+}
+
+/* Pick a queue for the freshly received request <req>, and either
+ * reject it or add it to the batch of requests for that queue. Returns
+ * -1, leaving the request alone, if backpressure holds it back. */
+int admit_request(struct dispatcher * disp, struct timeRequest * req)
+{
+	struct queue * the_queue;
+	uint64_t length_ns, pending_ns;
+
+	/* Load-aware policies must see the requests dispatched before
+	 * this one */
+	if (disp->policy == DISPATCH_JSQ || disp->policy == DISPATCH_P2C)
+		flush_batch(disp);
+
+	/* A request held back by backpressure still goes to the queue
+	 * it waited for */
+	the_queue = req->conn->paused_on ? req->conn->paused_on : dispatch_queue(disp);
+	req->conn->paused_on = NULL;
+	req->origin = the_queue;
+	if (disp->batch_count > 0 && disp->batch_queue != the_queue)
+		flush_batch(disp);
+
+	/* Predict the response time of the request assuming
+	 * that the work admitted before it is spread evenly
+	 * across the workers serving its queue */
+	length_ns = TSPEC_TO_NSEC(req->request.req_length);
+	pending_ns = __atomic_load_n(&the_queue->pending_ns, __ATOMIC_RELAXED);
+
+	/* With backpressure, the request waits for the queue to drain
+	 * instead, and the queue never fills up */
+	if (disp->bp && queue_size(the_queue) + disp->batch_count >= disp->bp->high) {
+		flush_batch(disp);
+		req->conn->paused_on = the_queue;
+		return -1;
+	}
+
+	/* if queue is full, or the request would complete too
+	 * late to be useful, reject request */
+	if (queue_size(the_queue) + disp->batch_count >= the_queue->maxSize) {
+		disp->rejected_full++;
+		reject_request(req, disp->log);
+	}
+	else if (disp->slo_ns && pending_ns / the_queue->num_servers + length_ns > disp->slo_ns) {
+		disp->rejected_slo++;
+		reject_request(req, disp->log);
+	}
+	/* A connection over its quota only hurts itself */
+	else if (the_queue->drr_quota &&
+		 __atomic_load_n(&req->conn->queued, __ATOMIC_RELAXED) >= the_queue->drr_quota) {
+		disp->rejected_quota++;
+		reject_request(req, disp->log);
+	}
+	else {
+		/* The queued request keeps the connection alive
+		 * until its response has been sent */
+		conn_get(req->conn);
+		if (the_queue->drr_quota)
+			__atomic_add_fetch(&req->conn->queued, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&the_queue->pending_ns, length_ns, __ATOMIC_RELAXED);
+		disp->batch[disp->batch_count++] = *req;
+		disp->batch_queue = the_queue;
+		if (disp->batch_count == (int)MAX_BATCH)
+			flush_batch(disp);
+	}
+	return 0;
+}
+
+/* Offset of CLOCK_REALTIME, which kernel timestamps are taken with,
+ * from CLOCK_MONOTONIC, in nanoseconds */
+static int64_t realtime_offset_ns(void)
+{
+	struct timespec real, mono;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	return (int64_t)TSPEC_TO_NSEC(real) - (int64_t)TSPEC_TO_NSEC(mono);
+}
+
+/* Extract the kernel receive timestamp from the control messages of
+ * <msg> into <stamp>, moved to CLOCK_MONOTONIC by <offset_ns>, or zero
+ * <stamp> if there is none */
+static void rx_timestamp(struct msghdr * msg, int64_t offset_ns, nstime_t * stamp)
+{
+	struct cmsghdr * cmsg;
+	struct scm_timestamping tss;
+
+	*stamp = 0;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+		/* Software timestamps come first */
+		memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+		if (tss.ts[0].tv_sec == 0 && tss.ts[0].tv_nsec == 0)
+			return;
+		*stamp = (nstime_t)((int64_t)tspec_to_nstime(tss.ts[0]) - offset_ns);
+		return;
+	}
+}
+
+/* Ask the kernel to timestamp the data received on <sockfd>, and on
+ * every socket it accepts. Returns -1 on failure. */
+int enable_rx_timestamps(int sockfd)
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/* Admit (or reject) request <request>, received at <now> on
+ * connection <conn> from <peer> (NULL but in datagram mode), which
+ * runs image operation <op> on <image> unless <op> is IMG_OP_NONE.
+ * Returns -1 if backpressure holds the request back. */
+static int ingest_one(struct connection * conn, struct dispatcher * disp,
+		       struct request * request, uint8_t resp_flags, nstime_t now,
+		       const struct sockaddr_in * peer, int op, const struct image * image)
+{
+	struct timeRequest req;
+
+	memset(&req, 0, sizeof(req));
+	req.request = *request;
+	if (peer)
+		req.peer = *peer;
+	req.receipt_timestamp = now;
+	req.kernel_timestamp = disp->rx_stamp;
+	req.resp_flags = resp_flags;
+	req.op = op;
+	req.image = image;
+	req.conn = conn;
+	if (admit_request(disp, &req) < 0)
+		return -1;
+	if (req.kernel_timestamp) {
+		disp->rx_stamped++;
+		disp->rx_delay_ns += nstime_sub(now, req.kernel_timestamp);
+	}
+	disp->received++;
+	return 0;
+}
+
+/* Take in the upload in progress on connection <conn> from the <len>
+ * bytes at <buf>: first its header, then as many of its pixels as are
+ * there. Once all the pixels are in, store the image and send the
+ * client its handle, or a rejection if there was no room for it, on
+ * the connection or within IMG_BUDGET.
+ * Returns how many bytes were consumed, or -1 if the upload is
+ * malformed. */
+static ssize_t ingest_upload(struct connection * conn, const uint8_t * buf, size_t len, nstime_t now)
+{
+	struct image_upload header;
+	struct timeRequest req;
+	struct response_v2 resp;
+	struct image * img = NULL;
+	size_t used, size;
+
+	if (conn->upload_left == 0) {
+		if (len < sizeof(struct image_upload))
+			return 0;
+		memcpy(&header, buf, sizeof(struct image_upload));
+		if (header.width == 0 || header.height == 0 ||
+		    header.width > IMG_MAX_DIM || header.height > IMG_MAX_DIM)
+			return -1;
+
+		size = (size_t)header.width * header.height;
+		if (conn->num_images < IMG_MAX_IMAGES &&
+		    __atomic_add_fetch(&img_bytes, size, __ATOMIC_RELAXED) <= IMG_BUDGET) {
+			img = (struct image *)calloc(1, sizeof(struct image));
+			if (img && image_init(img, header.width, header.height) < 0) {
+				free(img);
+				img = NULL;
+			}
+		}
+		/* Give the room back if the image was not stored after
+		 * all, including when it was over the budget */
+		if (img == NULL && conn->num_images < IMG_MAX_IMAGES)
+			__atomic_sub_fetch(&img_bytes, size, __ATOMIC_RELAXED);
+		conn->upload = img;
+		conn->upload_id = header.req_id;
+		conn->upload_left = size;
+		return sizeof(struct image_upload);
+	}
+
+	used = (len < conn->upload_left) ? len : conn->upload_left;
+	img = conn->upload;
+	if (img)
+		memcpy(img->pixels + (size_t)img->width * img->height - conn->upload_left, buf, used);
+	conn->upload_left -= used;
+	if (conn->upload_left > 0)
+		return used;
+
+	/* Stored right away: uploads do not go through the queues */
+	memset(&req, 0, sizeof(req));
+	req.request.req_id = conn->upload_id;
+	req.conn = conn;
+	req.resp_flags = conn->frame_flags & PROTO_V2_TIMING;
+	req.receipt_timestamp = req.start_timestamp = now;
+	req.completion_timestamp = nstime_now();
+	make_response(&req, img ? RESP_COMPLETED : RESP_REJECTED, &resp);
+	if (img) {
+		resp.image = conn->num_images;
+		conn->images[conn->num_images++] = img;
+		conn->upload = NULL;
+	}
+	respond_now(&req, &resp);
+	conn->frame_left--;
+	return used;
+}
+
+/* Parse the version 2 frames in the buffer of connection <conn>,
+ * and return how many bytes were consumed or -1 if the frames are
+ * malformed */
+static ssize_t ingest_frames(struct connection * conn, struct dispatcher * disp, nstime_t now)
+{
+	struct frame_v2 frame;
+	struct request_v2 wire;
+	struct request_op op_wire;
+	struct request request;
+	const struct image * image;
+	size_t off = 0, size;
+	ssize_t used;
+	int op;
+
+	for (;;) {
+		if (conn->frame_left == 0) {
+			if (conn->in_bytes - off < sizeof(struct frame_v2))
+				break;
+			memcpy(&frame, conn->in_buf + off, sizeof(struct frame_v2));
+			if (frame.magic != PROTO_V2_MAGIC || frame.version != PROTO_V2_VERSION)
+				return -1;
+			/* An upload is a frame of its own */
+			if (frame.flags & PROTO_V2_UPLOAD &&
+			    (frame.count != 1 || frame.flags & PROTO_V2_OPS))
+				return -1;
+			conn->frame_left = frame.count;
+			conn->frame_flags = frame.flags;
+			off += sizeof(struct frame_v2);
+			continue;
+		}
+
+		/* The pixels of an image may span any number of reads */
+		if (conn->frame_flags & PROTO_V2_UPLOAD) {
+			used = ingest_upload(conn, conn->in_buf + off, conn->in_bytes - off, now);
+			if (used < 0)
+				return -1;
+			if (used == 0)
+				break;
+			off += used;
+			continue;
+		}
+
+		if (conn->frame_flags & PROTO_V2_OPS) {
+			size = sizeof(struct request_op);
+			if (conn->in_bytes - off < size)
+				break;
+			memcpy(&op_wire, conn->in_buf + off, size);
+			if (op_wire.op == IMG_OP_NONE || op_wire.op >= IMG_NUM_OPS ||
+			    op_wire.image >= (uint32_t)conn->num_images)
+				return -1;
+			request.req_id = op_wire.req_id;
+			request.req_timestamp = NSEC_TO_TSPEC(op_wire.sent_ns);
+			request.req_length = NSEC_TO_TSPEC(op_wire.length_ns);
+			op = op_wire.op;
+			image = conn->images[op_wire.image];
+		} else {
+			size = sizeof(struct request_v2);
+			if (conn->in_bytes - off < size)
+				break;
+			memcpy(&wire, conn->in_buf + off, size);
+			request.req_id = wire.req_id;
+			request.req_timestamp = NSEC_TO_TSPEC(wire.sent_ns);
+			request.req_length = NSEC_TO_TSPEC(wire.length_ns);
+			op = IMG_OP_NONE;
+			image = NULL;
+		}
+		if (ingest_one(conn, disp, &request, conn->frame_flags & PROTO_V2_TIMING, now, NULL,
+			       op, image) < 0) {
+			conn->paused = 1;
+			break;
+		}
+		conn->frame_left--;
+		off += size;
+	}
+
+	return off;
+}
+
+/* Admit (or reject) every complete request in the buffer of
+ * connection <conn>, and keep the partial one that may follow, or
+ * with backpressure, all those that have to wait (the connection is
+ * then marked as paused). Returns -1 if the client does not follow
+ * the protocol. */
+int ingest_requests(struct connection * conn, struct dispatcher * disp)
+{
+	struct request request;
+	nstime_t now;
+	uint32_t magic;
+	ssize_t off;
+
+	/* Tell the version of the protocol from the first bytes */
+	if (conn->proto == PROTO_UNKNOWN) {
+		if (conn->in_bytes < sizeof(magic))
+			return 0;
+		memcpy(&magic, conn->in_buf, sizeof(magic));
+		conn->proto = (magic == PROTO_V2_MAGIC) ? PROTO_V2 : PROTO_V1;
+	}
+
+	/* All the requests picked up together arrived together */
+	now = nstime_now();
+	if (conn->proto == PROTO_V2) {
+		off = ingest_frames(conn, disp, now);
+		if (off < 0) {
+			conn->in_bytes = 0;
+			return -1;
+		}
+	} else {
+		for (off = 0; conn->in_bytes - off >= sizeof(struct request); off += sizeof(struct request)) {
+			memcpy(&request, conn->in_buf + off, sizeof(struct request));
+			if (ingest_one(conn, disp, &request, 0, now, NULL, IMG_OP_NONE, NULL) < 0) {
+				conn->paused = 1;
+				break;
+			}
+		}
+	}
+
+	/* Wait for the rest of the request if recv() split it, or for
+	 * room in the queue */
+	conn->in_bytes -= off;
+	memmove(conn->in_buf, conn->in_buf + off, conn->in_bytes);
+	return 0;
+}
+
+/* Read everything currently available on connection <conn> and
+ * enqueue (or reject) every complete request. Every recv() picks up
+ * as many requests as fit in the connection buffer, and the requests
+ * admitted are added to their queue in a single batch. This function
+ * never blocks: it returns 0 when the socket has been drained, 1 when
+ * backpressure paused the connection, and -1 when the connection with
+ * the client has been interrupted. */
+int handle_connection(struct connection * conn, struct dispatcher * disp)
+{
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t in_bytes, room;
+	int retval = 0;
+
+	do {
+		/* IMPLEMENT ME: Receive next request from socket. */
+		/* IMPLEMENT ME: Attempt to enqueue or reject request! */
+		room = CONN_BUF_SIZE - conn->in_bytes;
+		iov.iov_base = conn->in_buf + conn->in_bytes;
+		iov.iov_len = room;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (disp->rx_timestamps) {
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+		}
+		in_bytes = recvmsg(conn->conn_socket, &msg, MSG_DONTWAIT);
+		disp->recv_calls++;
+
+		if (in_bytes <= 0) {
+			if (in_bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				retval = -1;
+			break;
+		}
+		conn->in_bytes += in_bytes;
+		if (disp->rx_timestamps)
+			rx_timestamp(&msg, realtime_offset_ns(), &disp->rx_stamp);
+		if (ingest_requests(conn, disp) < 0) {
+			sync_printf("INFO: Protocol error. Socket = %d\n", conn->conn_socket);
+			retval = -1;
+			break;
+		}
+		if (conn->paused) {
+			retval = 1;
+			break;
+		}
+
+		/* A short read means that the socket has been drained. If
+		 * not, epoll will report the socket again anyway. */
+	} while (in_bytes == room);
+
+	flush_batch(disp);
+	return retval;
+}
+
+/* Accept all the pending connections on the listening socket
+ * <sockfd> and register them with the epoll instance <epfd>. Once out
+ * of file descriptors, descriptor <spare> is given up to turn the
+ * clients away instead, as they would otherwise keep the listening
+ * socket ready for ever. */
+void accept_connections(int sockfd, int epfd, int * spare)
+{
+	struct sockaddr_in client;
+	socklen_t client_len;
+	struct epoll_event ev;
+	struct connection * conn;
+	int accepted;
+
+	for (;;) {
+		client_len = sizeof(struct sockaddr_in);
+		accepted = accept4(sockfd, (struct sockaddr *)&client, &client_len,
+				   SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (accepted == -1) {
+			if ((errno == EMFILE || errno == ENFILE) && *spare >= 0) {
+				close(*spare);
+				accepted = accept(sockfd, NULL, NULL);
+				if (accepted >= 0) {
+					sync_printf("INFO: Out of file descriptors, client turned away.\n");
+					close(accepted);
+				}
+				*spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				/* The limit is hit before looking for clients */
+				if (accepted < 0)
+					return;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				ERROR_INFO();
+				perror("Unable to accept connections");
+			}
+			return;
+		}
+
+		conn = conn_create(accepted);
+		conn->epfd = epfd;
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, accepted, &ev) < 0) {
+			ERROR_INFO();
+			perror("Unable to register connection");
+			conn_put(conn);
+			continue;
+		}
+
+		sync_printf("INFO: Client connected. Socket = %d\n", accepted);
+	}
+}
+
+/* Create a timer that fires every <period_ns> nanoseconds. Returns
+ * its descriptor, or -1 on failure. */
+int create_timer(uint64_t period_ns)
+{
+	struct itimerspec tick;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+
+	tick.it_interval.tv_sec = period_ns / NANO_IN_SEC;
+	tick.it_interval.tv_nsec = period_ns % NANO_IN_SEC;
+	tick.it_value = tick.it_interval;
+	if (timerfd_settime(fd, 0, &tick, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Run the periodic task of timer <fd> of <loop> */
+void handle_timer(struct server_loop * loop, int fd)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	if (fd == loop->timerfd)
+		elastic_adjust(loop->pool);
+	else if (fd == loop->flushfd)
+		coalescer_flush(loop->coalescer);
+}
+
+/* Follow the sequence of request IDs of client <addr>, which just
+ * sent request <id> */
+static void udp_track(struct udp_state * udp, const struct sockaddr_in * addr, uint64_t id)
+{
+	struct udp_peer * peer;
+	uint32_t hash = (addr->sin_addr.s_addr * 2654435761u) ^ addr->sin_port;
+	int i;
+
+	for (i = 0; i < UDP_MAX_PEERS; i++) {
+		peer = &udp->peers[(hash + i) & (UDP_MAX_PEERS - 1)];
+		if (!peer->used) {
+			peer->used = 1;
+			peer->addr = *addr;
+			peer->next_id = 0;
+			udp->num_peers++;
+			break;
+		}
+		if (peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    peer->addr.sin_port == addr->sin_port)
+			break;
+	}
+	/* Clients beyond the first UDP_MAX_PEERS are not followed */
+	if (i == UDP_MAX_PEERS)
+		return;
+
+	/* A late request was counted as skipped when a later one
+	 * arrived first */
+	if (id >= peer->next_id) {
+		udp->skipped += id - peer->next_id;
+		peer->next_id = id + 1;
+	} else {
+		udp->reordered++;
+	}
+}
+
+/* Read every datagram waiting on the UDP socket of <loop>, UDP_BATCH
+ * at a time, and admit (or reject) all the requests they carry */
+static void udp_receive(struct server_loop * loop)
+{
+	struct udp_state * udp = loop->udp;
+	struct dispatcher * disp = loop->disp;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_in peers[UDP_BATCH];
+	char control[UDP_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct request request;
+	nstime_t now;
+	int64_t offset_ns = 0;
+	size_t off;
+	int received, i;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		iovs[i].iov_base = udp->bufs + (size_t)i * UDP_DGRAM_SIZE;
+		iovs[i].iov_len = UDP_DGRAM_SIZE;
+	}
+
+	do {
+		/* The kernel overwrites the lengths on every call */
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < UDP_BATCH; i++) {
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &peers[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			if (disp->rx_timestamps) {
+				msgs[i].msg_hdr.msg_control = control[i];
+				msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+			}
+		}
+
+		received = recvmmsg(loop->sockfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		disp->recv_calls++;
+		if (received < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				ERROR_INFO();
+				perror("Unable to receive datagrams");
+			}
+			break;
+		}
+
+		/* All the datagrams picked up together arrived together.
+		 * Whatever does not fit a whole request is ignored. */
+		now = nstime_now();
+		if (disp->rx_timestamps)
+			offset_ns = realtime_offset_ns();
+		for (i = 0; i < received; i++) {
+			if (disp->rx_timestamps)
+				rx_timestamp(&msgs[i].msg_hdr, offset_ns, &disp->rx_stamp);
+			for (off = 0; msgs[i].msg_len - off >= sizeof(struct request); off += sizeof(struct request)) {
+				memcpy(&request, (uint8_t *)iovs[i].iov_base + off, sizeof(struct request));
+				udp_track(udp, &peers[i], request.req_id);
+				ingest_one(udp->conn, disp, &request, 0, now, &peers[i], IMG_OP_NONE, NULL);
+			}
+		}
+	} while (received == UDP_BATCH);
+
+	flush_batch(disp);
+}
+
+/* Send the responses handed over by the workers to the clients they
+ * are addressed to, UDP_BATCH at a time */
+static void udp_send_responses(struct server_loop * loop)
+{
+	struct udp_state * udp = loop->udp;
+	struct outgoing out[UDP_BATCH];
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	int count, done, sent, i;
+
+	do {
+		for (count = 0; count < UDP_BATCH; count++)
+			if (mpmc_pop(&loop->outbox->ring, &out[count]) < 0)
+				break;
+
+		memset(msgs, 0, count * sizeof(struct mmsghdr));
+		for (i = 0; i < count; i++) {
+			iovs[i].iov_base = &out[i].resp;
+			iovs[i].iov_len = RESP_V2_SIZE(&out[i].resp);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &out[i].peer;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+
+		/* sendmmsg() stops at the first datagram it cannot send:
+		 * drop that one, as the network could have, and go on */
+		for (done = 0; done < count; done += sent) {
+			sent = sendmmsg(loop->sockfd, msgs + done, count - done, MSG_DONTWAIT);
+			udp->send_calls++;
+			if (sent <= 0) {
+				udp->send_drops++;
+				sent = 1;
+			} else {
+				udp->sent += sent;
+			}
+		}
+
+		for (i = 0; i < count; i++)
+			conn_put(out[i].conn);
+	} while (count == UDP_BATCH);
+}
+
+/* Set up datagram mode for <loop> in <udp>, with <box> to collect the
+ * responses of the workers. All the clients share a single connection
+ * on the UDP socket. Returns -1 on failure. */
+int udp_init(struct server_loop * loop, struct udp_state * udp, struct outbox * box)
+{
+	memset(udp, 0, sizeof(struct udp_state));
+	udp->peers = (struct udp_peer *)calloc(UDP_MAX_PEERS, sizeof(struct udp_peer));
+	udp->bufs = (uint8_t *)malloc(UDP_BATCH * UDP_DGRAM_SIZE);
+	if (udp->peers == NULL || udp->bufs == NULL || outbox_init(box, UDP_RESPONSES) < 0) {
+		free(udp->peers);
+		free(udp->bufs);
+		return -1;
+	}
+
+	udp->conn = conn_create(loop->sockfd);
+	udp->conn->udp = 1;
+	loop->udp = udp;
+	loop->outbox = box;
+	return 0;
+}
+
+/* Whether the queue that paused connection <conn> waits for drained
+ * below the low watermark of <bp> */
+static inline int bp_drained(struct backpressure * bp, struct connection * conn)
+{
+	return queue_size(conn->paused_on) <= bp->low;
+}
+
+/* Whether a connection paused by <bp> can be read from again */
+static int bp_can_resume(struct backpressure * bp)
+{
+	struct connection * conn;
+
+	for (conn = bp->paused; conn; conn = conn->next_paused)
+		if (bp_drained(bp, conn))
+			return 1;
+	return 0;
+}
+
+/* Stop reading from connection <conn>, registered with epoll instance
+ * <epfd>, until the queues drain */
+static void bp_pause(struct backpressure * bp, struct connection * conn, int epfd)
+{
+	/* Responses still go out as long as the socket takes them,
+	 * but those it does not wait for the connection to resume */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->conn_socket, NULL);
+	conn->paused_at = nstime_now();
+	conn->next_paused = bp->paused;
+	bp->paused = conn;
+	bp->pauses++;
+}
+
+/* Admit the requests the paused connections of <loop> held back and,
+ * for those that are not held back again, go back to reading from
+ * their socket through epoll instance <epfd> */
+static void bp_resume(struct server_loop * loop, int epfd)
+{
+	struct backpressure * bp = loop->disp->bp;
+	struct connection * conn, * next;
+	struct epoll_event ev;
+	nstime_t now;
+	int ret;
+
+	now = nstime_now();
+	conn = bp->paused;
+	bp->paused = NULL;
+
+	for (; conn; conn = next) {
+		next = conn->next_paused;
+
+		/* Its queue is still too long: leave it alone */
+		if (!bp_drained(bp, conn)) {
+			conn->next_paused = bp->paused;
+			bp->paused = conn;
+			continue;
+		}
+
+		conn->paused = 0;
+		bp->paused_ns += nstime_sub(now, conn->paused_at);
+
+		if (ingest_requests(conn, loop->disp) < 0) {
+			sync_printf("INFO: Protocol error. Socket = %d\n", conn->conn_socket);
+			conn_close_input(conn);
+			continue;
+		}
+		flush_batch(loop->disp);
+
+		/* Still no room: stays paused, without counting again */
+		if (conn->paused) {
+			conn->paused_at = now;
+			conn->next_paused = bp->paused;
+			bp->paused = conn;
+			continue;
+		}
+
+		/* Pairs with conn_want_out_locked() */
+		sem_wait(&conn->out_lock);
+		ev.events = EPOLLIN | EPOLLRDHUP | (conn->want_out ? EPOLLOUT : 0);
+		ev.data.ptr = conn;
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->conn_socket, &ev);
+		sem_post(&conn->out_lock);
+		if (ret < 0) {
+			ERROR_INFO();
+			perror("Unable to register connection");
+			conn_put(conn);
+		}
+	}
+}
+
+/* Serve the clients with the epoll backend until the server is asked
+ * to stop. Returns -1 if the backend could not be set up. */
+int serve_epoll(struct server_loop * loop)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct backpressure * bp = loop->disp->bp;
+	uint64_t wakeup;
+	int epfd, nready, timeout, ret, i, spare;
+	/* Identifies the listening socket, which has no connection
+	 * state. The timers, the outbox and the backpressure eventfd are
+	 * identified by their field in <loop> or its dispatcher. */
+	static int listen_token;
+
+	/* The listening socket and every client are multiplexed over
+	 * a single epoll instance. In datagram mode, the UDP socket takes
+	 * the place of the listening socket. */
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		ERROR_INFO();
+		perror("Unable to create epoll instance");
+		return -1;
+	}
+
+	fcntl(loop->sockfd, F_SETFL, fcntl(loop->sockfd, F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_token;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, loop->sockfd, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to register listening socket");
+		close(epfd);
+		return -1;
+	}
+
+	ev.data.ptr = &loop->timerfd;
+	if (loop->timerfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to register the elastic pool timer");
+		close(epfd);
+		return -1;
+	}
+
+	ev.data.ptr = &loop->flushfd;
+	if (loop->flushfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, loop->flushfd, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to register the response coalescing timer");
+		close(epfd);
+		return -1;
+	}
+
+	ev.data.ptr = &loop->disp->bp;
+	if (loop->disp->bp && epoll_ctl(epfd, EPOLL_CTL_ADD, loop->disp->bp->efd, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to register the backpressure eventfd");
+		close(epfd);
+		return -1;
+	}
+
+	/* In datagram mode, the workers hand their responses over to
+	 * the loop, which sends them in batches */
+	ev.data.ptr = &loop->outbox;
+	if (loop->udp && epoll_ctl(epfd, EPOLL_CTL_ADD, loop->outbox->efd, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to register the response outbox");
+		close(epfd);
+		return -1;
+	}
+
+	/* Kept for when the clients use up all the others */
+	spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	while (!server_done) {
+		timeout = -1;
+		if (loop->udp) {
+			udp_send_responses(loop);
+			/* Ask the workers to wake us up, then look for
+			 * responses one last time: pairs with the fence
+			 * in outbox_wake() */
+			__atomic_store_n(&loop->outbox->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (mpmc_size(&loop->outbox->ring) > 0)
+				timeout = 0;
+		}
+
+		/* Same with paused connections: pairs with the fence in
+		 * bp_release() */
+		if (bp && bp->paused) {
+			__atomic_store_n(&bp->waiting, 1, __ATOMIC_SEQ_CST);
+			if (bp_can_resume(bp))
+				timeout = 0;
+		}
+
+		nready = epoll_pwait(epfd, events, MAX_EVENTS, timeout, &loop->wait_mask);
+		if (loop->udp)
+			__atomic_store_n(&loop->outbox->sleeping, 0, __ATOMIC_RELAXED);
+
+		if (nready < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR_INFO();
+			perror("Unable to wait for events");
+			break;
+		}
+
+		for (i = 0; i < nready; i++) {
+			struct connection * conn = events[i].data.ptr;
+
+			/* The listening socket and the timers are the
+			 * only ones without connection state */
+			if (events[i].data.ptr == &listen_token) {
+				if (loop->udp)
+					udp_receive(loop);
+				else
+					accept_connections(loop->sockfd, epfd, &spare);
+				continue;
+			}
+			if (events[i].data.ptr == &loop->outbox) {
+				if (read(loop->outbox->efd, &wakeup, sizeof(wakeup)) < 0)
+					perror("Unable to read the outbox wake-ups");
+				continue;
+			}
+			if (events[i].data.ptr == &loop->disp->bp) {
+				if (read(bp->efd, &wakeup, sizeof(wakeup)) < 0)
+					perror("Unable to read the backpressure wake-ups");
+				continue;
+			}
+			if (events[i].data.ptr == &loop->timerfd ||
+			    events[i].data.ptr == &loop->flushfd) {
+				handle_timer(loop, *(int *)events[i].data.ptr);
+				continue;
+			}
+
+			/* Once the client is gone, only the bytes still
+			 * pending keep its socket registered. A hangup or
+			 * an error makes sending them fail, which lets go
+			 * of it as well. */
+			if (conn->closing) {
+				conn_output_ready(conn);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT)
+				conn_output_ready(conn);
+			if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+				continue;
+
+			/* Don't just drop the connection on error. Instead
+			 * let go of it, so that the socket is shut down only
+			 * after all of its queued requests are done and
+			 * their responses are out. */
+			ret = handle_connection(conn, loop->disp);
+			if (ret < 0) {
+				sync_printf("INFO: Client disconnected. Socket = %d\n", conn->conn_socket);
+				conn_close_input(conn);
+			} else if (ret > 0) {
+				bp_pause(bp, conn, epfd);
+			}
+		}
+
+		/* Workers made room for the paused connections */
+		if (bp && bp->paused && bp_can_resume(bp)) {
+			__atomic_store_n(&bp->waiting, 0, __ATOMIC_RELAXED);
+			bp_resume(loop, epfd);
+		}
+	}
+
+	if (spare >= 0)
+		close(spare);
+	close(epfd);
+	return 0;
+}
+
+/* Next free submission entry of <ring>, making room if necessary */
+static struct io_uring_sqe * loop_sqe(struct uring * ring)
+{
+	struct io_uring_sqe * sqe = uring_get_sqe(ring);
+
+	if (sqe == NULL) {
+		uring_submit_and_wait(ring, 0, NULL);
+		sqe = uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+/* Set up the io_uring backend of <loop> on <ring>, with <box> to
+ * collect the connections with responses to send. Multishot accept is armed
+ * right away, as kernels that do not support it fail it on the spot.
+ * Returns -1 if the kernel lacks support. */
+int uring_backend_init(struct server_loop * loop, struct uring * ring, struct outbox * box)
+{
+	struct io_uring_cqe * cqe;
+
+	if (uring_init(ring, URING_ENTRIES, URING_BGID, URING_BUFFERS, URING_BUF_SIZE) < 0)
+		return -1;
+
+	uring_prep_accept_multishot(uring_get_sqe(ring), loop->sockfd, URING_ACCEPT);
+	if (uring_submit_and_wait(ring, 0, NULL) < 0)
+		goto err;
+	cqe = uring_peek_cqe(ring);
+	if (cqe && cqe->user_data == URING_ACCEPT && cqe->res < 0) {
+		errno = -cqe->res;
+		goto err;
+	}
+
+	if (outbox_init(box, 0) < 0)
+		goto err;
+
+	loop->ring = ring;
+	loop->outbox = box;
+	return 0;
+
+err:
+	uring_exit(ring);
+	return -1;
+}
+
+/* Arm a receive on connection <conn>, multishot if supported */
+static void uring_arm_recv(struct uring * ring, struct connection * conn, int multishot)
+{
+	uring_prep_recv(loop_sqe(ring), conn->conn_socket, URING_BGID, multishot,
+			(uint64_t)(uintptr_t)conn | URING_RECV);
+}
+
+/* Send what is left of the bytes taken from connection <conn> */
+static void uring_send_rest(struct uring * ring, struct connection * conn)
+{
+	uring_prep_send(loop_sqe(ring), conn->conn_socket, conn->send_buf + conn->send_off,
+			conn->send_len - conn->send_off, MSG_NOSIGNAL,
+			(uint64_t)(uintptr_t)conn | URING_SEND);
+}
+
+/* Take the bytes pending on connection <conn> and send them. Returns
+ * -1 if there are none, in which case the connection no longer waits
+ * for the event loop, and the caller drops its reference. */
+static int uring_send_pending(struct uring * ring, struct connection * conn)
+{
+	uint8_t * buf;
+	size_t cap;
+
+	sem_wait(&conn->out_lock);
+	if (conn->pend_len == 0) {
+		conn->want_out = 0;
+		sem_post(&conn->out_lock);
+		return -1;
+	}
+	/* Trade buffers, so that the workers keep adding to one while
+	 * the other is being sent */
+	buf = conn->send_buf;
+	cap = conn->send_cap;
+	conn->send_buf = conn->pend_buf;
+	conn->send_cap = conn->pend_cap;
+	conn->send_len = conn->pend_len;
+	conn->pend_buf = buf;
+	conn->pend_cap = cap;
+	conn->pend_len = 0;
+	sem_post(&conn->out_lock);
+
+	conn->send_off = 0;
+	uring_send_rest(ring, conn);
+	return 0;
+}
+
+/* Start sending on the connections handed over through
+ * outbox_want_out(). Each of them has at most one send in flight, and
+ * what the workers add in the meantime goes out once it completes. */
+static void uring_send_responses(struct server_loop * loop)
+{
+	struct outbox * box = loop->outbox;
+	struct connection * conn, * next;
+
+	sem_wait(&box->lock);
+	conn = box->writable;
+	box->writable = NULL;
+	sem_post(&box->lock);
+
+	for (; conn; conn = next) {
+		next = conn->next_writable;
+		if (uring_send_pending(loop->ring, conn) < 0)
+			conn_put(conn);
+	}
+}
+
+/* Process completion <cqe> of the io_uring backend of <loop> */
+static void uring_handle_cqe(struct server_loop * loop, struct io_uring_cqe * cqe,
+			     int * multishot_recv)
+{
+	struct uring * ring = loop->ring;
+	void * ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	struct connection * conn;
+	uint16_t bid;
+	static uint64_t wakeup;
+
+	switch (cqe->user_data & URING_TAG_MASK) {
+	case URING_ACCEPT:
+		if (cqe->res >= 0) {
+			conn = conn_create(cqe->res);
+			conn->box = loop->outbox;
+			uring_arm_recv(ring, conn, *multishot_recv);
+			sync_printf("INFO: Client connected. Socket = %d\n", cqe->res);
+		} else {
+			errno = -cqe->res;
+			ERROR_INFO();
+			perror("Unable to accept connections");
+		}
+		if (!more)
+			uring_prep_accept_multishot(loop_sqe(ring), loop->sockfd, URING_ACCEPT);
+		break;
+
+	case URING_RECV:
+		conn = (struct connection *)ptr;
+		if (cqe->res > 0) {
+			/* Copy the data to the connection buffer, where a
+			 * partial request may be waiting to be completed */
+			uint8_t * data;
+			size_t left = cqe->res, len;
+
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			data = (uint8_t *)uring_buffer(ring, bid);
+			while (left > 0) {
+				len = CONN_BUF_SIZE - conn->in_bytes;
+				if (len > left)
+					len = left;
+				memcpy(conn->in_buf + conn->in_bytes, data, len);
+				conn->in_bytes += len;
+				data += len;
+				left -= len;
+				if (ingest_requests(conn, loop->disp) < 0) {
+					/* Drop the client once the receive
+					 * in flight completes */
+					sync_printf("INFO: Protocol error. Socket = %d\n", conn->conn_socket);
+					shutdown(conn->conn_socket, SHUT_RD);
+					break;
+				}
+			}
+			flush_batch(loop->disp);
+			uring_recycle_buffer(ring, bid);
+		} else if (cqe->res == -EINVAL && *multishot_recv) {
+			/* No multishot receive: re-arm after every one */
+			*multishot_recv = 0;
+			more = 0;
+		} else if (cqe->res != -ENOBUFS) {
+			/* Same as with epoll: the socket is only shut down
+			 * once all of its queued requests are done */
+			sync_printf("INFO: Client disconnected. Socket = %d\n", conn->conn_socket);
+			conn_put(conn);
+			break;
+		}
+		/* Out of buffers, or a single-shot receive completed */
+		if (!more)
+			uring_arm_recv(ring, conn, *multishot_recv);
+		break;
+
+	case URING_SEND:
+		conn = (struct connection *)ptr;
+		if (cqe->res < 0) {
+			/* The client is gone: drop what is still waiting for
+			 * it, and let the receive in flight notice */
+			shutdown(conn->conn_socket, SHUT_RDWR);
+			sem_wait(&conn->out_lock);
+			conn->pend_len = 0;
+			conn->want_out = 0;
+			sem_post(&conn->out_lock);
+			conn_put(conn);
+			break;
+		}
+
+		conn->send_off += cqe->res;
+		if (conn->send_off < conn->send_len)
+			uring_send_rest(ring, conn);
+		else if (uring_send_pending(ring, conn) < 0)
+			conn_put(conn);
+		break;
+
+	case URING_WAKE:
+		uring_prep_read(loop_sqe(ring), loop->outbox->efd, &wakeup, sizeof(wakeup), URING_WAKE);
+		break;
+
+	case URING_TIMER:
+		handle_timer(loop, (int)(cqe->user_data >> 3));
+		if (!more)
+			uring_prep_poll_multishot(loop_sqe(ring), (int)(cqe->user_data >> 3), cqe->user_data);
+		break;
+	}
+}
+
+/* Serve the clients with the io_uring backend until the server is
+ * asked to stop. A single system call submits the new operations and
+ * waits for completions, and with multishot operations most
+ * completions need nothing new to be submitted. */
+int serve_uring(struct server_loop * loop)
+{
+	struct uring * ring = loop->ring;
+	struct outbox * box = loop->outbox;
+	struct io_uring_cqe * cqe;
+	uint64_t enters = 0;
+	int multishot_recv = 1, wait_nr;
+	static uint64_t wakeup;
+
+	uring_prep_read(loop_sqe(ring), box->efd, &wakeup, sizeof(wakeup), URING_WAKE);
+	if (loop->timerfd >= 0)
+		uring_prep_poll_multishot(loop_sqe(ring), loop->timerfd,
+					  ((uint64_t)loop->timerfd << 3) | URING_TIMER);
+	if (loop->flushfd >= 0)
+		uring_prep_poll_multishot(loop_sqe(ring), loop->flushfd,
+					  ((uint64_t)loop->flushfd << 3) | URING_TIMER);
+
+	while (!server_done) {
+		uring_send_responses(loop);
+
+		/* Ask the workers to wake us up, then look for responses
+		 * one last time: pairs with the fence in outbox_wake() */
+		__atomic_store_n(&box->sleeping, 1, __ATOMIC_SEQ_CST);
+		wait_nr = (uring_peek_cqe(ring) == NULL &&
+			   __atomic_load_n(&box->writable, __ATOMIC_RELAXED) == NULL) ? 1 : 0;
+
+		if (uring_submit_and_wait(ring, wait_nr, &loop->wait_mask) < 0 && errno != EINTR) {
+			ERROR_INFO();
+			perror("Unable to wait for completions");
+			break;
+		}
+		__atomic_store_n(&box->sleeping, 0, __ATOMIC_RELAXED);
+		enters++;
+
+		while ((cqe = uring_peek_cqe(ring)) != NULL) {
+			uring_handle_cqe(loop, cqe, &multishot_recv);
+			uring_cqe_seen(ring);
+		}
+	}
+
+	printf("INFO: io_uring event loop entered the kernel %lu times.\n", enters);
+	return 0;
+}
+
+/* Send the bytes the io_uring event loop of <loop> did not get to,
+ * once the workers are gone. The sends still in flight are dropped
+ * along with the ring. */
+void uring_flush(struct server_loop * loop)
+{
+	struct outbox * box = loop->outbox;
+	struct connection * conn, * next;
+
+	conn = box->writable;
+	box->writable = NULL;
+	for (; conn; conn = next) {
+		next = conn->next_writable;
+		sem_wait(&conn->out_lock);
+		conn_send_pending_locked(conn);
+		conn->want_out = 0;
+		sem_post(&conn->out_lock);
+		conn_put(conn);
+	}
+}
+
+/* Admit (or reject) the requests waiting in the ring of the shared-
+ * memory client <conn>. Returns -1 if the client went away. */
+static int shm_serve_client(struct connection * conn, struct dispatcher * disp)
+{
+	struct request request;
+	nstime_t now;
+	uint64_t wakeup, one = 1;
+	ssize_t ret;
+	char byte;
+	int taken = 0;
+
+	/* Clients never write to the socket: it is only readable once
+	 * they close it */
+	ret = recv(conn->conn_socket, &byte, sizeof(byte), MSG_DONTWAIT);
+	if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		return -1;
+	if (read(conn->shm->req_efd, &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN)
+		return -1;
+
+	do {
+		now = nstime_now();
+		while (taken < SHM_RING_SIZE && shm_pop_request(conn->shm, &request) == 0) {
+			ingest_one(conn, disp, &request, 0, now, NULL, IMG_OP_NONE, NULL);
+			taken++;
+		}
+		flush_batch(disp);
+
+		/* Let the other clients have a turn, and come back to
+		 * this one right after */
+		if (taken == SHM_RING_SIZE) {
+			if (write(conn->shm->req_efd, &one, sizeof(one)) < 0)
+				return -1;
+			return 0;
+		}
+	} while (shm_server_idle(conn->shm) < 0);
+
+	return 0;
+}
+
+/* Accept all the pending clients of the shared-memory transport
+ * <shm>, set up their channel and register them with the epoll
+ * instance <epfd> */
+static void shm_accept_clients(struct shm_server * shm, int epfd)
+{
+	struct timeval timeout = { 1, 0 };
+	struct epoll_event ev;
+	struct connection * conn;
+	int accepted;
+
+	for (;;) {
+		accepted = accept4(shm->sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (accepted == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				ERROR_INFO();
+				perror("Unable to accept shared-memory clients");
+			}
+			return;
+		}
+
+		/* The client hands over its segment right after
+		 * connecting: do not wait for it forever */
+		setsockopt(accepted, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		conn = conn_create(accepted);
+		conn->shm = (struct shm_channel *)malloc(sizeof(struct shm_channel));
+		if (shm_accept(conn->shm, accepted) < 0) {
+			perror("Unable to set up the shared-memory channel");
+			free(conn->shm);
+			free(conn);
+			continue;
+		}
+
+		/* Both the doorbell and the socket lead to the client */
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->shm->req_efd, &ev) < 0 ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, accepted, &ev) < 0) {
+			ERROR_INFO();
+			perror("Unable to register shared-memory client");
+			conn_put(conn);
+			continue;
+		}
+
+		shm->clients++;
+		sync_printf("INFO: Shared-memory client connected. Socket = %d\n", accepted);
+	}
+}
+
+/* Main logic of the thread serving the shared-memory clients */
+static int shm_server_main(void * arg)
+{
+	struct shm_server * shm = (struct shm_server *)arg;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct connection * gone[MAX_EVENTS];
+	int epfd, nready, num_gone, i, j, done = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		ERROR_INFO();
+		perror("Unable to create epoll instance");
+		return EXIT_FAILURE;
+	}
+
+	/* The listening socket and the stop signal are identified by
+	 * their descriptor in <shm> */
+	ev.events = EPOLLIN;
+	ev.data.ptr = &shm->sockfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, shm->sockfd, &ev);
+	ev.data.ptr = &shm->stopfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, shm->stopfd, &ev);
+
+	while (!done) {
+		nready = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (nready < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR_INFO();
+			perror("Unable to wait for events");
+			break;
+		}
+
+		/* A client may show up twice in the same batch, so the
+		 * references of those that left are dropped at the end */
+		num_gone = 0;
+		for (i = 0; i < nready; i++) {
+			struct connection * conn = events[i].data.ptr;
+
+			if (events[i].data.ptr == &shm->stopfd) {
+				done = 1;
+				continue;
+			}
+			if (events[i].data.ptr == &shm->sockfd) {
+				shm_accept_clients(shm, epfd);
+				continue;
+			}
+
+			for (j = 0; j < num_gone && gone[j] != conn; j++)
+				;
+			if (j < num_gone)
+				continue;
+
+			shm->wakeups++;
+			if (shm_serve_client(conn, &shm->disp) < 0) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, conn->shm->req_efd, NULL);
+				epoll_ctl(epfd, EPOLL_CTL_DEL, conn->conn_socket, NULL);
+				sync_printf("INFO: Shared-memory client disconnected. Socket = %d\n", conn->conn_socket);
+				gone[num_gone++] = conn;
+			}
+		}
+
+		for (i = 0; i < num_gone; i++)
+			conn_put(gone[i]);
+	}
+
+	close(epfd);
+	return EXIT_SUCCESS;
+}
+
+/* Serve the clients of the shared-memory transport on the UNIX socket
+ * at <path> from a thread of their own, admitting their requests with
+ * a copy of dispatcher <disp> that logs to <log>. Returns -1 on
+ * failure. */
+int shm_server_start(struct shm_server * shm, const char * path, struct dispatcher * disp,
+		     struct evlog_ring * log)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	shm->path = path;
+	shm->clients = shm->wakeups = 0;
+	shm->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (shm->sockfd < 0)
+		return -1;
+
+	/* Take over the socket left behind by a previous run */
+	unlink(path);
+	if (bind(shm->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(shm->sockfd, BACKLOG_COUNT) < 0)
+		goto err_close;
+
+	shm->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (shm->stopfd < 0)
+		goto err_unlink;
+
+	/* Both dispatchers feed the same queues: flush_batch() rejects
+	 * what one admitted into room the other took in the meantime */
+	shm->disp = *disp;
+	shm->disp.log = log;
+	shm->disp.seed = disp->seed + 1;
+	/* A request leaves the ring before it is admitted, so it could
+	 * not be held back: no backpressure for these clients */
+	shm->disp.bp = NULL;
+
+	if (worker_thread_start(&shm->thread, shm_server_main, shm, -1) < 0)
+		goto err_stop;
+	return 0;
+
+err_stop:
+	close(shm->stopfd);
+err_unlink:
+	unlink(path);
+err_close:
+	close(shm->sockfd);
+	return -1;
+}
+
+/* Stop serving the shared-memory clients, and fold the statistics of
+ * the transport into those of dispatcher <disp> */
+void shm_server_stop(struct shm_server * shm, struct dispatcher * disp)
+{
+	uint64_t one = 1;
+
+	if (write(shm->stopfd, &one, sizeof(one)) < 0)
+		perror("Unable to stop the shared-memory transport");
+	worker_thread_join(&shm->thread);
+
+	close(shm->stopfd);
+	close(shm->sockfd);
+	unlink(shm->path);
+
+	disp->received += shm->disp.received;
+	disp->rejected_full += shm->disp.rejected_full;
+	disp->rejected_slo += shm->disp.rejected_slo;
+	disp->rejected_quota += shm->disp.rejected_quota;
+	printf("INFO: Served %lu shared-memory clients, woken up %lu times.\n",
+	       shm->clients, shm->wakeups);
+}
+
+/* Start the worker threads, then serve every client that connects to
+ * the listening socket <sockfd> until the server is asked to stop. */
+void event_loop(int sockfd, struct connection_params conn_params, struct server_stats * stats)
+{
+	struct queue * the_queue;
+	struct dispatcher disp;
+	sem_t * local_sems = NULL;
+	struct elastic_pool pool;
+	struct evlog evlog;
+	struct coalescer coalescer;
+	struct server_loop loop;
+	struct uring ring;
+	struct outbox outbox;
+	struct udp_state udp;
+	struct backpressure bp;
+	struct shm_server shm;
+	sigset_t stop_signals;
+	int i, num_rings;
+	/* In elastic mode, room is made for the largest pool */
+	int elastic = (conn_params.maxWorkers > 0);
+	int num_workers = elastic ? conn_params.maxWorkers : conn_params.numWorkers;
+	// An array of worker_params, each allocated on the NUMA node of
+	// the CPU its worker is pinned to
+	struct worker_params * worker_params_array[num_workers];
+	int num_params = 0;
+
+	/* Termination signals are only delivered while the event loop
+	 * sleeps in epoll_pwait(). The workers inherit the blocked
+	 * mask, so they can never swallow them. Shards are told to
+	 * stop with SIGUSR1 by the main thread instead. */
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &stop_signals, &loop.wait_mask);
+	sigdelset(&loop.wait_mask, SIGUSR1);
+
+	/* Now handle queue allocation and initialization. Either a
+	 * single queue protected by the global mutex, or one queue of
+	 * -q entries per worker with its own mutex. */
+	disp.policy = conn_params.dispatch;
+	disp.num_queues = (disp.policy == DISPATCH_SHARED) ? 1 : conn_params.numWorkers;
+	disp.next = 0;
+	disp.seed = getpid();
+	disp.slo_ns = (uint64_t)(conn_params.maxResponse * NANO_IN_SEC);
+	disp.rejected_full = disp.rejected_slo = disp.rejected_quota = 0;
+	disp.log = NULL;
+	disp.batch_count = 0;
+	disp.recv_calls = disp.received = 0;
+	disp.rx_timestamps = 0;
+	disp.rx_stamp = 0;
+	disp.rx_stamped = disp.rx_delay_ns = 0;
+	disp.bp = NULL;
+	/* Zeroed, so that a failure half-way only releases what was
+	 * set up */
+	the_queue = (struct queue*)calloc(disp.num_queues, sizeof(struct queue)); // Allocate memory for the queue
+	disp.queues = the_queue;
+
+	/* Shards share nothing, not even the global mutex */
+	if (disp.policy != DISPATCH_SHARED || conn_params.numShards > 0)
+		local_sems = (sem_t *)malloc(disp.num_queues * sizeof(sem_t));
+
+	for (i = 0; i < disp.num_queues; i++) {
+		sem_t * mutex = queue_mutex;
+
+		if (local_sems) {
+			mutex = &local_sems[i];
+			sem_init(mutex, 0, 1);
+		}
+
+		if (queue_init(&the_queue[i], conn_params.queueSize, conn_params.lockFree, mutex) < 0) {
+			ERROR_INFO();
+			perror("Unable to allocate the request queue");
+			goto out_queues;
+		}
+		the_queue[i].policy = conn_params.schedPolicy;
+		if (conn_params.schedPolicy == QUEUE_DRR &&
+		    drr_init(&the_queue[i], conn_params.drrQuota) < 0) {
+			ERROR_INFO();
+			perror("Unable to allocate the fair queueing state");
+			goto out_queues;
+		}
+		the_queue[i].slo_factor = conn_params.sloFactor;
+		the_queue[i].num_servers = (disp.num_queues == 1) ? conn_params.numWorkers : 1;
+		the_queue[i].spin_ns = (uint64_t)(conn_params.spinTime * 1000);
+
+		if (conn_params.codelTarget > 0) {
+			struct codel * codel = (struct codel *)calloc(1, sizeof(struct codel));
+			sem_init(&codel->lock, 0, 1);
+			codel->target_ns = (uint64_t)(conn_params.codelTarget * NANO_IN_SEC);
+			codel->interval_ns = (uint64_t)(conn_params.codelInterval * NANO_IN_SEC);
+			the_queue[i].codel = codel;
+		}
+	}
+
+	loop.sockfd = sockfd;
+	loop.disp = &disp;
+	loop.pool = &pool;
+	loop.coalescer = &coalescer;
+	loop.timerfd = loop.flushfd = -1;
+	loop.ring = NULL;
+	loop.outbox = NULL;
+	loop.udp = NULL;
+
+	/* Set up io_uring or datagram mode before starting the workers,
+	 * as they need to know where to hand their responses */
+	if (conn_params.udp) {
+		if (conn_params.ioBackend == IO_URING)
+			printf("INFO: The io_uring backend does not serve UDP, using epoll instead.\n");
+		if (udp_init(&loop, &udp, &outbox) < 0) {
+			ERROR_INFO();
+			perror("Unable to set up datagram mode");
+			goto out_queues;
+		}
+		printf("INFO: Serving clients over UDP.\n");
+	} else if (conn_params.ioBackend == IO_URING) {
+		if (uring_backend_init(&loop, &ring, &outbox) < 0) {
+			perror("INFO: io_uring is not available, using epoll instead");
+		} else {
+			printf("INFO: Using the io_uring backend.\n");
+		}
+	}
+
+	/* Receives through io_uring carry no control messages */
+	if (conn_params.rxTimestamps) {
+		if (loop.ring) {
+			printf("INFO: Kernel receive timestamps are not available with io_uring.\n");
+		} else if (enable_rx_timestamps(sockfd) < 0) {
+			ERROR_INFO();
+			perror("Unable to enable kernel receive timestamps");
+			goto out_io;
+		} else {
+			disp.rx_timestamps = 1;
+		}
+	}
+
+	/* Only TCP flow control can push back on the clients, and only
+	 * the epoll loop can stop reading from a given connection */
+	if (conn_params.bpHigh) {
+		if (loop.ring || loop.udp) {
+			printf("INFO: Backpressure needs TCP clients and the epoll backend, rejecting instead.\n");
+		} else {
+			memset(&bp, 0, sizeof(bp));
+			bp.high = conn_params.bpHigh;
+			bp.low = conn_params.bpLow;
+			bp.efd = eventfd(0, EFD_CLOEXEC);
+			if (bp.efd < 0) {
+				ERROR_INFO();
+				perror("Unable to set up backpressure");
+				goto out_io;
+			}
+			disp.bp = &bp;
+		}
+	}
+
+	/* One ring of the event log per worker, plus one for the
+	 * rejections issued by the event loop and, if enabled, one for
+	 * those of the shared-memory transport */
+	num_rings = num_workers + 1 + (conn_params.shmPath ? 1 : 0);
+	if (conn_params.logPath) {
+		if (evlog_open(&evlog, conn_params.logPath, num_rings, EVLOG_RING_SIZE) < 0) {
+			ERROR_INFO();
+			perror("Unable to open the event log");
+			goto out_bp;
+		}
+		disp.log = &evlog.rings[num_workers];
+	}
+
+	coalescer.max_batch = conn_params.coalesceMax;
+	coalescer.max_delay_ns = (uint64_t)(conn_params.coalesceDelay * 1000);
+	coalescer.dirty = NULL;
+	coalescer.responses = coalescer.sends = 0;
+	sem_init(&coalescer.lock, 0, 1);
+
+	/* IMPLEMENT ME!! Write a loop to start and initialize all the worker threads*/
+	pool.min_workers = conn_params.minWorkers;
+	pool.max_workers = conn_params.maxWorkers;
+	pool.active = conn_params.numWorkers;
+	pool.workers = worker_params_array;
+	pool.queue = the_queue;
+	pool.utilization = 0;
+	pool.above_ticks = pool.below_ticks = 0;
+	pool.grows = pool.shrinks = 0;
+
+	/* Populate the whole array first: with work stealing, a worker
+	 * looks at its peers as soon as it starts */
+	for (i = 0; i < num_workers; i++) {
+		int cpu = conn_params.numCpus ? conn_params.cpus[i % conn_params.numCpus] : -1;
+		struct worker_params * params = worker_alloc(sizeof(struct worker_params), cpu);
+
+		if (params == NULL) {
+			ERROR_INFO();
+			perror("Unable to allocate worker state");
+			goto out_params;
+		}
+		worker_params_array[i] = params;
+		num_params++;
+
+		params->serverQueue = &the_queue[i % disp.num_queues];
+		params->thread_id = i;
+		params->worker_done = 0; // Variable used to control termination of the worker thread
+		params->peers = worker_params_array;
+		params->num_peers = conn_params.numWorkers;
+		params->work_stealing = (disp.num_queues > 1) && conn_params.workStealing;
+		params->steals = 0;
+		params->completed = 0;
+		params->pool = elastic ? &pool : NULL;
+		params->started = 0;
+		params->cpu = cpu;
+		params->log = disp.log ? &evlog.rings[i] : NULL;
+		/* Worker stacks are tiny: keep the copies of the queue on
+		 * the heap. A line has room for "Q:[", "]\n" and up to 21
+		 * characters per entry. */
+		params->ids = (uint64_t *)malloc(conn_params.queueSize * sizeof(uint64_t));
+		params->snap = (struct timeRequest *)malloc(conn_params.queueSize * sizeof(struct timeRequest));
+		params->line = disp.log ? NULL : (char *)malloc(6 + 22 * conn_params.queueSize);
+		params->coalescer = conn_params.coalesceMax ? &coalescer : NULL;
+		/* Datagrams are sent in batches by the loop, while the
+		 * bytes for a connection go through it, even with io_uring */
+		params->outbox = loop.udp ? loop.outbox : NULL;
+		params->bp = disp.bp;
+		params->workload = conn_params.workload;
+		params->img_simd = conn_params.imgSimd;
+		memset(&params->img_out, 0, sizeof(struct image));
+		sem_init(&params->park, 0, 0);
+	}
+
+	/* Only the initial workers are started now. In elastic mode,
+	 * the others are started the first time they are needed. */
+	for (i = 0; i < conn_params.numWorkers; i++) {
+		if (wake_worker(worker_params_array[i]) < 0) {
+			goto stop_workers;
+		}
+	}
+
+	/* The elastic pool controller and the coalescer run
+	 * periodically as part of the event loop */
+	if (elastic) {
+		loop.timerfd = create_timer(ELASTIC_TICK_NS);
+		if (loop.timerfd < 0) {
+			ERROR_INFO();
+			perror("Unable to set up the elastic pool timer");
+			goto stop_workers;
+		}
+	}
+	if (conn_params.coalesceMax) {
+		loop.flushfd = create_timer(coalescer.max_delay_ns);
+		if (loop.flushfd < 0) {
+			ERROR_INFO();
+			perror("Unable to set up the response coalescing timer");
+			goto stop_workers;
+		}
+	}
+
+	if (conn_params.shmPath) {
+		if (shm_server_start(&shm, conn_params.shmPath, &disp,
+				     disp.log ? &evlog.rings[num_workers + 1] : NULL) < 0) {
+			ERROR_INFO();
+			perror("Unable to set up the shared-memory transport");
+			goto stop_workers;
+		}
+		printf("INFO: Shared-memory clients attach at %s\n", conn_params.shmPath);
+	}
+
+	/* We are ready to proceed with the rest of the request
+	 * handling logic. */
+	printf("INFO: Waiting for incoming connections...\n");
+
+	if (loop.ring)
+		serve_uring(&loop);
+	else
+		serve_epoll(&loop);
+
+	/* No more requests from the shared-memory clients either */
+	if (conn_params.shmPath)
+		shm_server_stop(&shm, &disp);
+
+stop_workers:
+	/* loop to gracefully terminate all the worker threads */
+	printf("INFO: Asserting termination flag for worker threads...\n");
+	for (i = 0; i < num_workers; i++) {
+		worker_params_array[i]->worker_done = 1;
+		sem_post(&worker_params_array[i]->park);
+	}
+	/* Just in case the threads are waiting for requests, wake them up */
+	for (i = 0; i < disp.num_queues; i++)
+		queue_wake_all(&the_queue[i]);
+
+	/* Workers finish the request they are serving, if any, and exit */
+	for (i = 0; i < num_workers; i++) {
+		if (!worker_params_array[i]->started)
+			continue;
+		worker_thread_join(&worker_params_array[i]->thread);
+		printf("INFO: Worker thread %d exited.\n", worker_params_array[i]->thread_id);
+	}
+
+	/* Send the responses the event loop did not get to */
+	if (loop.ring)
+		uring_flush(&loop);
+	if (loop.udp) {
+		udp_send_responses(&loop);
+		printf("INFO: UDP: %lu clients, %lu requests out of order, %lu missing.\n",
+		       udp.num_peers, udp.reordered, udp.skipped - udp.reordered);
+		printf("INFO: UDP: sent %lu responses with %lu sendmmsg() calls, dropped %lu.\n",
+		       udp.sent, udp.send_calls, udp.send_drops);
+	}
+
+	/* Send whatever responses were still held back */
+	if (conn_params.coalesceMax) {
+		coalescer_flush(&coalescer);
+		printf("INFO: Sent %lu responses with %lu send() calls.\n",
+		       coalescer.responses, coalescer.sends);
+	}
+
+	if (elastic)
+		printf("INFO: Elastic pool grew %lu times and shrank %lu times, ending with %d workers.\n",
+		       pool.grows, pool.shrinks, pool.active);
+
+	printf("INFO: Received %lu requests with %lu recv() calls.\n",
+	       disp.received, disp.recv_calls);
+	if (disp.rx_timestamps && disp.rx_stamped > 0)
+		printf("INFO: %lu requests timestamped by the kernel waited %.3f us on average in the socket.\n",
+		       disp.rx_stamped, (double)disp.rx_delay_ns / disp.rx_stamped / 1000);
+	printf("INFO: Rejected %lu requests on full queue, %lu by admission control.\n",
+	       disp.rejected_full, disp.rejected_slo);
+	if (the_queue[0].drr_quota)
+		printf("INFO: Rejected %lu requests of connections over their quota of %d.\n",
+		       disp.rejected_quota, the_queue[0].drr_quota);
+	if (disp.bp) {
+		printf("INFO: Backpressure paused connections %lu times, for %.6f s in total.\n",
+		       bp.pauses, (double)bp.paused_ns / NANO_IN_SEC);
+	}
+
+	if (the_queue[0].codel)
+		for (i = 0; i < disp.num_queues; i++)
+			printf("INFO: Queue %d dropped %lu requests.\n", i, the_queue[i].codel->drops);
+
+	if (worker_params_array[0]->work_stealing)
+		for (i = 0; i < conn_params.numWorkers; i++)
+			printf("INFO: Worker thread %d stole %lu requests.\n",
+			       i, worker_params_array[i]->steals);
+
+	if (stats) {
+		stats->received = disp.received;
+		stats->rejected = disp.rejected_full + disp.rejected_slo + disp.rejected_quota;
+		stats->completed = stats->steals = 0;
+		for (i = 0; i < num_workers; i++) {
+			stats->completed += worker_params_array[i]->completed;
+			stats->steals += worker_params_array[i]->steals;
+		}
+		for (i = 0; the_queue[0].codel && i < disp.num_queues; i++)
+			stats->rejected += the_queue[i].codel->drops;
+	}
+
+	if (loop.timerfd >= 0)
+		close(loop.timerfd);
+	if (loop.flushfd >= 0)
+		close(loop.flushfd);
+
+	/* Release everything in the reverse order it was set up in:
+	 * a failure half-way jumps to the stage that did not complete */
+out_params:
+	for (i = 0; i < num_params; i++) {
+		free(worker_params_array[i]->ids);
+		free(worker_params_array[i]->snap);
+		free(worker_params_array[i]->line);
+		workload_ctx_free(&worker_params_array[i]->work);
+		image_free(&worker_params_array[i]->img_out);
+		worker_free(worker_params_array[i], sizeof(struct worker_params));
+	}
+
+	/* Nobody is logging anymore: flush the event log */
+	if (disp.log) {
+		uint64_t stalls = 0;
+		for (i = 0; i < num_rings; i++)
+			stalls += evlog.rings[i].stalls;
+		evlog_close(&evlog);
+		printf("INFO: Event log: %lu records written, %lu waits for room.\n",
+		       evlog.written, stalls);
+	}
+
+out_bp:
+	if (disp.bp)
+		close(bp.efd);
+
+out_io:
+	if (loop.ring) {
+		close(outbox.efd);
+		uring_exit(&ring);
+	}
+	if (loop.udp) {
+		close(outbox.efd);
+		mpmc_destroy(&outbox.ring);
+		/* The socket belongs to the caller */
+		free(udp.conn);
+		free(udp.peers);
+		free(udp.bufs);
+	}
+
+out_queues:
+	for (i = 0; i < disp.num_queues; i++)
+		queue_destroy(&the_queue[i]);
+	free(the_queue);
+	free(local_sems);
+}
+
+/* Create a socket listening on port <port>, which other sockets can
+ * share if <reuseport> is set. With <udp> set, the socket is a UDP
+ * socket bound to the port instead. Returns -1 on failure. */
+int open_listener(in_port_t port, int reuseport, int udp)
+{
+	struct sockaddr_in addr;
+	struct in_addr any_address;
+	int sockfd, retval, optval;
+
+	/* Now onward to create the right type of socket */
+	sockfd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+
+	if (sockfd < 0) {
+		ERROR_INFO();
+		perror("Unable to create socket");
+		return -1;
+	}
+
+	/* Before moving forward, set socket to reuse address */
+	optval = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *)&optval, sizeof(optval));
+
+	/* Let the kernel spread connections (or, for UDP, clients)
+	 * across all the sockets bound to the same port */
+	if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (void *)&optval, sizeof(optval)) < 0) {
+		ERROR_INFO();
+		perror("Unable to share the port");
+		close(sockfd);
+		return -1;
+	}
+
+	/* Convert INADDR_ANY into network byte order */
+	any_address.s_addr = htonl(INADDR_ANY);
+
+	/* Time to bind the socket to the right port  */
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = any_address;
+
+	/* Attempt to bind the socket with the given parameters */
+	retval = bind(sockfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+
+	if (retval < 0) {
+		ERROR_INFO();
+		perror("Unable to bind socket");
+		close(sockfd);
+		return -1;
+	}
+
+	/* Datagrams are welcome as soon as the socket is bound */
+	if (udp)
+		return sockfd;
+
+	/* Let us now proceed to set the server to listen on the selected port */
+	retval = listen(sockfd, BACKLOG_COUNT);
+
+	if (retval < 0) {
+		ERROR_INFO();
+		perror("Unable to listen on socket");
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/* Main logic of the thread running a shard */
+int shard_main(void * arg)
+{
+	struct shard * shard = (struct shard *)arg;
+
+	event_loop(shard->sockfd, shard->params, &shard->stats);
+	return EXIT_SUCCESS;
+}
+
+/* Run <conn_params.numShards> shards, each listening on its own socket
+ * bound to <port>, until the server is asked to stop. The CPUs of the
+ * server are split evenly across the shards: the event loop of a shard
+ * runs on the first CPU of its group, and its workers on the whole
+ * group. Returns -1 on failure. */
+int run_shards(in_port_t port, struct connection_params conn_params)
+{
+	int num_shards = conn_params.numShards, ncpus, per_shard, i;
+	int * cpus = conn_params.cpus;
+	struct server_stats total;
+	struct shard * shards;
+	sigset_t stop_signals, old_mask;
+	char * paths = NULL, * shm_paths = NULL;
+
+	ncpus = conn_params.numCpus;
+	if (ncpus == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = (int *)malloc(ncpus * sizeof(int));
+		for (i = 0; i < ncpus; i++)
+			cpus[i] = i;
+	}
+	/* With fewer CPUs than shards, shards share CPUs */
+	per_shard = (ncpus >= num_shards) ? ncpus / num_shards : 1;
+
+	if (conn_params.logPath)
+		paths = (char *)malloc(num_shards * (strlen(conn_params.logPath) + 16));
+	if (conn_params.shmPath)
+		shm_paths = (char *)malloc(num_shards * (strlen(conn_params.shmPath) + 16));
+
+	/* Only this thread takes termination signals, and forwards
+	 * them to the shards */
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+	shards = (struct shard *)calloc(num_shards, sizeof(struct shard));
+	for (i = 0; i < num_shards; i++) {
+		struct shard * shard = &shards[i];
+
+		shard->id = i;
+		shard->params = conn_params;
+		shard->params.cpus = &cpus[(i * per_shard) % ncpus];
+		shard->params.numCpus = per_shard;
+		if (paths) {
+			shard->params.logPath = paths + i * (strlen(conn_params.logPath) + 16);
+			sprintf(shard->params.logPath, "%s.%d", conn_params.logPath, i);
+		}
+		if (shm_paths) {
+			shard->params.shmPath = shm_paths + i * (strlen(conn_params.shmPath) + 16);
+			sprintf(shard->params.shmPath, "%s.%d", conn_params.shmPath, i);
+		}
+
+		shard->sockfd = open_listener(port, 1, conn_params.udp);
+		if (shard->sockfd < 0)
+			break;
+
+		if (worker_thread_start(&shard->thread, shard_main, shard, shard->params.cpus[0]) < 0) {
+			ERROR_INFO();
+			perror("Unable to start shard");
+			close(shard->sockfd);
+			break;
+		}
+		printf("INFO: Shard %d started on CPU %d.\n", i, shard->params.cpus[0]);
+	}
+	num_shards = i;
+
+	while (!server_done && num_shards == conn_params.numShards)
+		sigsuspend(&old_mask);
+
+	/* Wake up every shard still waiting for events */
+	server_done = 1;
+	for (i = 0; i < num_shards; i++)
+		worker_thread_kill(&shards[i].thread, SIGUSR1);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < num_shards; i++) {
+		struct server_stats * stats = &shards[i].stats;
+
+		worker_thread_join(&shards[i].thread);
+		close(shards[i].sockfd);
+		printf("INFO: Shard %d received %lu requests, completed %lu, rejected %lu, stole %lu.\n",
+		       i, stats->received, stats->completed, stats->rejected, stats->steals);
+		total.received += stats->received;
+		total.completed += stats->completed;
+		total.rejected += stats->rejected;
+		total.steals += stats->steals;
+	}
+	printf("INFO: All %d shards received %lu requests, completed %lu, rejected %lu, stole %lu.\n",
+	       num_shards, total.received, total.completed, total.rejected, total.steals);
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	if (cpus != conn_params.cpus)
+		free(cpus);
+	free(paths);
+	free(shm_paths);
+	free(shards);
+	return (num_shards == conn_params.numShards) ? 0 : -1;
+}
+
+/* Translate the name of a dispatch policy into its DISPATCH_*
+ * value. Returns -1 if the name is not recognized. */
+int parse_dispatch(const char * name)
+{
+	if (strcmp(name, "shared") == 0)
+		return DISPATCH_SHARED;
+	if (strcmp(name, "rr") == 0)
+		return DISPATCH_RR;
+	if (strcmp(name, "jsq") == 0)
+		return DISPATCH_JSQ;
+	if (strcmp(name, "p2c") == 0)
+		return DISPATCH_P2C;
+	return -1;
+}
+
+/* Translate the name of a scheduling policy into its QUEUE_* value.
+ * SRPT is accepted as an alias of SJN: requests are not preempted, so
+ * the remaining time of a queued request is its whole length. Returns
+ * -1 if the name is not recognized. */
+int parse_sched(const char * name)
+{
+	if (strcmp(name, "fifo") == 0)
+		return QUEUE_FIFO;
+	if (strcmp(name, "sjn") == 0 || strcmp(name, "srpt") == 0)
+		return QUEUE_SJN;
+	if (strcmp(name, "edf") == 0)
+		return QUEUE_EDF;
+	if (strcmp(name, "drr") == 0)
+		return QUEUE_DRR;
+	return -1;
+}
+
+/* Stop the event loop upon SIGINT/SIGTERM */
+void handle_signal(int signo)
+{
+	(void)signo;
+	server_done = 1;
+}
+
+/* Template implementation of the main function for the FIFO
+ * server. The server must accept in input a command line parameter
+ * with the <port number> to bind the server to. */
+int main (int argc, char ** argv) {
+	int sockfd = -1, retval, opt, i;
+	in_port_t socket_port;
+	struct rlimit nofile;
+	struct sigaction sa;
+
+	struct connection_params conn_params = { 0 };
+
+	/* Parse all the command line arguments */
+	conn_params.sloFactor = DEFAULT_SLO_FACTOR;
+	conn_params.codelInterval = DEFAULT_CODEL_INTERVAL;
+	conn_params.coalesceDelay = DEFAULT_COALESCE_DELAY;
+	conn_params.bpLow = -1;
+	conn_params.imgSimd = img_simd_best();
+	while ((opt = getopt(argc, argv, "q:w:ld:sp:k:r:m:e:t:c:o:g:i:S:x:uTb:f:NW:V:")) != -1) {
+        switch (opt) {
+			/* 1. Detect the -q parameter and set aside the queue size in conn_params */
+            case 'q':
+                conn_params.queueSize = atoi(optarg);
+                break;
+			/* 2. Detect the -w parameter and set aside the number of threads to launch */
+            case 'w':
+                conn_params.numWorkers = atoi(optarg);
+                break;
+			/* 3. Detect the -l flag to use the lock-free queue backend */
+            case 'l':
+                conn_params.lockFree = 1;
+                break;
+			/* 4. Detect the -d parameter to give each worker its own queue */
+            case 'd':
+                conn_params.dispatch = parse_dispatch(optarg);
+                if (conn_params.dispatch < 0) {
+                    fprintf(stderr, "Unknown dispatch policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 5. Detect the -s flag to let idle workers steal requests */
+            case 's':
+                conn_params.workStealing = 1;
+                break;
+			/* 6. Detect the -p parameter to select the order of service */
+            case 'p':
+                conn_params.schedPolicy = parse_sched(optarg);
+                if (conn_params.schedPolicy < 0) {
+                    fprintf(stderr, "Unknown scheduling policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 7. Detect the -k parameter to set the EDF deadline factor */
+            case 'k':
+                conn_params.sloFactor = atof(optarg);
+                break;
+			/* 8. Detect the -r parameter to enable admission control */
+            case 'r':
+                conn_params.maxResponse = atof(optarg);
+                break;
+			/* 9. Detect the -m parameter to enable CoDel queue management */
+            case 'm':
+                if (sscanf(optarg, "%lf,%lf", &conn_params.codelTarget, &conn_params.codelInterval) < 1) {
+                    fprintf(stderr, "Invalid CoDel parameters: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 10. Detect the -e parameter to make the worker pool elastic */
+            case 'e':
+                if (sscanf(optarg, "%d,%d", &conn_params.minWorkers, &conn_params.maxWorkers) != 2) {
+                    fprintf(stderr, "Invalid worker pool bounds: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 11. Detect the -t parameter to let idle workers spin */
+            case 't':
+                conn_params.spinTime = atof(optarg);
+                break;
+			/* 12. Detect the -c parameter to pin the workers */
+            case 'c':
+                conn_params.cpus = (int *)malloc(MAX_CPUS * sizeof(int));
+                conn_params.numCpus = parse_cpu_list(optarg, conn_params.cpus, MAX_CPUS);
+                if (conn_params.numCpus <= 0) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 13. Detect the -o parameter to log events in binary form */
+            case 'o':
+                conn_params.logPath = optarg;
+                break;
+			/* 14. Detect the -g parameter to coalesce responses */
+            case 'g':
+                if (sscanf(optarg, "%d,%lf", &conn_params.coalesceMax, &conn_params.coalesceDelay) < 1 ||
+                    conn_params.coalesceMax <= 0 || conn_params.coalesceDelay <= 0) {
+                    fprintf(stderr, "Invalid coalescing parameters: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (conn_params.coalesceMax > MAX_COALESCE)
+                    conn_params.coalesceMax = MAX_COALESCE;
+                break;
+			/* 15. Detect the -i parameter to select the I/O backend */
+            case 'i':
+                if (strcmp(optarg, "epoll") == 0) {
+                    conn_params.ioBackend = IO_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    conn_params.ioBackend = IO_URING;
+                } else {
+                    fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 16. Detect the -S parameter to run independent shards */
+            case 'S':
+                conn_params.numShards = atoi(optarg);
+                if (conn_params.numShards <= 0) {
+                    fprintf(stderr, "The number of shards must be greater than 0.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 17. Detect the -x parameter to serve shared-memory clients */
+            case 'x':
+                conn_params.shmPath = optarg;
+                break;
+			/* 18. Detect the -u flag to serve clients over UDP */
+            case 'u':
+                conn_params.udp = 1;
+                break;
+			/* 19. Detect the -T flag to record kernel receive timestamps */
+            case 'T':
+                conn_params.rxTimestamps = 1;
+                break;
+			/* 20. Detect the -b parameter to apply backpressure */
+            case 'b':
+                if (sscanf(optarg, "%d,%d", &conn_params.bpHigh, &conn_params.bpLow) < 1 ||
+                    conn_params.bpHigh <= 0) {
+                    fprintf(stderr, "Invalid backpressure watermarks: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 21. Detect the -f parameter to cap the requests queued per connection */
+            case 'f':
+                conn_params.drrQuota = strtol(optarg, NULL, 10);
+                if (conn_params.drrQuota <= 0) {
+                    fprintf(stderr, "The per-connection quota must be greater than 0.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+			/* 22. Detect the -N flag to log timestamps in nanoseconds */
+            case 'N':
+                log_nsec = 1;
+                break;
+			/* 23. Detect the -W parameter to run service kernels */
+            case 'W': {
+                char * size = strchr(optarg, ':');
+                size_t working_set = WORKLOAD_DEFAULT_WSS;
+
+                if (size) {
+                    *size++ = '\0';
+                    working_set = strtoul(size, NULL, 10) * 1024;
+                }
+                conn_params.workload = (struct workload *)malloc(sizeof(struct workload));
+                if (workload_parse(conn_params.workload, optarg, working_set) < 0) {
+                    fprintf(stderr, "Invalid workload: %s (working set of at least 128 KiB)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+			/* 24. Detect the -V parameter to pick the kernels of the image operations */
+            case 'V':
+                conn_params.imgSimd = img_simd_parse(optarg);
+                if (conn_params.imgSimd < 0) {
+                    fprintf(stderr, "Invalid or unsupported instruction set: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, USAGE_STRING, argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+	// Check if the required options are provided
+    if (conn_params.queueSize <= 0 || conn_params.numWorkers <= 0) {
+        fprintf(stderr, "Both queue size and number of workers must be greater than 0.\n");
+        exit(EXIT_FAILURE);
+    }
+
+	/* The lock-free ring can only hand out requests in FIFO order */
+    if (conn_params.schedPolicy != QUEUE_FIFO && conn_params.lockFree) {
+        fprintf(stderr, "Scheduling policies other than FIFO require the default queue backend.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (conn_params.maxResponse < 0) {
+        fprintf(stderr, "The response time objective cannot be negative.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (conn_params.codelTarget < 0 || conn_params.codelInterval <= 0) {
+        fprintf(stderr, "The CoDel target cannot be negative, and its interval must be greater than 0.\n");
+        exit(EXIT_FAILURE);
+    }
+
+	/* The initial pool size is -w, within the elastic bounds */
+    if (conn_params.maxWorkers > 0) {
+        if (conn_params.minWorkers <= 0 || conn_params.minWorkers > conn_params.maxWorkers) {
+            fprintf(stderr, "Elastic pool bounds must satisfy 0 < min <= max.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (conn_params.dispatch != DISPATCH_SHARED) {
+            fprintf(stderr, "The elastic pool requires the shared queue.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (conn_params.numWorkers < conn_params.minWorkers)
+            conn_params.numWorkers = conn_params.minWorkers;
+        if (conn_params.numWorkers > conn_params.maxWorkers)
+            conn_params.numWorkers = conn_params.maxWorkers;
+    }
+
+    if (conn_params.spinTime < 0) {
+        fprintf(stderr, "The spin time cannot be negative.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (conn_params.sloFactor <= 0) {
+        fprintf(stderr, "The SLO factor must be greater than 0.\n");
+        exit(EXIT_FAILURE);
+    }
+
+	/* Resume halfway to an empty queue by default */
+    if (conn_params.bpHigh > 0) {
+        if (conn_params.bpLow < 0)
+            conn_params.bpLow = conn_params.bpHigh / 2;
+        if (conn_params.bpHigh > conn_params.queueSize || conn_params.bpLow >= conn_params.bpHigh) {
+            fprintf(stderr, "Backpressure watermarks must satisfy 0 <= low < high <= queue size.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+	/* Fair queueing needs every connection to share one queue */
+    if (conn_params.schedPolicy == QUEUE_DRR) {
+        if (conn_params.dispatch != DISPATCH_SHARED) {
+            fprintf(stderr, "Fair queueing requires the shared queue.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (conn_params.drrQuota == 0)
+            conn_params.drrQuota = (conn_params.queueSize > 1) ? conn_params.queueSize / 2 : 1;
+    } else if (conn_params.drrQuota > 0) {
+        fprintf(stderr, "The per-connection quota only applies to fair queueing.\n");
+        exit(EXIT_FAILURE);
+    }
+
+	/* 25. Detect the port number to bind the server socket to (see HW1 and HW2) */
+	if (optind < argc) {
+		socket_port = strtol(argv[optind], NULL, 10);
+		printf("INFO: setting server port as: %d\n", socket_port);
+	} else {
+		ERROR_INFO();
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Every shard gets its own listening socket later on */
+	if (conn_params.numShards == 0) {
+		sockfd = open_listener(socket_port, 0, conn_params.udp);
+		if (sockfd < 0)
+			return EXIT_FAILURE;
+	}
+
+	/* Initilize threaded printf mutex */
+	printf_mutex = (sem_t *)malloc(sizeof(sem_t));
+	retval = sem_init(printf_mutex, 0, 1);
+	if (retval < 0) {
+		ERROR_INFO();
+		perror("Unable to initialize printf mutex");
+		return EXIT_FAILURE;
+	}
+
+	/* Workers time the requests with the TSC from now on */
+	if (tsc_calibrate())
+		printf("INFO: TSC runs at %.3f MHz.\n", (double)tsc_cal.hz / 1000000);
+	else
+		printf("INFO: TSC unusable, timing requests with clock_gettime().\n");
+
+	/* Before any worker or client competes for the machine */
+	if (conn_params.workload) {
+		if (workload_calibrate(conn_params.workload) < 0) {
+			ERROR_INFO();
+			perror("Unable to calibrate the service kernels");
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < WORKLOAD_NUM_KERNELS; i++)
+			if (conn_params.workload->ns_per_unit[i] > 0)
+				printf("INFO: Service kernel %s runs in units of %.3f us.\n",
+				       workload_name(i), conn_params.workload->ns_per_unit[i] / 1000);
+	}
+
+	printf("INFO: Image operations run on the %s kernels.\n", img_simd_name(conn_params.imgSimd));
+
+	/* Initialize queue protection variables. DO NOT TOUCH. */
+	queue_mutex = (sem_t *)malloc(sizeof(sem_t));
+	retval = sem_init(queue_mutex, 0, 1);
+	if (retval < 0) {
+		ERROR_INFO();
+		perror("Unable to initialize queue mutex");
+		return EXIT_FAILURE;
+	}
+	/* DONE - Initialize queue protection variables */
+
+	/* Every client needs a descriptor: raise the limit as far as
+	 * we are allowed to */
+	if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+		nofile.rlim_cur = nofile.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+
+	/* Stop serving clients upon SIGINT/SIGTERM. Writes to a peer
+	 * that went away must not kill the server either. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Ready to handle connections with the clients. */
+	if (conn_params.numShards > 0) {
+		if (run_shards(socket_port, conn_params) < 0)
+			return EXIT_FAILURE;
+	} else {
+		event_loop(sockfd, conn_params, NULL);
+		close(sockfd);
+	}
 
 	free(queue_mutex);
-	free(queue_notify);
 
-	close(sockfd);
 	return EXIT_SUCCESS;
 
 }
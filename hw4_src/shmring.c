@@ -0,0 +1,307 @@
+/*******************************************************************************
+* Shared-Memory Request Transport (implementation)
+*
+* Description:
+*     Channel setup over a UNIX socket and the two single-producer/single-
+*     consumer rings of the shared segment. See shmring.h for the interface.
+*
+* Notes:
+*     A side that finds nothing to do sets its sleeping flag, then checks
+*     the ring one last time before waiting on its doorbell. The other side
+*     publishes its index, then looks at the flag and rings the doorbell if
+*     it is set. Full fences on both sides guarantee that at least one of
+*     them sees what the other did, so no wake-up is ever lost, and
+*     doorbells are only rung when somebody actually sleeps.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "shmring.h"
+
+/* Ring doorbell <efd> if the side whose sleeping flag is <sleeping>
+ * went to sleep. Must follow the publication of a new index. */
+static void shm_ring_doorbell(uint32_t * sleeping, int efd)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(sleeping, 0, __ATOMIC_ACQ_REL)) {
+		/* Only fails if the counter is about to overflow, i.e.
+		 * if the other side has a wake-up pending anyway */
+		if (write(efd, &one, sizeof(one)) < 0)
+			return;
+	}
+}
+
+/* Map the segment behind <memfd> into <ch> */
+static int shm_map(struct shm_channel * ch, int memfd)
+{
+	void * addr = mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE,
+			   MAP_SHARED, memfd, 0);
+
+	if (addr == MAP_FAILED)
+		return -1;
+	ch->seg = (struct shm_segment *)addr;
+	return 0;
+}
+
+int shm_connect(struct shm_channel * ch, const char * path)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	char byte = 0;
+	int fds[3], memfd = -1;
+
+	memset(ch, 0, sizeof(struct shm_channel));
+	ch->sockfd = ch->req_efd = ch->resp_efd = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	ch->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ch->sockfd < 0 || connect(ch->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+
+	/* The whole segment starts out zeroed, i.e. with empty rings */
+	memfd = memfd_create("shmring", MFD_CLOEXEC);
+	if (memfd < 0 || ftruncate(memfd, sizeof(struct shm_segment)) < 0 || shm_map(ch, memfd) < 0)
+		goto err;
+	ch->seg->magic = SHM_MAGIC;
+	ch->seg->ring_size = SHM_RING_SIZE;
+	/* Nothing came in yet, so the server is waiting */
+	ch->seg->server_sleeping = 1;
+
+	ch->req_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ch->resp_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ch->req_efd < 0 || ch->resp_efd < 0)
+		goto err;
+
+	/* Pass the segment and the doorbells to the server */
+	fds[0] = memfd;
+	fds[1] = ch->req_efd;
+	fds[2] = ch->resp_efd;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(ch->sockfd, &msg, MSG_NOSIGNAL) != 1)
+		goto err;
+
+	close(memfd);
+	return 0;
+
+err:
+	if (memfd >= 0)
+		close(memfd);
+	shm_close(ch);
+	return -1;
+}
+
+int shm_send_request(struct shm_channel * ch, const struct request * req)
+{
+	struct shm_segment * seg = ch->seg;
+	uint64_t tail = seg->req_tail;
+
+	if (tail - __atomic_load_n(&seg->req_head, __ATOMIC_ACQUIRE) == SHM_RING_SIZE) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	seg->reqs[tail & (SHM_RING_SIZE - 1)] = *req;
+	__atomic_store_n(&seg->req_tail, tail + 1, __ATOMIC_RELEASE);
+	shm_ring_doorbell(&seg->server_sleeping, ch->req_efd);
+	return 0;
+}
+
+int shm_recv_response(struct shm_channel * ch, struct response * resp, int wait)
+{
+	struct shm_segment * seg = ch->seg;
+	uint64_t head = seg->resp_head, wakeup;
+	struct pollfd fds[2];
+
+	while (head == __atomic_load_n(&seg->resp_tail, __ATOMIC_ACQUIRE)) {
+		if (!wait) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		/* Look one last time after asking for the doorbell */
+		__atomic_store_n(&seg->client_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (head != __atomic_load_n(&seg->resp_tail, __ATOMIC_ACQUIRE))
+			break;
+
+		fds[0].fd = ch->resp_efd;
+		fds[0].events = POLLIN;
+		fds[1].fd = ch->sockfd;
+		fds[1].events = POLLIN | POLLRDHUP;
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			return -1;
+		if (fds[0].revents & POLLIN) {
+			if (read(ch->resp_efd, &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN)
+				return -1;
+		} else if (fds[1].revents) {
+			/* The server only ever closes the socket */
+			errno = EPIPE;
+			return -1;
+		}
+	}
+	__atomic_store_n(&seg->client_sleeping, 0, __ATOMIC_RELAXED);
+
+	*resp = seg->resps[head & (SHM_RING_SIZE - 1)];
+	__atomic_store_n(&seg->resp_head, head + 1, __ATOMIC_RELEASE);
+
+	/* The server may be holding back requests until there is room
+	 * for their responses */
+	shm_ring_doorbell(&seg->server_sleeping, ch->req_efd);
+	return 0;
+}
+
+int shm_accept(struct shm_channel * ch, int sockfd)
+{
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	struct stat st;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	char byte;
+	int fds[3] = { -1, -1, -1 }, i;
+
+	memset(ch, 0, sizeof(struct shm_channel));
+	ch->sockfd = sockfd;
+	ch->req_efd = ch->resp_efd = -1;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != 1)
+		goto err;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		errno = EPROTO;
+		goto err;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	ch->req_efd = fds[1];
+	ch->resp_efd = fds[2];
+
+	/* Only trust a segment large enough and set up for our rings */
+	if (fstat(fds[0], &st) < 0 || (size_t)st.st_size < sizeof(struct shm_segment) ||
+	    shm_map(ch, fds[0]) < 0)
+		goto err;
+	close(fds[0]);
+	fds[0] = -1;
+	if (ch->seg->magic != SHM_MAGIC || ch->seg->ring_size != SHM_RING_SIZE) {
+		errno = EPROTO;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	for (i = 0; i < 3; i++)
+		if (fds[i] >= 0 && fds[i] != ch->req_efd && fds[i] != ch->resp_efd)
+			close(fds[i]);
+	shm_close(ch);
+	return -1;
+}
+
+int shm_pop_request(struct shm_channel * ch, struct request * req)
+{
+	struct shm_segment * seg = ch->seg;
+	uint64_t head = seg->req_head;
+
+	if (head == __atomic_load_n(&seg->req_tail, __ATOMIC_ACQUIRE))
+		return -1;
+	/* Every request taken holds a slot of the response ring until
+	 * the client consumes its response */
+	if (head - __atomic_load_n(&seg->resp_head, __ATOMIC_ACQUIRE) >= SHM_RING_SIZE)
+		return -1;
+
+	*req = seg->reqs[head & (SHM_RING_SIZE - 1)];
+	__atomic_store_n(&seg->req_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int shm_server_idle(struct shm_channel * ch)
+{
+	struct shm_segment * seg = ch->seg;
+	uint64_t head = seg->req_head;
+
+	__atomic_store_n(&seg->server_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (head != __atomic_load_n(&seg->req_tail, __ATOMIC_ACQUIRE) &&
+	    head - __atomic_load_n(&seg->resp_head, __ATOMIC_ACQUIRE) < SHM_RING_SIZE) {
+		__atomic_store_n(&seg->server_sleeping, 0, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+int shm_push_response(struct shm_channel * ch, const struct response * resp)
+{
+	struct shm_segment * seg = ch->seg;
+	uint64_t tail = seg->resp_tail;
+
+	if (tail - __atomic_load_n(&seg->resp_head, __ATOMIC_ACQUIRE) == SHM_RING_SIZE) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	seg->resps[tail & (SHM_RING_SIZE - 1)] = *resp;
+	__atomic_store_n(&seg->resp_tail, tail + 1, __ATOMIC_RELEASE);
+	shm_ring_doorbell(&seg->client_sleeping, ch->resp_efd);
+	return 0;
+}
+
+void shm_close(struct shm_channel * ch)
+{
+	int saved_errno = errno;
+
+	if (ch->seg)
+		munmap(ch->seg, sizeof(struct shm_segment));
+	if (ch->req_efd >= 0)
+		close(ch->req_efd);
+	if (ch->resp_efd >= 0)
+		close(ch->resp_efd);
+	if (ch->sockfd >= 0)
+		close(ch->sockfd);
+
+	memset(ch, 0, sizeof(struct shm_channel));
+	ch->sockfd = ch->req_efd = ch->resp_efd = -1;
+	errno = saved_errno;
+}
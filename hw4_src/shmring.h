@@ -0,0 +1,102 @@
+/*******************************************************************************
+* Shared-Memory Request Transport (header)
+*
+* Description:
+*     A transport for clients running on the same host as the server. The
+*     client allocates a memory segment (memfd) holding a ring of requests
+*     it writes and a ring of responses the server writes, plus two
+*     eventfds used as doorbells, and hands all three to the server over a
+*     UNIX socket. From then on, requests and responses move through the
+*     rings without any system call, except to wake up a side that went to
+*     sleep waiting for the other. The rings hold the very same struct
+*     request and struct response the servers receive and send over TCP.
+*
+* Notes:
+*     Each ring has a single producer and a single consumer. On the server
+*     side, the response ring may be fed by several threads, which must
+*     then serialize their calls to shm_push_response(). The UNIX socket
+*     stays open for as long as the channel is in use: either side closing
+*     it tells the other that the channel is gone. Every function returning
+*     an int returns a negative value on failure, with errno set.
+*
+*******************************************************************************/
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "mpmc.h"
+
+/* Number of slots of each ring (a power of two) */
+#define SHM_RING_SIZE 1024
+
+/* Tells a properly initialized segment apart */
+#define SHM_MAGIC 0x53484d31 /* "SHM1" */
+
+/* Layout of the shared segment. Every index counts the elements that
+ * went through the ring so far, and is written by one side only. */
+struct shm_segment {
+	uint32_t magic;
+	uint32_t ring_size;
+	/* Request ring: filled by the client, emptied by the server */
+	uint64_t req_tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t req_head __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Response ring: filled by the server, emptied by the client */
+	uint64_t resp_tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t resp_head __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Set by a side before it sleeps, and cleared by the first
+	 * one to ring its doorbell */
+	uint32_t server_sleeping __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t client_sleeping __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct request reqs[SHM_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct response resps[SHM_RING_SIZE];
+};
+
+/* One end of a channel, in either process */
+struct shm_channel {
+	struct shm_segment * seg;
+	/* UNIX socket the channel was set up over */
+	int sockfd;
+	/* Doorbells: new requests for the server, new responses (or
+	 * room for more requests) for the client */
+	int req_efd;
+	int resp_efd;
+};
+
+/* Client: set up a channel with the server listening on the UNIX
+ * socket at <path> */
+int shm_connect(struct shm_channel * ch, const char * path);
+
+/* Client: queue <req> for the server. Fails with EAGAIN if the ring is
+ * full, in which case responses must be consumed first. */
+int shm_send_request(struct shm_channel * ch, const struct request * req);
+
+/* Client: take the next response. If there is none, either wait for
+ * it when <wait> is set or fail with EAGAIN. Fails with EPIPE if the
+ * server went away. */
+int shm_recv_response(struct shm_channel * ch, struct response * resp, int wait);
+
+/* Server: complete the setup of a channel requested by the client
+ * connected to <sockfd>. Takes ownership of <sockfd>. */
+int shm_accept(struct shm_channel * ch, int sockfd);
+
+/* Server: take the next request from the client. Returns -1 if there
+ * is none, or if the response ring could not hold the response to it
+ * because the client is lagging behind. */
+int shm_pop_request(struct shm_channel * ch, struct request * req);
+
+/* Server: ask the client to ring the request doorbell from now on.
+ * Returns -1 if more requests can be taken already, in which case
+ * the server must keep going instead of sleeping. */
+int shm_server_idle(struct shm_channel * ch);
+
+/* Server: hand <resp> to the client. Never fails as long as every
+ * response answers a request taken with shm_pop_request(). */
+int shm_push_response(struct shm_channel * ch, const struct response * resp);
+
+/* Either side: tear down the channel */
+void shm_close(struct shm_channel * ch);
+
+#endif
@@ -20,8 +20,26 @@
 *
 *******************************************************************************/
 
+#include <cpuid.h>
+#include <errno.h>
+
 #include "timelib.h"
 
+/* How long tsc_calibrate() watches the two clocks (10 ms) */
+#define TSC_CALIBRATION_NS (10 * 1000 * 1000)
+
+struct tsc_calibration tsc_cal;
+
+/* Margin of hybridwait_ns() before any sleep was measured: the default
+ * timer slack (50 us) plus some scheduling latency, and the bounds it
+ * always stays within */
+#define WAKE_MARGIN_INIT_NS (60 * 1000)
+#define WAKE_MARGIN_MIN_NS (1000)
+#define WAKE_MARGIN_MAX_NS (2 * 1000 * 1000)
+
+/* Every thread sleeps with its own timer slack and on its own CPU */
+static __thread uint64_t wake_margin_ns = WAKE_MARGIN_INIT_NS;
+
 /* Return the number of clock cycles elapsed when waiting for
  * wait_time seconds using sleeping functions */
 uint64_t get_elapsed_sleep(long sec, long nsec)
@@ -63,7 +81,7 @@ uint64_t get_elapsed_busywait(long sec, long nsec)
 	/* Busy wait until enough time has elapsed */
 	do {
 		clock_gettime(CLOCK_MONOTONIC, &now);
-	} while (time_end.tv_sec > now.tv_sec || time_end.tv_nsec > now.tv_nsec);
+	} while (timespec_cmp(&time_end, &now) > 0);
 
 	/* Get end timestamp */
 	get_clocks(end);
@@ -79,7 +97,7 @@ void timespec_add (struct timespec * a, struct timespec * b)
 	 * seconds */
 	time_t addl_seconds = b->tv_sec;
 	a->tv_nsec += b->tv_nsec;
-	if (a->tv_nsec > NANO_IN_SEC) {
+	if (a->tv_nsec >= NANO_IN_SEC) {
 		addl_seconds += a->tv_nsec / NANO_IN_SEC;
 		a->tv_nsec = a->tv_nsec % NANO_IN_SEC;
 	}
@@ -118,7 +136,7 @@ uint64_t busywait_timespec(struct timespec delay)
 	/* Busy wait until enough time has elapsed */
 	do {
 		clock_gettime(CLOCK_MONOTONIC, &now);
-	} while (delay.tv_sec > now.tv_sec || delay.tv_nsec > now.tv_nsec);
+	} while (timespec_cmp(&delay, &now) > 0);
 
 	/* Get end timestamp */
 	get_clocks(end);
@@ -136,3 +154,148 @@ inline struct timespec dtotspec(double timestamp)
 	retval.tv_nsec = (long)(timestamp * NANO_IN_SEC) % NANO_IN_SEC;
 	return retval;
 }
+
+/* Check that the TSC ticks at a constant rate whatever the frequency
+ * and sleep state of the core (invariant TSC), that RDTSCP exists, and
+ * that the kernel itself keeps time with the TSC: if it found the TSCs
+ * of different CPUs out of sync, it switched to another clocksource. */
+static int tsc_usable(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	char source[16] = "";
+	FILE * file;
+
+	if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 27)))
+		return 0;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+		return 0;
+
+	file = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+	if (file == NULL)
+		return 0;
+	if (fgets(source, sizeof(source), file) == NULL)
+		source[0] = '\0';
+	fclose(file);
+	return strncmp(source, "tsc", 3) == 0;
+}
+
+/* Read CLOCK_MONOTONIC and the TSC at the same time, as the middle of
+ * the shortest of a few readings of the TSC around clock_gettime() */
+static void tsc_sample(uint64_t * ns, uint64_t * clocks)
+{
+	struct timespec now;
+	uint64_t before, after, best = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		get_clocks_ordered(before);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		get_clocks_ordered(after);
+		if (after - before < best) {
+			best = after - before;
+			*clocks = before + (after - before) / 2;
+			*ns = (uint64_t)now.tv_sec * NANO_IN_SEC + now.tv_nsec;
+		}
+	}
+}
+
+uint64_t tsc_calibrate(void)
+{
+	uint64_t start_ns, start_clocks, end_ns, end_clocks;
+	struct timespec wait_time;
+
+	memset(&tsc_cal, 0, sizeof(tsc_cal));
+	if (!tsc_usable())
+		return 0;
+
+	/* Sleeping does not disturb an invariant TSC */
+	wait_time.tv_sec = 0;
+	wait_time.tv_nsec = TSC_CALIBRATION_NS;
+	tsc_sample(&start_ns, &start_clocks);
+	nanosleep(&wait_time, NULL);
+	tsc_sample(&end_ns, &end_clocks);
+	if (end_clocks <= start_clocks || end_ns <= start_ns)
+		return 0;
+
+	tsc_cal.mult = (uint64_t)((((__uint128_t)(end_ns - start_ns)) << TSC_SHIFT)
+				  / (end_clocks - start_clocks));
+	tsc_cal.base_clocks = end_clocks;
+	tsc_cal.base_ns = end_ns;
+	tsc_cal.hz = (uint64_t)((__uint128_t)(end_clocks - start_clocks) * NANO_IN_SEC
+				/ (end_ns - start_ns));
+	return tsc_cal.hz;
+}
+
+/* Compare clocks rather than nanoseconds: the loop then only reads the
+ * TSC, with no conversion. No PAUSE in the loop: the wait stands for
+ * work, so the core has nothing to give up, and a PAUSE only delays the
+ * moment the end is noticed. */
+uint64_t busywait_ns(uint64_t ns)
+{
+	uint64_t start, now, end;
+
+	if (tsc_cal.hz == 0) {
+		start = tsc_now_ns();
+		do {
+			now = tsc_now_ns();
+		} while (now - start < ns);
+		return now - start;
+	}
+
+	get_clocks_ordered(start);
+	end = start + ns_to_clocks(ns);
+	do {
+		get_clocks_ordered(now);
+	} while (now < end);
+
+	return clocks_to_ns(now - start);
+}
+
+/* Track the 98th percentile of the lateness of wake-ups, given the
+ * lateness <late_ns> of the last one: grow the margin by a step when
+ * it was too short, and shrink it by a step 50 times smaller when it
+ * was long enough. The margin settles where both happen equally often,
+ * i.e. where 1 wake-up in 50 is later than it. Steps proportional to
+ * the margin rather than to the lateness keep the rare wake-up that
+ * comes milliseconds late, after a preemption, from inflating it. */
+static void wake_margin_update(uint64_t late_ns)
+{
+	if (late_ns > wake_margin_ns)
+		wake_margin_ns += wake_margin_ns / 8;
+	else
+		wake_margin_ns -= wake_margin_ns / 400;
+	if (wake_margin_ns < WAKE_MARGIN_MIN_NS)
+		wake_margin_ns = WAKE_MARGIN_MIN_NS;
+	if (wake_margin_ns > WAKE_MARGIN_MAX_NS)
+		wake_margin_ns = WAKE_MARGIN_MAX_NS;
+}
+
+uint64_t hybridwait_ns(uint64_t ns)
+{
+	nstime_t start, deadline, wake, now;
+	struct timespec target;
+
+	start = nstime_now();
+	deadline = nstime_add(start, ns);
+
+	/* Too short to be worth sleeping */
+	if (ns > wake_margin_ns) {
+		wake = deadline - wake_margin_ns;
+		target = nstime_to_tspec(wake);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR)
+			;
+		now = nstime_now();
+		wake_margin_update(nstime_sub(now, wake));
+	} else {
+		now = start;
+	}
+
+	if (now < deadline)
+		busywait_ns(deadline - now);
+	return nstime_sub(nstime_now(), start);
+}
+
+uint64_t hybridwait_margin_ns(void)
+{
+	return wake_margin_ns;
+}
@@ -18,8 +18,16 @@
 *     using this library. Modifications or improvements are welcome. Please
 *     refer to the accompanying documentation for detailed usage instructions.
 *
+*     The tsc_* and *_ns functions keep time in integer nanoseconds on the
+*     CLOCK_MONOTONIC timeline, but read the TSC instead of entering the
+*     vDSO. They need tsc_calibrate() to have been called once beforehand,
+*     and fall back to clock_gettime() if it found the TSC unusable.
+*
 *******************************************************************************/
 
+#ifndef TIMELIB_H
+#define TIMELIB_H
+
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -42,6 +50,141 @@
 			((uint64_t)__clocks_lo);			\
 	} while (0)
 
+/* Same as above with RDTSCP, which waits for all the previous
+ * instructions to complete before reading the counter */
+#define get_clocks_ordered(clocks)					\
+	do {								\
+		uint32_t __clocks_hi, __clocks_lo;			\
+		__asm__ __volatile__("rdtscp" :				\
+				     "=a" (__clocks_lo),		\
+				     "=d" (__clocks_hi)			\
+				     : : "ecx"				\
+			);						\
+		clocks = (((uint64_t)__clocks_hi) << 32) |		\
+			((uint64_t)__clocks_lo);			\
+	} while (0)
+
+/* Relation between the TSC and CLOCK_MONOTONIC measured by
+ * tsc_calibrate(): at <base_clocks> the clock read <base_ns>, and every
+ * clock lasts <mult> / 2^TSC_SHIFT nanoseconds. <hz> is 0 if the TSC
+ * cannot be used. */
+#define TSC_SHIFT 32
+struct tsc_calibration {
+	uint64_t hz;
+	uint64_t base_clocks;
+	uint64_t base_ns;
+	uint64_t mult;
+};
+extern struct tsc_calibration tsc_cal;
+
+/* Measure the frequency of the TSC against CLOCK_MONOTONIC. Must be
+ * called before any other thread uses the functions below. Returns the
+ * frequency in Hz, or 0 if the TSC is not invariant or not trusted by
+ * the kernel, in which case those functions use clock_gettime(). */
+uint64_t tsc_calibrate(void);
+
+/* Duration of <clocks> TSC clocks, in nanoseconds */
+static inline uint64_t clocks_to_ns(uint64_t clocks)
+{
+	return (uint64_t)(((__uint128_t)clocks * tsc_cal.mult) >> TSC_SHIFT);
+}
+
+/* Number of TSC clocks lasting <ns> nanoseconds */
+static inline uint64_t ns_to_clocks(uint64_t ns)
+{
+	return (uint64_t)(((__uint128_t)ns << TSC_SHIFT) / tsc_cal.mult);
+}
+
+/* Current CLOCK_MONOTONIC time, in nanoseconds */
+static inline uint64_t tsc_now_ns(void)
+{
+	struct timespec now;
+	uint64_t clocks;
+
+	if (tsc_cal.hz == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (uint64_t)now.tv_sec * NANO_IN_SEC + now.tv_nsec;
+	}
+	get_clocks_ordered(clocks);
+	return tsc_cal.base_ns + clocks_to_ns(clocks - tsc_cal.base_clocks);
+}
+
+/* Nanoseconds elapsed since <start_ns>, as returned by tsc_now_ns() */
+static inline uint64_t tsc_elapsed_ns(uint64_t start_ns)
+{
+	return tsc_now_ns() - start_ns;
+}
+
+/* Busywait for <ns> nanoseconds. Returns the number of nanoseconds
+ * actually elapsed. */
+uint64_t busywait_ns(uint64_t ns);
+
+/* A point on the CLOCK_MONOTONIC timeline, or a duration, as an integer
+ * number of nanoseconds: exact, and a single word to copy, compare or
+ * subtract, where a struct timespec takes two. Turn it into seconds
+ * with nstime_to_double() only when printing it. */
+typedef uint64_t nstime_t;
+
+/* Current CLOCK_MONOTONIC time. Taken from the kernel rather than from
+ * the TSC, which keeps time with the rate measured at calibration and
+ * drifts away from the clocks of the clients over long runs. */
+static inline nstime_t nstime_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (nstime_t)now.tv_sec * NANO_IN_SEC + now.tv_nsec;
+}
+
+static inline nstime_t nstime_add(nstime_t a, nstime_t b)
+{
+	return a + b;
+}
+
+/* Time from <b> to <a>, or 0 if <b> comes later */
+static inline nstime_t nstime_sub(nstime_t a, nstime_t b)
+{
+	return (a > b) ? a - b : 0;
+}
+
+/* Same convention as timespec_cmp() */
+static inline int nstime_cmp(nstime_t a, nstime_t b)
+{
+	return (a > b) - (a < b);
+}
+
+static inline nstime_t tspec_to_nstime(struct timespec spec)
+{
+	return (nstime_t)spec.tv_sec * NANO_IN_SEC + spec.tv_nsec;
+}
+
+static inline struct timespec nstime_to_tspec(nstime_t t)
+{
+	struct timespec spec;
+
+	spec.tv_sec = t / NANO_IN_SEC;
+	spec.tv_nsec = t % NANO_IN_SEC;
+	return spec;
+}
+
+/* Seconds, rounded exactly like a struct timespec would be */
+static inline double nstime_to_double(nstime_t t)
+{
+	return (double)(t / NANO_IN_SEC) + (double)(t % NANO_IN_SEC) / NANO_IN_SEC;
+}
+
+/* Wait for <ns> nanoseconds, sleeping with clock_nanosleep() for as
+ * much of it as possible and busywaiting for the rest. Sleeps wake up
+ * late by the timer slack and the scheduling latency, so the sleep ends
+ * a margin ahead of the deadline, and the margin follows the lateness
+ * observed so far by the calling thread. Returns the number of
+ * nanoseconds actually elapsed. */
+uint64_t hybridwait_ns(uint64_t ns);
+
+/* Margin currently left to busywaiting by hybridwait_ns() in the
+ * calling thread */
+uint64_t hybridwait_margin_ns(void);
+
 /* Return the number of clock cycles elapsed when waiting for
  * wait_time seconds using sleeping functions */
 uint64_t get_elapsed_sleep(long sec, long nsec);
@@ -62,3 +205,5 @@ int timespec_cmp(struct timespec *, struct timespec *);
 
 /* Translate a double timestamp into a valid timespec */
 struct timespec dtotspec(double timestamp);
+
+#endif
@@ -0,0 +1,228 @@
+/*******************************************************************************
+* Minimal io_uring Interface (implementation)
+*
+* Description:
+*     Setup, submission and completion handling for io_uring through the raw
+*     system calls. See uring.h for the interface.
+*
+* Notes:
+*     The head of the submission ring and the tail of the completion ring
+*     are written by the kernel, the other two indexes by us, so each side
+*     reads the indexes of the other with acquire semantics and publishes
+*     its own with release semantics.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags, const sigset_t * sig)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, sig, _NSIG / 8);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Register the provided buffer ring of <ring> with the kernel */
+static int uring_setup_buffers(struct uring * ring, uint16_t bgid, unsigned count, size_t size)
+{
+	struct io_uring_buf_reg reg;
+	size_t br_len = count * sizeof(struct io_uring_buf);
+	unsigned i;
+
+	ring->br = (struct io_uring_buf_ring *)mmap(NULL, br_len, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		return -1;
+	}
+	ring->br_entries = count;
+	ring->bgid = bgid;
+	ring->buf_size = size;
+	ring->bufs = (uint8_t *)malloc(count * size);
+	if (ring->bufs == NULL)
+		return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+	reg.ring_entries = count;
+	reg.bgid = bgid;
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	/* Hand all the buffers to the kernel */
+	ring->br_tail = 0;
+	for (i = 0; i < count; i++)
+		uring_recycle_buffer(ring, i);
+
+	return 0;
+}
+
+int uring_init(struct uring * ring, unsigned entries, uint16_t bgid,
+	       unsigned count, size_t size)
+{
+	struct io_uring_params p;
+	unsigned i;
+
+	memset(ring, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Both rings may live in the same mapping */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto err;
+	}
+
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	ring->sq_head = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_array = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.array);
+	ring->sq_mask = *(unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ptr + p.cq_off.cqes);
+
+	/* SQEs are always used in order */
+	for (i = 0; i < ring->sq_entries; i++)
+		ring->sq_array[i] = i;
+
+	if (uring_setup_buffers(ring, bgid, count, size) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	uring_exit(ring);
+	return -1;
+}
+
+void uring_exit(struct uring * ring)
+{
+	int saved_errno = errno;
+
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	if (ring->br)
+		munmap(ring->br, ring->br_entries * sizeof(struct io_uring_buf));
+	free(ring->bufs);
+
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = -1;
+	errno = saved_errno;
+}
+
+unsigned uring_sq_space(struct uring * ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return ring->sq_entries - (*ring->sq_tail + ring->sq_pending - head);
+}
+
+struct io_uring_sqe * uring_get_sqe(struct uring * ring)
+{
+	struct io_uring_sqe * sqe;
+
+	if (uring_sq_space(ring) == 0)
+		return NULL;
+
+	sqe = &ring->sqes[(*ring->sq_tail + ring->sq_pending) & ring->sq_mask];
+	ring->sq_pending++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+int uring_submit_and_wait(struct uring * ring, unsigned wait_nr, const sigset_t * mask)
+{
+	unsigned to_submit = ring->sq_pending;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+				 wait_nr ? IORING_ENTER_GETEVENTS : 0, mask);
+	return ret;
+}
+
+struct io_uring_cqe * uring_peek_cqe(struct uring * ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring * ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void * uring_buffer(struct uring * ring, uint16_t bid)
+{
+	return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void uring_recycle_buffer(struct uring * ring, uint16_t bid)
+{
+	struct io_uring_buf * buf = &ring->br->bufs[ring->br_tail & (ring->br_entries - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
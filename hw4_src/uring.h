@@ -0,0 +1,140 @@
+/*******************************************************************************
+* Minimal io_uring Interface (header)
+*
+* Description:
+*     Just enough of io_uring to drive sockets from a single thread without
+*     depending on liburing: setting up the submission and completion rings,
+*     preparing the few operations the servers use, submitting and waiting
+*     in one system call, and a ring of provided buffers from which the
+*     kernel picks where to store received data.
+*
+* Notes:
+*     Only the thread that owns a ring may use it. Every function returning
+*     an int returns a negative value on failure, with errno set. Multishot
+*     accept and provided buffer rings need Linux 5.19, multishot recv 6.0;
+*     uring_init() fails on kernels without provided buffer rings, so that
+*     callers can fall back to another I/O mechanism.
+*
+*******************************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	/* Submission ring, and the SQEs prepared but not submitted */
+	unsigned * sq_head, * sq_tail, * sq_array;
+	unsigned sq_mask, sq_entries, sq_pending;
+	struct io_uring_sqe * sqes;
+	/* Completion ring */
+	unsigned * cq_head, * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+	/* Mappings of the rings */
+	void * sq_ptr, * cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	/* Provided buffers: ring, group ID and memory */
+	struct io_uring_buf_ring * br;
+	unsigned br_entries;
+	uint16_t br_tail, bgid;
+	uint8_t * bufs;
+	size_t buf_size;
+};
+
+/* Set up <ring> with room for <entries> submissions, and a group
+ * <bgid> of <count> provided buffers of <size> bytes each (<count> must
+ * be a power of two). Returns 0 on success, -1 on failure. */
+int uring_init(struct uring * ring, unsigned entries, uint16_t bgid,
+	       unsigned count, size_t size);
+
+/* Tear down <ring> and release its buffers */
+void uring_exit(struct uring * ring);
+
+/* Next free submission entry, zeroed, or NULL if the submission ring
+ * is full and must be submitted first */
+struct io_uring_sqe * uring_get_sqe(struct uring * ring);
+
+/* Number of submission entries that can still be obtained */
+unsigned uring_sq_space(struct uring * ring);
+
+/* Submit all the prepared entries and, if <wait_nr> is not 0, wait
+ * until at least that many completions are available. <mask> is the
+ * signal mask to apply while waiting, NULL to keep the current one.
+ * Returns the number of entries submitted, or -1 on failure. */
+int uring_submit_and_wait(struct uring * ring, unsigned wait_nr, const sigset_t * mask);
+
+/* Oldest unprocessed completion, or NULL if there is none. Mark it as
+ * processed with uring_cqe_seen(). */
+struct io_uring_cqe * uring_peek_cqe(struct uring * ring);
+void uring_cqe_seen(struct uring * ring);
+
+/* Memory of provided buffer <bid>, and give it back to the kernel
+ * once its content has been consumed */
+void * uring_buffer(struct uring * ring, uint16_t bid);
+void uring_recycle_buffer(struct uring * ring, uint16_t bid);
+
+/* Preparation of the operations used by the servers. <data> comes
+ * back untouched in the user_data of the completion(s). */
+static inline void uring_prep_accept_multishot(struct io_uring_sqe * sqe, int fd, uint64_t data)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = data;
+}
+
+/* Receive into a buffer of group <bgid>. When <multishot> is set, the
+ * request stays armed and completes every time data arrives. */
+static inline void uring_prep_recv(struct io_uring_sqe * sqe, int fd, uint16_t bgid,
+				   int multishot, uint64_t data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = bgid;
+	sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = data;
+}
+
+static inline void uring_prep_send(struct io_uring_sqe * sqe, int fd, const void * buf,
+				   size_t len, int flags, uint64_t data)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+}
+
+static inline void uring_prep_read(struct io_uring_sqe * sqe, int fd, void * buf,
+				   size_t len, uint64_t data)
+{
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = data;
+}
+
+/* Stays armed and completes every time <fd> becomes readable */
+static inline void uring_prep_poll_multishot(struct io_uring_sqe * sqe, int fd, uint64_t data)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+}
+
+#endif
@@ -0,0 +1,191 @@
+/*******************************************************************************
+* Worker Thread Management (implementation)
+*
+* Description:
+*     Helpers to start, pin and join the worker threads used by the servers.
+*     See worker_thread.h for the interface.
+*
+* Notes:
+*     NUMA placement is best effort: the node of a CPU is looked up in sysfs,
+*     and memory is bound to it with a preferred policy, so allocations fall
+*     back to other nodes rather than failing. On single-node machines this
+*     is a no-op.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "worker_thread.h"
+
+/* Return the NUMA node of CPU <cpu>, or -1 if it cannot be found */
+static int cpu_to_node(int cpu)
+{
+	char path[64];
+	struct dirent * entry;
+	DIR * dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "node", 4) == 0 &&
+		    sscanf(entry->d_name + 4, "%d", &node) == 1)
+			break;
+		node = -1;
+	}
+
+	closedir(dir);
+	return node;
+}
+
+/* Map <len> bytes of anonymous memory, preferably on the node of <cpu> */
+static void * map_local(size_t len, int cpu, int flags)
+{
+	unsigned long nodemask;
+	int node = (cpu >= 0) ? cpu_to_node(cpu) : -1;
+	void * ptr;
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	/* Must happen before the pages are first touched */
+	if (node >= 0 && node < (int)(8 * sizeof(nodemask))) {
+		nodemask = 1UL << node;
+		syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, &nodemask,
+			8 * sizeof(nodemask), 0);
+	}
+
+	return ptr;
+}
+
+void * worker_alloc(size_t size, int cpu)
+{
+	return map_local(size, cpu, 0);
+}
+
+void worker_free(void * ptr, size_t size)
+{
+	if (ptr)
+		munmap(ptr, size);
+}
+
+/* First function run by every new thread: pin it, then hand over */
+static void * worker_thread_entry(void * arg)
+{
+	struct worker_thread * thread = (struct worker_thread *)arg;
+	cpu_set_t set;
+
+	if (thread->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(thread->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			perror("Unable to pin worker thread");
+	}
+
+	thread->fn(thread->arg);
+	return NULL;
+}
+
+int worker_thread_start(struct worker_thread * thread, int (*fn)(void *),
+			void * arg, int cpu)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	pthread_attr_t attr;
+	int retval;
+
+	thread->fn = fn;
+	thread->arg = arg;
+	thread->cpu = cpu;
+	thread->stack_len = WORKER_STACK_SIZE + page;
+	thread->stack = map_local(thread->stack_len, cpu, MAP_STACK);
+	if (thread->stack == NULL)
+		return -1;
+
+	/* Stacks grow down: make the lowest page the guard */
+	if (mprotect(thread->stack, page, PROT_NONE) < 0) {
+		munmap(thread->stack, thread->stack_len);
+		thread->stack = NULL;
+		return -1;
+	}
+
+	/* The thread-local storage is carved out of the stack too */
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, (uint8_t *)thread->stack + page, WORKER_STACK_SIZE);
+	retval = pthread_create(&thread->handle, &attr, worker_thread_entry, thread);
+	pthread_attr_destroy(&attr);
+
+	if (retval != 0) {
+		munmap(thread->stack, thread->stack_len);
+		thread->stack = NULL;
+		errno = retval;
+		return -1;
+	}
+
+	return 0;
+}
+
+void worker_thread_join(struct worker_thread * thread)
+{
+	if (thread->stack == NULL)
+		return;
+
+	pthread_join(thread->handle, NULL);
+	munmap(thread->stack, thread->stack_len);
+	thread->stack = NULL;
+}
+
+void worker_thread_kill(struct worker_thread * thread, int signo)
+{
+	if (thread->stack)
+		pthread_kill(thread->handle, signo);
+}
+
+int parse_cpu_list(const char * list, int * cpus, int max)
+{
+	const char * p = list;
+	char * end;
+	long first, last, cpu;
+	int count = 0;
+
+	while (*p) {
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return -1;
+		last = first;
+		p = end;
+
+		if (*p == '-') {
+			last = strtol(++p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+			p = end;
+		}
+
+		for (cpu = first; cpu <= last && count < max; cpu++)
+			cpus[count++] = cpu;
+
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+
+	return count;
+}
@@ -0,0 +1,69 @@
+/*******************************************************************************
+* Worker Thread Management (header)
+*
+* Description:
+*     Helpers to start, pin and join the worker threads used by the servers.
+*     Every thread runs on its own mmap'd stack with a guard page
+*     below it, so that an overflow faults right away instead of silently
+*     corrupting the heap, and can optionally be pinned to a CPU. Memory for
+*     per-worker state can be allocated on the NUMA node of that CPU.
+*
+* Notes:
+*     Threads are created through pthreads on the stack we provide rather
+*     than with a bare clone(): the C library keeps per-thread state (the
+*     malloc caches, errno) in thread-local storage, which a bare clone()
+*     shares with its parent, so that two threads allocating memory at the
+*     same time corrupt the heap.
+*
+*******************************************************************************/
+
+#ifndef WORKER_THREAD_H
+#define WORKER_THREAD_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Default size of a worker stack, guard page excluded. Pages are only
+ * backed by memory once they are touched. */
+#define WORKER_STACK_SIZE (256 * 1024)
+
+struct worker_thread {
+	/* Start of the mapping, guard page included, and its length */
+	void * stack;
+	size_t stack_len;
+	pthread_t handle;
+	/* CPU the thread is pinned to, -1 if it can run anywhere */
+	int cpu;
+	/* Entry point and its argument */
+	int (*fn)(void *);
+	void * arg;
+};
+
+/* Start a thread that runs <fn>(<arg>) on a fresh stack of
+ * WORKER_STACK_SIZE bytes. When <cpu> is not negative, the thread pins
+ * itself to that CPU before calling <fn> and its stack is allocated on
+ * the CPU's NUMA node. Returns 0 on success, -1 on error. */
+int worker_thread_start(struct worker_thread * thread, int (*fn)(void *),
+			void * arg, int cpu);
+
+/* Wait for the thread to exit and release its stack */
+void worker_thread_join(struct worker_thread * thread);
+
+/* Send signal <signo> to the thread, if it is running */
+void worker_thread_kill(struct worker_thread * thread, int signo);
+
+/* Allocate <size> bytes of zeroed, page-aligned memory, preferably on
+ * the NUMA node of <cpu> (anywhere if <cpu> is negative). Returns NULL
+ * on error. */
+void * worker_alloc(size_t size, int cpu);
+
+/* Release memory obtained from worker_alloc() */
+void worker_free(void * ptr, size_t size);
+
+/* Parse a CPU list such as "0-3,8,10-11" into at most <max> entries of
+ * <cpus>. Returns the number of CPUs parsed, or -1 if the list is
+ * malformed. */
+int parse_cpu_list(const char * list, int * cpus, int max);
+
+#endif
@@ -0,0 +1,306 @@
+/*******************************************************************************
+* Synthetic Workload Engine (implementation)
+*
+* Description:
+*     The service kernels and their calibration. See workload.h for the
+*     interface.
+*
+* Notes:
+*     Units are sized so that one takes microseconds: small enough for
+*     requests of a few microseconds to be served accurately, large enough
+*     for the bookkeeping around a unit not to matter. The chase visits
+*     one cache line after the other in an order built with Sattolo's
+*     algorithm, i.e. along a single cycle through all the lines, so that
+*     the hardware prefetchers cannot guess the next line and the chase
+*     never gets stuck in a short loop that fits in the caches.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "common.h"
+#include "mpmc.h"
+#include "workload.h"
+#include "worker_thread.h"
+
+/* Side of the gemm matrices: a unit multiplies two of them */
+#define GEMM_N 16
+
+/* Loads per chase unit, bytes per copy unit, bytes per hash unit */
+#define CHASE_LOADS 64
+#define COPY_BYTES  (64 * 1024)
+#define HASH_BYTES  (4 * 1024)
+
+/* Calibration times every kernel CALIBRATION_RUNS times for at least
+ * CALIBRATION_NS (10 ms) each, and keeps the fastest run: interruptions
+ * only ever make a run slower */
+#define CALIBRATION_NS (10 * 1000 * 1000)
+#define CALIBRATION_RUNS 5
+
+/* A cache line of the chase, pointing to the next one */
+struct workload_line {
+	uint32_t next;
+	uint8_t pad[CACHE_LINE_SIZE - sizeof(uint32_t)];
+};
+
+static const char * names[WORKLOAD_NUM_KERNELS] = {
+	"busy", "gemm", "chase", "copy", "hash"
+};
+
+const char * workload_name(int kernel)
+{
+	return names[kernel];
+}
+
+int workload_parse(struct workload * wl, const char * mix, size_t working_set)
+{
+	char * copy, * name, * save;
+	int kernel;
+
+	memset(wl, 0, sizeof(struct workload));
+	wl->working_set = working_set;
+	/* Both halves of the copy kernel need room for a unit */
+	if (working_set < 2 * COPY_BYTES)
+		return -1;
+
+	copy = strdup(mix);
+	if (copy == NULL)
+		return -1;
+	for (name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		for (kernel = 0; kernel < WORKLOAD_NUM_KERNELS; kernel++)
+			if (strcmp(name, names[kernel]) == 0)
+				break;
+		if (kernel == WORKLOAD_NUM_KERNELS || wl->mix_len == WORKLOAD_MAX_MIX) {
+			free(copy);
+			return -1;
+		}
+		wl->mix[wl->mix_len++] = kernel;
+	}
+	free(copy);
+
+	wl->avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	return (wl->mix_len > 0) ? 0 : -1;
+}
+
+/* C = A * B, eight columns of C at a time */
+__attribute__((target("avx2,fma")))
+static void gemm_avx2(const float * a, const float * b, float * c)
+{
+	__m256 acc;
+	int i, j, k;
+
+	for (i = 0; i < GEMM_N; i++) {
+		for (j = 0; j < GEMM_N; j += 8) {
+			acc = _mm256_setzero_ps();
+			for (k = 0; k < GEMM_N; k++)
+				acc = _mm256_fmadd_ps(_mm256_set1_ps(a[i * GEMM_N + k]),
+						      _mm256_loadu_ps(&b[k * GEMM_N + j]), acc);
+			_mm256_storeu_ps(&c[i * GEMM_N + j], acc);
+		}
+	}
+}
+
+/* Same as above, four columns at a time */
+static void gemm_sse(const float * a, const float * b, float * c)
+{
+	__m128 acc;
+	int i, j, k;
+
+	for (i = 0; i < GEMM_N; i++) {
+		for (j = 0; j < GEMM_N; j += 4) {
+			acc = _mm_setzero_ps();
+			for (k = 0; k < GEMM_N; k++)
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(a[i * GEMM_N + k]),
+								 _mm_loadu_ps(&b[k * GEMM_N + j])));
+			_mm_storeu_ps(&c[i * GEMM_N + j], acc);
+		}
+	}
+}
+
+static void run_gemm(struct workload_ctx * ctx, uint64_t units)
+{
+	uint64_t u;
+
+	for (u = 0; u < units; u++) {
+		if (ctx->wl->avx2)
+			gemm_avx2(ctx->a, ctx->b, ctx->c);
+		else
+			gemm_sse(ctx->a, ctx->b, ctx->c);
+	}
+}
+
+static void run_chase(struct workload_ctx * ctx, uint64_t units)
+{
+	uint32_t pos = ctx->pos;
+	uint64_t u;
+	int i;
+
+	for (u = 0; u < units; u++)
+		for (i = 0; i < CHASE_LOADS; i++)
+			pos = ctx->lines[pos].next;
+	ctx->pos = pos;
+}
+
+static void run_copy(struct workload_ctx * ctx, uint64_t units)
+{
+	uint64_t u;
+
+	for (u = 0; u < units; u++) {
+		if (ctx->offset + COPY_BYTES > ctx->half)
+			ctx->offset = 0;
+		memcpy(ctx->dst + ctx->offset, ctx->src + ctx->offset, COPY_BYTES);
+		ctx->offset += COPY_BYTES;
+	}
+}
+
+/* Multiply-xorshift mixing, as in the finalizer of MurmurHash3 */
+static void run_hash(struct workload_ctx * ctx, uint64_t units)
+{
+	uint64_t u, h = ctx->hash;
+	size_t i;
+
+	for (u = 0; u < units; u++) {
+		for (i = 0; i < HASH_BYTES / sizeof(uint64_t); i++) {
+			h ^= ctx->words[i];
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+		}
+	}
+	ctx->hash = h;
+}
+
+static void run_units(struct workload_ctx * ctx, int kernel, uint64_t units)
+{
+	switch (kernel) {
+	case WORKLOAD_GEMM:
+		run_gemm(ctx, units);
+		break;
+	case WORKLOAD_CHASE:
+		run_chase(ctx, units);
+		break;
+	case WORKLOAD_COPY:
+		run_copy(ctx, units);
+		break;
+	case WORKLOAD_HASH:
+		run_hash(ctx, units);
+		break;
+	}
+}
+
+int workload_ctx_init(struct workload_ctx * ctx, const struct workload * wl, int cpu)
+{
+	size_t gemm_len = 3 * GEMM_N * GEMM_N * sizeof(float);
+	uint8_t * mem;
+	unsigned seed = 1;
+	uint32_t j, tmp;
+	size_t i;
+
+	memset(ctx, 0, sizeof(struct workload_ctx));
+	ctx->wl = wl;
+
+	/* gemm matrices and hash input, then the working sets of chase
+	 * and copy */
+	ctx->mem_len = gemm_len + HASH_BYTES + 2 * wl->working_set;
+	ctx->mem = worker_alloc(ctx->mem_len, cpu);
+	if (ctx->mem == NULL)
+		return -1;
+	mem = (uint8_t *)ctx->mem;
+
+	ctx->a = (float *)mem;
+	ctx->b = ctx->a + GEMM_N * GEMM_N;
+	ctx->c = ctx->b + GEMM_N * GEMM_N;
+	for (i = 0; i < GEMM_N * GEMM_N; i++) {
+		ctx->a[i] = (float)(i % 7) / 8;
+		ctx->b[i] = (float)(i % 5) / 4;
+	}
+
+	ctx->words = (uint64_t *)(mem + gemm_len);
+	for (i = 0; i < HASH_BYTES / sizeof(uint64_t); i++)
+		ctx->words[i] = i * 0x9e3779b97f4a7c15ULL;
+
+	/* Sattolo's algorithm: a random permutation made of a single
+	 * cycle. Also touches the whole working set. */
+	ctx->lines = (struct workload_line *)(mem + gemm_len + HASH_BYTES);
+	ctx->num_lines = wl->working_set / sizeof(struct workload_line);
+	for (i = 0; i < ctx->num_lines; i++)
+		ctx->lines[i].next = i;
+	for (i = ctx->num_lines - 1; i > 0; i--) {
+		j = (uint32_t)(((uint64_t)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % i);
+		tmp = ctx->lines[i].next;
+		ctx->lines[i].next = ctx->lines[j].next;
+		ctx->lines[j].next = tmp;
+	}
+
+	/* Copies go from one half of the working set to the other */
+	ctx->src = (uint8_t *)ctx->lines + wl->working_set;
+	ctx->half = wl->working_set / 2;
+	memset(ctx->src, 0x5a, wl->working_set);
+	ctx->dst = ctx->src + ctx->half;
+	return 0;
+}
+
+void workload_ctx_free(struct workload_ctx * ctx)
+{
+	worker_free(ctx->mem, ctx->mem_len);
+	ctx->mem = NULL;
+}
+
+uint64_t workload_run(struct workload_ctx * ctx, int kernel, uint64_t ns)
+{
+	uint64_t units;
+
+	if (kernel == WORKLOAD_BUSY) {
+		busywait_ns(ns);
+		return 0;
+	}
+
+	ctx->owed[kernel] += ns / ctx->wl->ns_per_unit[kernel];
+	units = (uint64_t)ctx->owed[kernel];
+	ctx->owed[kernel] -= units;
+	run_units(ctx, kernel, units);
+	return units;
+}
+
+int workload_calibrate(struct workload * wl)
+{
+	struct workload_ctx ctx;
+	uint64_t units, start, elapsed, best;
+	int i, run, kernel;
+
+	if (workload_ctx_init(&ctx, wl, -1) < 0)
+		return -1;
+
+	for (i = 0; i < wl->mix_len; i++) {
+		kernel = wl->mix[i];
+		if (kernel == WORKLOAD_BUSY || wl->ns_per_unit[kernel] > 0)
+			continue;
+
+		/* Warm up, then double the units until they take long
+		 * enough to be timed accurately */
+		run_units(&ctx, kernel, 1);
+		for (units = 1; ; units *= 2) {
+			start = nstime_now();
+			run_units(&ctx, kernel, units);
+			elapsed = nstime_now() - start;
+			if (elapsed >= CALIBRATION_NS)
+				break;
+		}
+		best = elapsed;
+		for (run = 1; run < CALIBRATION_RUNS; run++) {
+			start = nstime_now();
+			run_units(&ctx, kernel, units);
+			elapsed = nstime_now() - start;
+			if (elapsed < best)
+				best = elapsed;
+		}
+		wl->ns_per_unit[kernel] = (double)best / units;
+	}
+
+	workload_ctx_free(&ctx);
+	return 0;
+}
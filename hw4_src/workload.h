@@ -0,0 +1,108 @@
+/*******************************************************************************
+* Synthetic Workload Engine (header)
+*
+* Description:
+*     Service kernels that make serving a request stress the same parts of
+*     the machine as real work, instead of only burning cycles: single-
+*     precision matrix multiplications on the SIMD units (gemm), dependent
+*     loads over a working set in random order (chase), streaming copies
+*     through a working set (copy), and integer hashing of a cache-resident
+*     buffer (hash). Each kernel runs in units of fixed work, and the time
+*     a unit takes on an otherwise idle machine is measured at startup, so
+*     that serving a request of length L runs L worth of units. When
+*     workers contend for memory bandwidth, caches or execution units,
+*     units take longer and so do the requests.
+*
+* Notes:
+*     chase and copy each have a working set of their own in every worker,
+*     so that running more workers means touching more memory. The gemm
+*     kernel uses AVX2 and FMA when the CPU has them, and SSE2, which
+*     every x86-64 CPU has, otherwise. Every function returning an int
+*     returns a negative value on failure.
+*
+*******************************************************************************/
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Service kernels */
+#define WORKLOAD_BUSY  0 /* Busywait, as without the engine */
+#define WORKLOAD_GEMM  1 /* Matrix multiplication, SIMD-bound */
+#define WORKLOAD_CHASE 2 /* Pointer chasing, latency-bound */
+#define WORKLOAD_COPY  3 /* memcpy(), bandwidth-bound */
+#define WORKLOAD_HASH  4 /* Hashing, integer-bound */
+#define WORKLOAD_NUM_KERNELS 5
+
+/* Most kernels a mix may list */
+#define WORKLOAD_MAX_MIX 8
+
+/* Default size of the working sets of every worker */
+#define WORKLOAD_DEFAULT_WSS (8 * 1024 * 1024)
+
+/* Configuration shared by all the workers, read-only once calibrated */
+struct workload {
+	/* Kernels of the mix: a request runs mix[req_id % mix_len] */
+	int mix[WORKLOAD_MAX_MIX];
+	int mix_len;
+	size_t working_set;
+	/* Nanoseconds a unit of every kernel takes on an idle machine */
+	double ns_per_unit[WORKLOAD_NUM_KERNELS];
+	/* Whether the gemm kernel uses AVX2 and FMA */
+	int avx2;
+};
+
+/* Private state of a worker */
+struct workload_ctx {
+	const struct workload * wl;
+	/* gemm: C = A * B */
+	float * a, * b, * c;
+	/* chase: cache lines linked in one random cycle, and where the
+	 * chase stands */
+	struct workload_line * lines;
+	size_t num_lines;
+	uint32_t pos;
+	/* copy: the two halves of its working set, and where the next
+	 * copy goes */
+	uint8_t * src, * dst;
+	size_t half, offset;
+	/* hash: input, and the running hash */
+	uint64_t * words;
+	uint64_t hash;
+	/* Fractions of units owed to every kernel, so that requests
+	 * shorter than a unit still run the right amount on average */
+	double owed[WORKLOAD_NUM_KERNELS];
+	/* Where all the allocations live */
+	void * mem;
+	size_t mem_len;
+};
+
+/* Parse a mix such as "gemm,chase" into <wl>, with working sets of
+ * <working_set> bytes per worker */
+int workload_parse(struct workload * wl, const char * mix, size_t working_set);
+
+/* Measure the time a unit of every kernel of the mix takes. Must be
+ * called before any worker uses <wl>, while the machine is idle. */
+int workload_calibrate(struct workload * wl);
+
+/* Set up the state of a worker pinned to <cpu> (-1 if not pinned),
+ * allocated on the NUMA node of that CPU */
+int workload_ctx_init(struct workload_ctx * ctx, const struct workload * wl, int cpu);
+void workload_ctx_free(struct workload_ctx * ctx);
+
+/* Kernel that serves the request with ID <req_id> */
+static inline int workload_kernel(const struct workload * wl, uint64_t req_id)
+{
+	return wl->mix[req_id % wl->mix_len];
+}
+
+/* Run kernel <kernel> for <ns> nanoseconds worth of units. Returns
+ * the number of units run. */
+uint64_t workload_run(struct workload_ctx * ctx, int kernel, uint64_t ns);
+
+/* Name of kernel <kernel> */
+const char * workload_name(int kernel);
+
+#endif